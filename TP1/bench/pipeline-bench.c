@@ -0,0 +1,402 @@
+/*
+ * filter and pipeline throughput on synthetic frames generated in memory, every filter of filter.h is timed on its
+ * own and every pipeline backend end to end with image_dir_hooks_t in place of the files, so neither disk nor PNG
+ * decoding and encoding are part of the numbers
+ *
+ * every measure is `frames` frames, repeated after `warmup` untimed runs, the median and the best run are
+ * reported in frames/s and in MB/s of input pixels
+ *
+ * pipeline-bench-notbb is built without pipeline-tbb.cpp, the tbb backend is then left out like in pipeline-notbb
+ */
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "filter.h"
+#include "image.h"
+#include "log.h"
+#include "pipeline.h"
+
+#define MAX_SIZES 16
+
+/* only defined when pipeline-tbb.cpp is linked in, NULL otherwise */
+#pragma weak pipeline_tbb
+
+typedef struct frame_size {
+    size_t width;
+    size_t height;
+} frame_size_t;
+
+typedef struct bench {
+    size_t frames;
+    size_t repeat;
+    size_t warmup;
+    const char* filters;   /* comma separated names, "all" or "none" */
+    const char* pipelines; /* same */
+} bench_t;
+
+typedef struct source {
+    image_t* frame;
+    size_t count;
+    size_t loaded;
+    atomic_size_t saved;
+} source_t;
+
+static image_t* scale_up_2(image_t* image) {
+    return filter_scale_up(image, 2);
+}
+
+static image_t* scale_sharpen_sobel(image_t* image) {
+    return filter_scale_sharpen_sobel(image, 2);
+}
+
+static image_t* add_pixel(image_t* image) {
+    pixel_t pixel = {{16, 32, 64, 0}};
+    return filter_add_pixel(image, &pixel);
+}
+
+static const struct {
+    const char* name;
+    image_t* (*filter)(image_t* image);
+} filters[] = {
+    {"scale_up", scale_up_2},
+    {"sharpen", filter_sharpen},
+    {"sobel", filter_sobel},
+    {"scale_sharpen_sobel", scale_sharpen_sobel},
+    {"to_hsv", filter_to_hsv},
+    {"to_rgb", filter_to_rgb},
+    {"add_pixel", add_pixel},
+    {"desaturate", filter_desaturate},
+    {"edge_identity", filter_edge_identity},
+    {"edge_detect", filter_edge_detect},
+    {"box_blur", filter_box_blur},
+    {"gaussian_blur", filter_gaussian_blur},
+    {"horizontal_flip", filter_horizontal_flip},
+    {"vertical_flip", filter_vertical_flip},
+};
+
+static const struct {
+    const char* name;
+    int (*pipeline)(image_dir_t* image_dir);
+} pipelines[] = {
+    {"serial", pipeline_serial},
+    {"pthread", pipeline_pthread},
+    {"tbb", pipeline_tbb},
+    {"steal", pipeline_steal},
+};
+
+#define NB_FILTERS (sizeof(filters) / sizeof(filters[0]))
+#define NB_PIPELINES (sizeof(pipelines) / sizeof(pipelines[0]))
+
+static void show_help(FILE* f, const char* exec_name) {
+    fprintf(f, "Usage: %s [OPTION]...\n", exec_name);
+    fprintf(f, "\n");
+    fprintf(f, "Options:\n");
+    fprintf(f, "  --size WxH[,WxH]...  frame sizes (default: 640x480,1920x1080)\n");
+    fprintf(f, "  --frames N           frames per timed run (default: 32)\n");
+    fprintf(f, "  --repeat N           timed runs per measure (default: 5)\n");
+    fprintf(f, "  --warmup N           untimed runs before them (default: 1)\n");
+    fprintf(f, "  --filters LIST       filters to time, comma separated, all or none (default: all)\n");
+    fprintf(f, "  --pipelines LIST     pipelines to time, comma separated, all or none (default: all)\n");
+    fprintf(f, "\n");
+    fprintf(f, "Filters:");
+    for (size_t k = 0; k < NB_FILTERS; k++) {
+        fprintf(f, " %s", filters[k].name);
+    }
+    fprintf(f, "\nPipelines:");
+    for (size_t k = 0; k < NB_PIPELINES; k++) {
+        if (pipelines[k].pipeline != NULL) {
+            fprintf(f, " %s", pipelines[k].name);
+        }
+    }
+    fprintf(f, "\n");
+}
+
+static size_t parse_size(const char* exec_name, const char* opt, const char* arg, bool allow_zero) {
+    char* end;
+    unsigned long value = strtoul(arg, &end, 10);
+    if (end == arg || *end != '\0' || arg[0] == '-' || (value == 0 && !allow_zero)) {
+        fprintf(stderr, "%s: invalid number '%s' for option `%s`\n", exec_name, arg, opt);
+        exit(1);
+    }
+
+    return value;
+}
+
+static size_t parse_frame_sizes(const char* exec_name, const char* arg, frame_size_t* sizes) {
+    size_t count      = 0;
+    const char* token = arg;
+
+    while (1) {
+        char* end;
+        unsigned long width  = strtoul(token, &end, 10);
+        unsigned long height = 0;
+        if (*end == 'x') {
+            height = strtoul(end + 1, &end, 10);
+        }
+
+        if (width < 3 || height < 3 || (*end != ',' && *end != '\0') || count == MAX_SIZES) {
+            fprintf(stderr, "%s: invalid frame sizes '%s' for option `--size`\n", exec_name, arg);
+            exit(1);
+        }
+
+        sizes[count++] = (frame_size_t){.width = width, .height = height};
+        if (*end == '\0') {
+            return count;
+        }
+        token = end + 1;
+    }
+}
+
+static bool selected(const char* list, const char* name) {
+    if (strcmp(list, "all") == 0) {
+        return true;
+    }
+
+    size_t length = strlen(name);
+    for (const char* token = list; *token != '\0'; token += strcspn(token, ",")) {
+        if (*token == ',') {
+            token++;
+        }
+        if (strncmp(token, name, length) == 0 && (token[length] == ',' || token[length] == '\0')) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* smooth gradients under xorshift noise, the 3x3 kernels and the HSV conversion see every kind of pixel */
+
+static image_t* synthetic_frame(size_t width, size_t height) {
+    image_t* image = image_create(0, width, height);
+    if (image == NULL) {
+        return NULL;
+    }
+
+    uint32_t state = 2463534242u;
+    for (size_t j = 0; j < height; j++) {
+        for (size_t i = 0; i < width; i++) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+
+            pixel_t* pixel  = image_get_pixel(image, i, j);
+            pixel->bytes[0] = (i * 255 / width + (state & 0x1f)) & 0xff;
+            pixel->bytes[1] = (j * 255 / height + ((state >> 8) & 0x1f)) & 0xff;
+            pixel->bytes[2] = ((i + j) * 127 / (width + height) + ((state >> 16) & 0x3f)) & 0xff;
+            pixel->bytes[3] = 255;
+        }
+    }
+
+    return image;
+}
+
+static image_t* source_load(image_dir_t* image_dir) {
+    source_t* source = image_dir->hooks->arg;
+    if (source->loaded == source->count) {
+        return NULL;
+    }
+
+    image_t* image = image_create(0, source->frame->width, source->frame->height);
+    if (image == NULL) {
+        return NULL;
+    }
+
+    memcpy(image->pixels, source->frame->pixels, image->width * image->height * sizeof(*image->pixels));
+    source->loaded++;
+    return image;
+}
+
+static int source_save(image_dir_t* image_dir, image_t* image) {
+    source_t* source = image_dir->hooks->arg;
+
+    /* image_dir_load_next() numbers the frames of the source from 0 */
+
+    if (image->id >= source->count) {
+        LOG_ERROR("saved image %zu was never loaded", image->id);
+        return -1;
+    }
+
+    atomic_fetch_add(&source->saved, 1);
+    return 0;
+}
+
+/* the pipelines print their progress on stdout, it goes to /dev/null while they run */
+
+static int mute_stdout(void) {
+    fflush(stdout);
+
+    int saved = dup(STDOUT_FILENO);
+    int null  = open("/dev/null", O_WRONLY);
+    if (saved < 0 || null < 0) {
+        LOG_ERROR_ERRNO("open");
+        exit(1);
+    }
+
+    dup2(null, STDOUT_FILENO);
+    close(null);
+    return saved;
+}
+
+static void unmute_stdout(int saved) {
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+static int run_filter(size_t k, image_t* frame, size_t count, double* elapsed) {
+    double start = now();
+
+    for (size_t n = 0; n < count; n++) {
+        image_t* image = filters[k].filter(frame);
+        if (image == NULL) {
+            return -1;
+        }
+        image_destroy(image);
+    }
+
+    *elapsed = now() - start;
+    return 0;
+}
+
+static int run_pipeline(size_t k, image_t* frame, size_t count, double* elapsed) {
+    source_t source = {.frame = frame, .count = count, .loaded = 0};
+    atomic_init(&source.saved, 0);
+
+    image_dir_hooks_t hooks = {.load = source_load, .save = source_save, .arg = &source};
+    image_dir_t image_dir   = {.output_format = IMAGE_FORMAT_PNG, .hooks = &hooks};
+    image_dir_reset(&image_dir, "", "", pipelines[k].name);
+
+    int saved_stdout = mute_stdout();
+    double start     = now();
+    int ret          = pipelines[k].pipeline(&image_dir);
+    *elapsed         = now() - start;
+    unmute_stdout(saved_stdout);
+
+    if (ret < 0 || atomic_load(&source.saved) != count) {
+        LOG_ERROR("pipeline %s saved %zu of %zu frames", pipelines[k].name, atomic_load(&source.saved), count);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+typedef int (*run_t)(size_t k, image_t* frame, size_t count, double* elapsed);
+
+static int measure(const bench_t* bench, const char* kind, const char* name, run_t run, size_t k, image_t* frame) {
+    double elapsed[bench->repeat];
+
+    for (size_t r = 0; r < bench->warmup + bench->repeat; r++) {
+        double time;
+        if (run(k, frame, bench->frames, &time) < 0) {
+            return -1;
+        }
+        if (r >= bench->warmup) {
+            elapsed[r - bench->warmup] = time;
+        }
+    }
+
+    qsort(elapsed, bench->repeat, sizeof(*elapsed), compare_double);
+
+    double median = elapsed[bench->repeat / 2];
+    double best   = elapsed[0];
+    double mbytes = bench->frames * frame->width * frame->height * sizeof(pixel_t) / 1e6;
+
+    char size[32];
+    snprintf(size, sizeof(size), "%zux%zu", frame->width, frame->height);
+
+    printf("%-9s %-20s %-10s %12.2f %12.2f %12.2f %12.2f\n", kind, name, size, bench->frames / median,
+           bench->frames / best, mbytes / median, mbytes / best);
+    fflush(stdout);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    char* exec_name = argv[0];
+    frame_size_t sizes[MAX_SIZES];
+    size_t nb_sizes = 2;
+    bench_t bench   = {
+        .frames    = 32,
+        .repeat    = 5,
+        .warmup    = 1,
+        .filters   = "all",
+        .pipelines = "all",
+    };
+
+    sizes[0] = (frame_size_t){.width = 640, .height = 480};
+    sizes[1] = (frame_size_t){.width = 1920, .height = 1080};
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp("--help", argv[i]) == 0) {
+            show_help(stdout, exec_name);
+            exit(0);
+        } else if (i + 1 >= argc) {
+            show_help(stderr, exec_name);
+            exit(1);
+        } else if (strcmp("--size", argv[i]) == 0) {
+            nb_sizes = parse_frame_sizes(exec_name, argv[i + 1], sizes);
+        } else if (strcmp("--frames", argv[i]) == 0) {
+            bench.frames = parse_size(exec_name, argv[i], argv[i + 1], false);
+        } else if (strcmp("--repeat", argv[i]) == 0) {
+            bench.repeat = parse_size(exec_name, argv[i], argv[i + 1], false);
+        } else if (strcmp("--warmup", argv[i]) == 0) {
+            bench.warmup = parse_size(exec_name, argv[i], argv[i + 1], true);
+        } else if (strcmp("--filters", argv[i]) == 0) {
+            bench.filters = argv[i + 1];
+        } else if (strcmp("--pipelines", argv[i]) == 0) {
+            bench.pipelines = argv[i + 1];
+        } else {
+            show_help(stderr, exec_name);
+            exit(1);
+        }
+        i++;
+    }
+
+    printf("%-9s %-20s %-10s %12s %12s %12s %12s\n", "kind", "name", "size", "frames/s", "best", "MB/s", "best");
+
+    for (size_t s = 0; s < nb_sizes; s++) {
+        image_t* frame = synthetic_frame(sizes[s].width, sizes[s].height);
+        if (frame == NULL) {
+            return 1;
+        }
+
+        for (size_t k = 0; k < NB_FILTERS; k++) {
+            if (selected(bench.filters, filters[k].name) &&
+                measure(&bench, "filter", filters[k].name, run_filter, k, frame) < 0) {
+                LOG_ERROR("couldn't run filter %s", filters[k].name);
+                return 1;
+            }
+        }
+
+        for (size_t k = 0; k < NB_PIPELINES; k++) {
+            if (pipelines[k].pipeline != NULL && selected(bench.pipelines, pipelines[k].name) &&
+                measure(&bench, "pipeline", pipelines[k].name, run_pipeline, k, frame) < 0) {
+                return 1;
+            }
+        }
+
+        image_destroy(frame);
+    }
+
+    return 0;
+}
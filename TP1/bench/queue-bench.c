@@ -0,0 +1,169 @@
+/*
+ * queue throughput under 1..N producers and 1..N consumers, built once with source/queue.c (queue-bench) and
+ * once with bench/queue-mutex.c (queue-bench-mutex) so both implementations run the exact same workload
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "queue.h"
+
+typedef struct bench {
+    queue_t* queue;
+    size_t items_per_producer;
+    size_t batch;
+} bench_t;
+
+static void show_help(FILE* f, const char* exec_name) {
+    fprintf(f, "Usage: %s [OPTION]...\n", exec_name);
+    fprintf(f, "\n");
+    fprintf(f, "Options:\n");
+    fprintf(f, "  --threads N   up to N producers and N consumers (default: number of cpus)\n");
+    fprintf(f, "  --items N     items pushed per run (default: 1000000)\n");
+    fprintf(f, "  --size N      queue capacity (default: 10)\n");
+    fprintf(f, "  --batch N     items per queue_push_many/queue_pop_many call (default: 1)\n");
+}
+
+static size_t parse_size(const char* exec_name, const char* opt, const char* arg) {
+    char* end;
+    unsigned long value = strtoul(arg, &end, 10);
+    if (end == arg || *end != '\0' || value == 0) {
+        fprintf(stderr, "%s: invalid number '%s' for option `%s`\n", exec_name, arg, opt);
+        exit(1);
+    }
+
+    return value;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void* producer(void* arg) {
+    bench_t* bench = arg;
+    void* items[bench->batch];
+
+    for (size_t i = 0; i < bench->items_per_producer; i += bench->batch) {
+        size_t count = bench->items_per_producer - i;
+        if (count > bench->batch) {
+            count = bench->batch;
+        }
+
+        for (size_t k = 0; k < count; k++) {
+            items[k] = (void*)(uintptr_t)(i + k + 1);
+        }
+
+        queue_push_many(bench->queue, items, count);
+    }
+
+    return NULL;
+}
+
+static void* consumer(void* arg) {
+    bench_t* bench = arg;
+    void* items[bench->batch];
+
+    /* NULL is the last item pushed, it is put back for the next consumer */
+
+    while (1) {
+        size_t count = queue_pop_many(bench->queue, items, bench->batch);
+
+        for (size_t k = 0; k < count; k++) {
+            if (items[k] == NULL) {
+                queue_push(bench->queue, NULL);
+                return NULL;
+            }
+        }
+    }
+}
+
+static int run(size_t producers, size_t consumers, size_t items, size_t size, size_t batch, double* elapsed) {
+    bench_t bench = {
+        .queue              = queue_create(size),
+        .items_per_producer = items / producers,
+        .batch              = batch,
+    };
+    if (bench.queue == NULL) {
+        return -1;
+    }
+
+    pthread_t threads[producers + consumers];
+
+    double start = now();
+
+    for (size_t i = 0; i < consumers; i++) {
+        pthread_create(&threads[producers + i], NULL, consumer, &bench);
+    }
+    for (size_t i = 0; i < producers; i++) {
+        pthread_create(&threads[i], NULL, producer, &bench);
+    }
+
+    for (size_t i = 0; i < producers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    queue_push(bench.queue, NULL);
+    for (size_t i = 0; i < consumers; i++) {
+        pthread_join(threads[producers + i], NULL);
+    }
+
+    *elapsed = now() - start;
+
+    queue_destroy(bench.queue);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    char* exec_name = argv[0];
+    size_t threads  = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t items    = 1000000;
+    size_t size     = 10;
+    size_t batch    = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp("--help", argv[i]) == 0) {
+            show_help(stdout, exec_name);
+            exit(0);
+        } else if (i + 1 >= argc) {
+            show_help(stderr, exec_name);
+            exit(1);
+        } else if (strcmp("--threads", argv[i]) == 0) {
+            threads = parse_size(exec_name, argv[i], argv[i + 1]);
+        } else if (strcmp("--items", argv[i]) == 0) {
+            items = parse_size(exec_name, argv[i], argv[i + 1]);
+        } else if (strcmp("--size", argv[i]) == 0) {
+            size = parse_size(exec_name, argv[i], argv[i + 1]);
+        } else if (strcmp("--batch", argv[i]) == 0) {
+            batch = parse_size(exec_name, argv[i], argv[i + 1]);
+        } else {
+            show_help(stderr, exec_name);
+            exit(1);
+        }
+        i++;
+    }
+
+    printf("%-10s %-10s %-12s %-10s %s\n", "producers", "consumers", "items", "seconds", "Mitems/s");
+
+    for (size_t producers = 1; producers <= threads; producers++) {
+        for (size_t consumers = 1; consumers <= threads; consumers++) {
+            double elapsed;
+            if (run(producers, consumers, items, size, batch, &elapsed) < 0) {
+                LOG_ERROR("couldn't run benchmark");
+                return 1;
+            }
+
+            size_t pushed = (items / producers) * producers;
+            printf("%-10zu %-10zu %-12zu %-10.3f %.3f\n", producers, consumers, pushed, elapsed,
+                   pushed / elapsed / 1e6);
+        }
+    }
+
+    return 0;
+}
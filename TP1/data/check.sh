@@ -7,6 +7,7 @@ function check_file() {
     local filename_serial="serial-$filename"
     local filename_pthread="pthread-$filename"
     local filename_tbb="tbb-$filename"
+    local filename_steal="steal-$filename"
 
     if [[ ! -f "$filename_serial" ]]; then
         echo -e "\nFile '$filename_serial' does not exist"
@@ -23,6 +24,11 @@ function check_file() {
         return 1
     fi
 
+    if [[ ! -f "$filename_steal" ]]; then
+        echo -e "\nFile '$filename_steal' does not exist"
+        return 1
+    fi
+
     if ! cmp "$filename_serial" "$filename_pthread" > /dev/null; then
         echo -e "\nFiles '$filename_serial' and '$filename_pthread' don't match"
         return 1
@@ -33,6 +39,11 @@ function check_file() {
         return 1
     fi
 
+    if ! cmp "$filename_serial" "$filename_steal" > /dev/null; then
+        echo -e "\nFiles '$filename_serial' and '$filename_steal' don't match"
+        return 1
+    fi
+
     printf .
     return 0;
 }
@@ -0,0 +1,31 @@
+#ifndef INCLUDE_BUDGET_H_
+#define INCLUDE_BUDGET_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * bound on the bytes of the images a pipeline has in flight, every image reserves its footprint under its id
+ * when it is loaded and gives it back once saved or dropped
+ *
+ * a reservation is always granted when nothing else is reserved, so a single image larger than the budget
+ * still goes through, a budget of 0 bytes grants everything
+ */
+
+typedef struct budget budget_t;
+
+budget_t* budget_create(size_t max_bytes);
+void budget_destroy(budget_t* budget);
+
+/* blocks until the reservation fits, returns -1 on error */
+int budget_acquire(budget_t* budget, size_t id, size_t bytes);
+
+/* returns false instead of blocking when the reservation doesn't fit or on error */
+bool budget_try_acquire(budget_t* budget, size_t id, size_t bytes);
+
+void budget_release(budget_t* budget, size_t id);
+
+/* most bytes reserved at once since budget_create() */
+size_t budget_peak(budget_t* budget);
+
+#endif /* INCLUDE_BUDGET_H_ */
@@ -0,0 +1,25 @@
+#ifndef INCLUDE_DEQUE_H_
+#define INCLUDE_DEQUE_H_
+
+#include <stddef.h>
+
+/*
+ * fixed capacity work-stealing deque of non-NULL pointers (Chase-Lev), only the owner thread may push and pop
+ * at the bottom, any thread may steal from the top
+ */
+
+typedef struct deque deque_t;
+
+deque_t* deque_create(size_t size);
+void deque_destroy(deque_t* deque);
+
+/* owner only, returns -1 when the deque is full */
+int deque_push(deque_t* deque, void* ptr);
+
+/* owner only, returns NULL when the deque is empty */
+void* deque_pop(deque_t* deque);
+
+/* returns NULL when the deque is empty or when another thread took the item first */
+void* deque_steal(deque_t* deque);
+
+#endif /* INCLUDE_DEQUE_H_ */
@@ -0,0 +1,64 @@
+#ifndef INCLUDE_FILTER_CHAIN_H_
+#define INCLUDE_FILTER_CHAIN_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "image.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/*
+ * the filters a pipeline applies to every image, parsed from a comma separated description such as
+ * "scale_up:2,sharpen,sobel,desaturate", any filter of filter.h can appear, scale_up takes an optional factor
+ * (2 by default) and add_pixel takes the R:G:B values to add
+ *
+ * adjacent pointwise filters (to_hsv, to_rgb, add_pixel, desaturate) are fused into one stage that makes a
+ * single pass over the image, so a pipeline builds one stage per entry of the chain, not per filter
+ */
+
+typedef struct filter_chain filter_chain_t;
+
+#define FILTER_CHAIN_DEFAULT "scale_up:2,sharpen,sobel"
+
+/* returns NULL after logging the reason when the description is invalid */
+filter_chain_t* filter_chain_parse(const char* description);
+void filter_chain_destroy(filter_chain_t* chain);
+
+size_t filter_chain_length(const filter_chain_t* chain);
+
+/* the filters of the stage joined with '+', e.g. "to_hsv+desaturate" */
+const char* filter_chain_stage_name(const filter_chain_t* chain, size_t stage);
+
+/* output dimensions of the stage for an input of width x height, false and 0x0 when the input is too small for it */
+bool filter_chain_stage_size(const filter_chain_t* chain, size_t stage, size_t width, size_t height,
+                             size_t* new_width, size_t* new_height);
+
+/* whether an image of width x height goes through every stage, the filters with a border need a minimum size */
+bool filter_chain_accepts(const filter_chain_t* chain, size_t width, size_t height);
+
+/* bytes held at once by an image of width x height going through the chain, its largest input and output pair */
+size_t filter_chain_footprint(const filter_chain_t* chain, size_t width, size_t height);
+
+/* returns a newly allocated image, the input image is not freed */
+image_t* filter_chain_stage_apply(const filter_chain_t* chain, size_t stage, image_t* image);
+
+/*
+ * whether filter_chain_stage_rows() can compute the stage by bands, it then works like the filter_*_rows()
+ * functions of filter.h
+ */
+
+bool filter_chain_stage_has_rows(const filter_chain_t* chain, size_t stage);
+void filter_chain_stage_rows(const filter_chain_t* chain, size_t stage, image_t* image, image_t* new_image,
+                             size_t row_begin, size_t row_end);
+
+/* the whole chain, scale_up followed by sharpen and sobel goes through filter_scale_sharpen_sobel() */
+image_t* filter_chain_apply(const filter_chain_t* chain, image_t* image);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* INCLUDE_FILTER_CHAIN_H_ */
@@ -0,0 +1,42 @@
+#ifndef INCLUDE_FILTER_SIMD_H_
+#define INCLUDE_FILTER_SIMD_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image.h"
+
+/*
+ * vectorized row kernels used by filter.c, rows[] are the three input rows centered on the output row
+ *
+ * each kernel returns how many output pixels it computed from the start of the row, the caller finishes
+ * the remaining pixels with the scalar kernel
+ */
+
+bool filter_simd_has_sse(void);
+bool filter_simd_has_avx2(void);
+
+size_t filter_sobel_row_sse(const pixel_t* rows[3], pixel_t* out, size_t width);
+size_t filter_sobel_row_avx2(const pixel_t* rows[3], pixel_t* out, size_t width);
+
+/* weights must not overflow int16 when applied to 255 on every tap, see kernel33_compile() */
+
+size_t filter_convolution33_row_sse(const pixel_t* rows[3], pixel_t* out, size_t width, const int16_t weights[3][3],
+                                    int shift);
+size_t filter_convolution33_row_avx2(const pixel_t* rows[3], pixel_t* out, size_t width, const int16_t weights[3][3],
+                                     int shift);
+
+/* writes every pixel of in twice to out, the return value counts input pixels */
+
+size_t filter_scale_up2_row_sse(const pixel_t* in, pixel_t* out, size_t width);
+size_t filter_scale_up2_row_avx2(const pixel_t* in, pixel_t* out, size_t width);
+
+/* color space conversions of filter_to_hsv() and filter_to_rgb(), in may be out */
+
+size_t filter_to_hsv_row_sse(const pixel_t* in, pixel_t* out, size_t width);
+size_t filter_to_hsv_row_avx2(const pixel_t* in, pixel_t* out, size_t width);
+size_t filter_to_rgb_row_sse(const pixel_t* in, pixel_t* out, size_t width);
+size_t filter_to_rgb_row_avx2(const pixel_t* in, pixel_t* out, size_t width);
+
+#endif /* INCLUDE_FILTER_SIMD_H_ */
@@ -5,7 +5,12 @@
 
 #include "image.h"
 
-/* all filter return a newly allocated image, input image is not freed  */
+/*
+ * all filter return a newly allocated image, input image is not freed
+ *
+ * the filters with a kernel (sobel, the convolutions, the blurs) return NULL for an image smaller than the kernel,
+ * it would have no output
+ */
 
 image_t* filter_scale_up(image_t* image, size_t factor);
 image_t* filter_sobel(image_t* image);
@@ -15,6 +20,14 @@ image_t* filter_add_pixel(image_t* image, pixel_t* add_pixel);
 image_t* filter_desaturate(image_t* image);
 image_t* filter_convolution33(image_t* image, const double m[3][3]);
 image_t* filter_edge_identity(image_t* image);
+
+/*
+ * convolution by the outer product of col[] and row[], both of 2 * radius + 1 taps, divided by divisor, computed
+ * in two 1-D passes with exact integer arithmetic, the image shrinks by radius on every side, fails when 255 times
+ * the sums of the absolute taps doesn't fit in an int32
+ */
+
+image_t* filter_convolution_separable(image_t* image, const int row[], const int col[], size_t radius, int divisor);
 image_t* filter_edge_detect(image_t* image);
 image_t* filter_sharpen(image_t* image);
 image_t* filter_box_blur(image_t* image);
@@ -22,4 +35,83 @@ image_t* filter_gaussian_blur(image_t* image);
 image_t* filter_horizontal_flip(image_t* image);
 image_t* filter_vertical_flip(image_t* image);
 
+/*
+ * same filters writing into new_image, which the caller allocated with the output dimensions (a pipeline can
+ * ping-pong between preallocated images), they return -1 without touching it when its dimensions don't match
+ *
+ * new_image may be image itself for the pointwise filters and the flips, the _inplace() versions do just that
+ */
+
+int filter_scale_up_into(image_t* image, image_t* new_image, size_t factor);
+int filter_sobel_into(image_t* image, image_t* new_image);
+int filter_to_hsv_into(image_t* image, image_t* new_image);
+int filter_to_rgb_into(image_t* image, image_t* new_image);
+int filter_add_pixel_into(image_t* image, image_t* new_image, pixel_t* add_pixel);
+int filter_desaturate_into(image_t* image, image_t* new_image);
+int filter_convolution33_into(image_t* image, image_t* new_image, const double m[3][3]);
+int filter_edge_identity_into(image_t* image, image_t* new_image);
+int filter_convolution_separable_into(image_t* image, image_t* new_image, const int row[], const int col[],
+                                      size_t radius, int divisor);
+int filter_edge_detect_into(image_t* image, image_t* new_image);
+int filter_sharpen_into(image_t* image, image_t* new_image);
+int filter_box_blur_into(image_t* image, image_t* new_image);
+int filter_gaussian_blur_into(image_t* image, image_t* new_image);
+int filter_horizontal_flip_into(image_t* image, image_t* new_image);
+int filter_vertical_flip_into(image_t* image, image_t* new_image);
+
+void filter_to_hsv_inplace(image_t* image);
+void filter_to_rgb_inplace(image_t* image);
+void filter_add_pixel_inplace(image_t* image, pixel_t* add_pixel);
+void filter_desaturate_inplace(image_t* image);
+void filter_horizontal_flip_inplace(image_t* image);
+void filter_vertical_flip_inplace(image_t* image);
+
+/*
+ * compute rows [row_begin, row_end) of the filter output into new_image, which must already have the output
+ * dimensions, disjoint row ranges can be computed concurrently from the same input image
+ */
+
+void filter_scale_up_rows(image_t* image, image_t* new_image, size_t factor, size_t row_begin, size_t row_end);
+void filter_sobel_rows(image_t* image, image_t* new_image, size_t row_begin, size_t row_end);
+void filter_convolution33_rows(image_t* image, image_t* new_image, const double m[3][3], size_t row_begin,
+                               size_t row_end);
+void filter_sharpen_rows(image_t* image, image_t* new_image, size_t row_begin, size_t row_end);
+
+/*
+ * a run of pointwise filters applied in one pass over the image, bit-identical to applying them one after the
+ * other, new_image may be image itself
+ */
+
+typedef enum filter_pointwise_op {
+    FILTER_OP_TO_HSV,
+    FILTER_OP_TO_RGB,
+    FILTER_OP_ADD_PIXEL,
+    FILTER_OP_DESATURATE,
+} filter_pointwise_op_t;
+
+typedef struct filter_pointwise {
+    filter_pointwise_op_t op;
+    pixel_t pixel; /* for FILTER_OP_ADD_PIXEL */
+} filter_pointwise_t;
+
+image_t* filter_pointwise(image_t* image, const filter_pointwise_t* ops, size_t nb_ops);
+int filter_pointwise_into(image_t* image, image_t* new_image, const filter_pointwise_t* ops, size_t nb_ops);
+void filter_pointwise_rows(image_t* image, image_t* new_image, const filter_pointwise_t* ops, size_t nb_ops,
+                           size_t row_begin, size_t row_end);
+
+/* row kernels used by filter_sobel() and filter_convolution33(), defaults to the best one supported by the CPU */
+
+typedef enum filter_impl {
+    FILTER_IMPL_SCALAR,
+    FILTER_IMPL_SSE,
+    FILTER_IMPL_AVX2,
+} filter_impl_t;
+
+int filter_set_impl(filter_impl_t impl);
+filter_impl_t filter_get_impl(void);
+
+/* same as filter_sobel(filter_sharpen(filter_scale_up(image, factor))) without the intermediate images */
+
+image_t* filter_scale_sharpen_sobel(image_t* image, size_t factor);
+
 #endif /* INCLUDE_FILTER_H_ */
@@ -0,0 +1,33 @@
+#ifndef INCLUDE_ID_MAP_H_
+#define INCLUDE_ID_MAP_H_
+
+#include <stddef.h>
+
+/*
+ * values of fixed size kept by image id while the image is in flight, ids are handed out from 0 without holes
+ * so the table is indexed by the low bits of the id and only grows with the number of ids present at once, not
+ * with the id itself, a pipeline that never stops keeps the same table
+ *
+ * not thread-safe, the users keep it behind their own mutex
+ */
+
+typedef struct id_map {
+    size_t value_size;
+    size_t slot_size;
+    size_t capacity; /* power of two, 0 until the first id is put */
+    size_t count;
+    unsigned char* slots;
+} id_map_t;
+
+void id_map_init(id_map_t* map, size_t value_size);
+void id_map_destroy(id_map_t* map);
+
+/* the value of id, zeroed when the id wasn't there, NULL on error */
+void* id_map_put(id_map_t* map, size_t id);
+
+/* the value of id, NULL when the id isn't there, valid until the next put or remove */
+void* id_map_get(const id_map_t* map, size_t id);
+
+void id_map_remove(id_map_t* map, size_t id);
+
+#endif /* INCLUDE_ID_MAP_H_ */
@@ -0,0 +1,22 @@
+#ifndef INCLUDE_IMAGE_CACHE_H_
+#define INCLUDE_IMAGE_CACHE_H_
+
+#include <stddef.h>
+
+#include "image.h"
+
+typedef struct image_cache image_cache_t;
+
+/* image_dir_load_next() once the cache is started, the ids of the cached frames are skipped */
+
+image_t* image_cache_next(image_dir_t* image_dir);
+
+/* called by image_dir_save() once the image with this id is written to filename */
+
+void image_cache_saved(image_dir_t* image_dir, size_t id, const char* filename);
+
+/* called by image_dir_drop(), the frame has no output to cache */
+
+void image_cache_dropped(image_dir_t* image_dir, size_t id);
+
+#endif /* INCLUDE_IMAGE_CACHE_H_ */
@@ -0,0 +1,13 @@
+#ifndef INCLUDE_IMAGE_IO_H_
+#define INCLUDE_IMAGE_IO_H_
+
+#include "image.h"
+
+typedef struct image_io image_io_t;
+
+/* image_dir_load_next() and image_dir_save() once the I/O layer is started */
+
+image_t* image_io_load_next(image_dir_t* image_dir);
+int image_io_save(image_dir_t* image_dir, image_t* image, const char* filename);
+
+#endif /* INCLUDE_IMAGE_IO_H_ */
@@ -0,0 +1,29 @@
+#ifndef INCLUDE_IMAGE_LOADER_H_
+#define INCLUDE_IMAGE_LOADER_H_
+
+#include <stddef.h>
+
+#include "image.h"
+
+typedef struct image_loader image_loader_t;
+
+typedef image_t* (*image_load_t)(char* filename);
+
+/* writes the path of the input file with this id to buffer and returns its reader, NULL when there is none */
+
+image_load_t image_dir_find(image_dir_t* image_dir, size_t id, char* buffer, size_t buffer_size);
+
+/* same returning the format of the file, -1 when there is none */
+
+int image_dir_find_format(image_dir_t* image_dir, size_t id, char* buffer, size_t buffer_size,
+                          image_format_t* format);
+
+/* writes the path of the output file of the image with this id to buffer */
+
+int image_dir_output_name(image_dir_t* image_dir, size_t id, char* buffer, size_t buffer_size);
+
+/* image_dir_load_next() once loaders are started */
+
+image_t* image_loader_next(image_dir_t* image_dir);
+
+#endif /* INCLUDE_IMAGE_LOADER_H_ */
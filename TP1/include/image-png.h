@@ -0,0 +1,16 @@
+#ifndef INCLUDE_IMAGE_PNG_H_
+#define INCLUDE_IMAGE_PNG_H_
+
+#include <stdio.h>
+
+#include "image.h"
+
+/* writes image as a PNG deflated on up to options->threads threads, used by image_save_png() */
+
+int image_save_png_parallel(image_t* image, char* filename, const image_png_options_t* options);
+
+/* same written to an open stream, used by image_encode_png() */
+
+int image_write_png_parallel(image_t* image, FILE* file, const image_png_options_t* options);
+
+#endif /* INCLUDE_IMAGE_PNG_H_ */
@@ -0,0 +1,43 @@
+#ifndef INCLUDE_IMAGE_POOL_H_
+#define INCLUDE_IMAGE_POOL_H_
+
+#include <stddef.h>
+
+#include "image.h"
+
+/*
+ * thread-safe pool of pixel buffers, used by image_create() and image_destroy() so a pipeline that keeps
+ * processing frames of the same sizes stops allocating once every stage has seen one frame
+ *
+ * buffers are grouped in size classes (four per power of two), every thread keeps a few small buffers of its own
+ * and only goes to the shared free lists, under a mutex, when its cache misses or overflows, the buffers of full
+ * frames always go through the shared free lists
+ */
+
+typedef struct image_pool image_pool_t;
+
+typedef struct image_pool_stats {
+    size_t allocated; /* buffers that came from malloc */
+    size_t reused;    /* buffers handed out again from the pool */
+    size_t released;  /* buffers freed because the pool was holding max_bytes already */
+} image_pool_stats_t;
+
+/* max_bytes bounds what the shared free lists keep, the per-thread caches add at most a few MB per thread */
+image_pool_t* image_pool_create(size_t max_bytes);
+
+/* must be called once no other thread uses the pool anymore */
+void image_pool_destroy(image_pool_t* pool);
+
+/* returns a buffer of at least count pixels aligned on a cache line, NULL on error */
+pixel_t* image_pool_get(image_pool_t* pool, size_t count);
+
+/* gives back a buffer returned by image_pool_get() on the same pool, from any thread */
+void image_pool_put(image_pool_t* pool, pixel_t* pixels);
+
+/* counters since the pool was created, the default pool is reported by --stats */
+void image_pool_get_stats(image_pool_t* pool, image_pool_stats_t* stats);
+
+/* pool used by image_create() and image_destroy(), created on first use */
+image_pool_t* image_pool_default(void);
+
+#endif /* INCLUDE_IMAGE_POOL_H_ */
@@ -0,0 +1,42 @@
+#ifndef INCLUDE_IMAGE_SOCKET_H_
+#define INCLUDE_IMAGE_SOCKET_H_
+
+#include <stdint.h>
+
+#include "image.h"
+
+/*
+ * protocol of image_dir_start_socket(), every request and every reply is this header followed by `size` bytes
+ * holding one image file in `format`, an image_format_t, so a frame is either encoded (PNG, QOI) or its RGBA
+ * pixels behind the 24 bytes header of the raw files
+ *
+ * the reply to a request carries its tag, its format and the processed frame, or a status other than
+ * IMAGE_SOCKET_OK and no bytes when the frame couldn't be decoded or encoded, with several save threads the
+ * replies of a connection can come back in any order
+ *
+ * a client has to read the replies while it sends requests, the server blocks on a connection whose replies
+ * aren't read and stops reading requests, it may shut down its side of the connection once it sent its last
+ * request and still read the replies
+ *
+ * the fields use the byte order of the machine like the raw files, both ends are on the same host
+ */
+
+#define IMAGE_SOCKET_MAGIC "TP1SOCK\1"
+#define IMAGE_SOCKET_MAX_SIZE (1UL << 30)
+
+enum {
+    IMAGE_SOCKET_OK     = 0,
+    IMAGE_SOCKET_FAILED = 1,
+};
+
+typedef struct image_socket_header {
+    char magic[8];
+    uint32_t format;
+    uint32_t status; /* 0 in requests */
+    uint64_t tag;    /* chosen by the client */
+    uint64_t size;
+} image_socket_header_t;
+
+typedef struct image_socket image_socket_t;
+
+#endif /* INCLUDE_IMAGE_SOCKET_H_ */
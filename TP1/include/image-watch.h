@@ -0,0 +1,22 @@
+#ifndef INCLUDE_IMAGE_WATCH_H_
+#define INCLUDE_IMAGE_WATCH_H_
+
+#include <stddef.h>
+
+#include "image.h"
+
+typedef struct image_watch image_watch_t;
+
+/* image_dir_load_next() once the watch is started */
+
+image_t* image_watch_next(image_dir_t* image_dir);
+
+/* called by image_dir_save() once the image with this id is written */
+
+void image_watch_saved(image_dir_t* image_dir, size_t id);
+
+/* called by image_dir_drop(), the frame never gets a latency */
+
+void image_watch_dropped(image_dir_t* image_dir, size_t id);
+
+#endif /* INCLUDE_IMAGE_WATCH_H_ */
@@ -27,24 +27,183 @@ static inline pixel_t* image_get_pixel(image_t* image, unsigned int x, unsigned
     return &image->pixels[x + y * image->width];
 }
 
+/* PNG encoder settings, set from the command line before a pipeline is started */
+
+enum {
+    IMAGE_PNG_FILTER_NONE  = 1 << 0,
+    IMAGE_PNG_FILTER_SUB   = 1 << 1,
+    IMAGE_PNG_FILTER_UP    = 1 << 2,
+    IMAGE_PNG_FILTER_AVG   = 1 << 3,
+    IMAGE_PNG_FILTER_PAETH = 1 << 4,
+    IMAGE_PNG_FILTER_ALL   = (1 << 5) - 1,
+};
+
+typedef struct image_png_options {
+    int level;      /* zlib compression level from 0 to 9, -1 for the zlib default */
+    int filters;    /* IMAGE_PNG_FILTER_* allowed per row, the one minimizing the row is kept, 0 for the default */
+    size_t threads; /* threads deflating a single image, 1 leaves the whole encoding to libpng */
+} image_png_options_t;
+
+extern image_png_options_t image_png_options;
+
 image_t* image_create(size_t id, size_t width, size_t height);
 image_t* image_create_from_png(char* filename);
 image_t* image_copy(image_t* image);
 void image_destroy(image_t* image);
 int image_save_png(image_t* image, char* filename);
 
+/*
+ * QOI is lossless and much faster to encode and decode than PNG, raw is a small header and the pixels as they are
+ * in memory, both go through a single read or write system call
+ */
+
+image_t* image_create_from_qoi(char* filename);
+int image_save_qoi(image_t* image, char* filename);
+image_t* image_create_from_raw(char* filename);
+int image_save_raw(image_t* image, char* filename);
+
+/*
+ * the same readers decoding a whole file already in memory and writers encoding to a malloc()ed buffer the caller
+ * frees, so the file system can be left to the asynchronous I/O layer
+ */
+
+image_t* image_create_from_png_memory(const void* data, size_t size);
+int image_encode_png(image_t* image, void** data, size_t* size);
+image_t* image_create_from_qoi_memory(const void* data, size_t size);
+int image_encode_qoi(image_t* image, void** data, size_t* size);
+image_t* image_create_from_raw_memory(const void* data, size_t size);
+int image_encode_raw(image_t* image, void** data, size_t* size);
+
+/*
+ * rows [row_begin, row_end) of the image are decoded and won't change anymore, a negative return value stops
+ * the decoding and the loader returns NULL
+ */
+
+typedef int (*image_rows_callback_t)(image_t* image, size_t row_begin, size_t row_end, void* arg);
+
+/*
+ * same as image_create_from_png() calling back every band_rows decoded rows (0 for the whole image), so the top
+ * of a frame can be processed while the bottom is still being decoded, interlaced files are handed in one band
+ */
+
+image_t* image_create_from_png_rows(char* filename, size_t band_rows, image_rows_callback_t callback, void* arg);
+
+/*
+ * PNG encoder fed with bands of rows as they are produced, the rows of a band are contiguous like in
+ * image_t.pixels, image_png_writer_close() fails if the writer didn't get exactly `height` rows
+ */
+
+typedef struct image_png_writer image_png_writer_t;
+
+image_png_writer_t* image_png_writer_open(char* filename, size_t width, size_t height);
+int image_png_writer_write_rows(image_png_writer_t* writer, pixel_t* rows, size_t count);
+int image_png_writer_close(image_png_writer_t* writer);
+
+typedef enum image_format {
+    IMAGE_FORMAT_PNG,
+    IMAGE_FORMAT_QOI,
+    IMAGE_FORMAT_RAW,
+} image_format_t;
+
+/*
+ * the input files can be in any format, for every id the loader takes the first of NNNN.png, NNNN.qoi and NNNN.raw
+ * that exists, the output files are written in output_format which image_dir_reset() leaves untouched
+ */
+
+struct image_dir;
+struct filter_chain;
+
+/*
+ * replaces the files of an image_dir_t when set, load() returns the next image or NULL at the end and
+ * image_dir_load_next() numbers them, save() may be called from several threads at once and doesn't take the
+ * image, drop() is called instead of save() for an image a filter dropped and may be NULL, the benchmarks use
+ * it to run the pipelines on frames in memory
+ */
+
+typedef struct image_dir_hooks {
+    image_t* (*load)(struct image_dir* image_dir);
+    int (*save)(struct image_dir* image_dir, image_t* image);
+    void (*drop)(struct image_dir* image_dir, size_t id);
+    void* arg;
+} image_dir_hooks_t;
+
 typedef struct image_dir {
     const char* input_dir_name;
     const char* output_dir_name;
     const char* save_prefix;
     size_t load_current;
     bool stop;
+    image_format_t output_format;
+    struct image_loader* loader; /* set between image_dir_start_loaders() and image_dir_stop_loaders() */
+    struct image_io* io;         /* set between image_dir_start_io() and image_dir_stop_io() */
+    struct image_watch* watch;   /* set between image_dir_start_watch() and image_dir_stop_watch() */
+    struct image_cache* cache;   /* set between image_dir_start_cache() and image_dir_stop_cache() */
+    image_dir_hooks_t* hooks;
 } image_dir_t;
 
+image_t* image_decode(image_format_t format, const void* data, size_t size);
+int image_encode(image_t* image, image_format_t format, void** data, size_t* size);
+
 image_t* image_dir_load_next(image_dir_t* image_dir);
 int image_dir_save(image_dir_t* image_dir, image_t* image);
 
+/* called by the pipelines instead of image_dir_save() when a filter dropped the image, from any thread */
+void image_dir_drop(image_dir_t* image_dir, size_t id);
+
 void image_dir_reset(image_dir_t* image_dir, const char* input_dir_name, const char* output_dir_name,
                      const char* save_prefix);
 
+/*
+ * decodes the next images on nb_threads threads ahead of image_dir_load_next(), which still returns them one at
+ * a time with increasing ids and must still be called from one thread at a time, 1 thread keeps the loading
+ * synchronous, image_dir_stop_loaders() frees the images that were never asked for
+ */
+
+int image_dir_start_loaders(image_dir_t* image_dir, size_t nb_threads);
+void image_dir_stop_loaders(image_dir_t* image_dir);
+
+typedef enum image_io_backend {
+    IMAGE_IO_SYNC,    /* every stage reads and writes its own files */
+    IMAGE_IO_URING,   /* io_uring, IMAGE_IO_THREADS when the kernel doesn't allow it */
+    IMAGE_IO_THREADS, /* blocking reads and writes on a few I/O threads */
+} image_io_backend_t;
+
+/*
+ * reads the files of the next `depth` ids in the background and decodes them from memory in image_dir_load_next(),
+ * image_dir_save() encodes to memory and returns once the write is submitted, image_dir_stop_io() waits for the
+ * writes still in flight and fails if one of them did, images handed out by loaders don't go through this layer
+ */
+
+int image_dir_start_io(image_dir_t* image_dir, image_io_backend_t backend, size_t depth);
+int image_dir_stop_io(image_dir_t* image_dir);
+
+/*
+ * image_dir_load_next() waits for the next file to be written to the input directory instead of stopping at the
+ * first missing one, until image_dir->stop is set, image_dir_save() prints how long after its arrival every image
+ * was saved and image_dir_stop_watch() the percentiles of these latencies, loaders and the I/O layer don't watch
+ */
+
+int image_dir_start_watch(image_dir_t* image_dir);
+void image_dir_stop_watch(image_dir_t* image_dir);
+
+/*
+ * serves the frames clients send on a unix socket at path instead of the files of the directory, the pipeline
+ * runs until image_dir->stop is set and every processed frame goes back to the client that sent it, see
+ * image-socket.h for the protocol, frames too small for the filters are refused before they reach the pipeline,
+ * image_dir_stop_socket() closes the connections and removes the socket
+ */
+
+int image_dir_start_socket(image_dir_t* image_dir, const char* path, const struct filter_chain* filters);
+void image_dir_stop_socket(image_dir_t* image_dir);
+
+/*
+ * keeps the outputs in cache_dir_name under a hash of their input file, the filters and the output format and
+ * settings, image_dir_load_next() copies the cached output of a frame seen before to its output path and goes on
+ * with the next id instead of handing it to the pipeline, image_dir_save() adds the new outputs, set the
+ * output format and the PNG settings before starting the cache, loaders and the I/O layer don't go through it
+ */
+
+int image_dir_start_cache(image_dir_t* image_dir, const char* cache_dir_name, const struct filter_chain* filters);
+void image_dir_stop_cache(image_dir_t* image_dir);
+
 #endif /* INCLUDE_IMAGE_H_ */
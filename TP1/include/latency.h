@@ -0,0 +1,33 @@
+#ifndef INCLUDE_LATENCY_H_
+#define INCLUDE_LATENCY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * latencies in nanoseconds counted in a histogram of fixed size, LATENCY_SUB_BUCKETS buckets per power of two,
+ * so the percentiles are within 1 / LATENCY_SUB_BUCKETS of the recorded values however long the run is, the
+ * maximum is kept exactly
+ *
+ * not thread-safe, the users keep it behind their own mutex
+ */
+
+#define LATENCY_SUB_BUCKETS 32
+#define LATENCY_BUCKETS (60 * LATENCY_SUB_BUCKETS)
+
+typedef struct latency_histogram {
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+} latency_histogram_t;
+
+/* CLOCK_MONOTONIC in nanoseconds */
+uint64_t latency_now(void);
+
+void latency_reset(latency_histogram_t* histogram);
+void latency_add(latency_histogram_t* histogram, uint64_t ns);
+
+/* nearest rank percentile p in milliseconds, the upper bound of its bucket, 0 when nothing was added */
+double latency_percentile_ms(const latency_histogram_t* histogram, unsigned int p);
+
+#endif /* INCLUDE_LATENCY_H_ */
@@ -3,15 +3,34 @@
 #ifndef INCLUDE_PIPELINE_H_
 #define INCLUDE_PIPELINE_H_
 
+#include "filter-chain.h"
 #include "image.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif /* __cplusplus */
 
+/* tuning knobs shared by the pipelines, set from the command line before a pipeline is started */
+
+typedef struct pipeline_options {
+    size_t tbb_grain_size;     /* rows per band when a TBB stage splits a frame, 0 keeps one thread per frame */
+    filter_chain_t* filters;   /* applied to every image, NULL for FILTER_CHAIN_DEFAULT */
+    size_t max_inflight_bytes; /* bound on the footprint of the images in flight, 0 bounds their number instead */
+} pipeline_options_t;
+
+extern pipeline_options_t pipeline_options;
+
+/*
+ * pipeline_options.filters, the default chain is parsed on the first call, which must not race with another,
+ * NULL when it could not be allocated
+ */
+
+const filter_chain_t* pipeline_filters(void);
+
 int pipeline_serial(image_dir_t* image_dir);
 int pipeline_pthread(image_dir_t* image_dir);
 int pipeline_tbb(image_dir_t* image_dir);
+int pipeline_steal(image_dir_t* image_dir);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -3,31 +3,31 @@
 #ifndef INCLUDE_QUEUE_H_
 #define INCLUDE_QUEUE_H_
 
-#include <pthread.h>
 #include <stddef.h>
 
-#include "queue.h"
+/*
+ * bounded multi-producer multi-consumer queue of pointers, NULL is a valid value
+ *
+ * queue_push() blocks while the queue holds `size` items and queue_pop() blocks while it is empty
+ */
 
-typedef struct queue_node queue_node_t;
-
-typedef struct queue_node {
-    void* value;
-    queue_node_t* prev;
-} queue_node_t;
-
-typedef struct queue {
-    size_t size;
-    size_t used;
-    queue_node_t* tail;
-    queue_node_t* head;
-    pthread_mutex_t mutex;
-    pthread_cond_t modified_item_pushed;
-    pthread_cond_t modified_item_poped;
-} queue_t;
+typedef struct queue queue_t;
 
 queue_t* queue_create(size_t size);
 void queue_destroy(queue_t* queue);
 int queue_push(queue_t* queue, void* ptr);
 void* queue_pop(queue_t* queue);
 
+/* pushes all count items, blocking whenever the queue is full, returns -1 on error */
+int queue_push_many(queue_t* queue, void** ptrs, size_t count);
+
+/* blocks until at least one item is available then pops up to max items, returns how many, 0 on error */
+size_t queue_pop_many(queue_t* queue, void** ptrs, size_t max);
+
+/* same as queue_pop_many() but gives up after timeout_ms milliseconds and returns 0 with errno set to ETIMEDOUT */
+size_t queue_pop_many_timeout(queue_t* queue, void** ptrs, size_t max, unsigned int timeout_ms);
+
+/* number of items in the queue, only a hint while other threads use it */
+size_t queue_used(queue_t* queue);
+
 #endif /* INCLUDE_QUEUE_H_ */
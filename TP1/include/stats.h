@@ -0,0 +1,79 @@
+#ifndef INCLUDE_STATS_H_
+#define INCLUDE_STATS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "filter-chain.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/*
+ * run statistics for --stats, per stage the items processed, the time spent working on them and the time spent
+ * blocked pushing to or popping from a queue, per image the latency from the start of its load to the end of
+ * its save
+ *
+ * every call is a no-op and stats_now() returns 0 unless stats_start() was called, so the pipelines can call
+ * them unconditionally
+ */
+
+/* stage k of the filter chain is STATS_FILTER(k) */
+
+typedef enum stats_stage {
+    STATS_LOAD,
+    STATS_SAVE,
+    STATS_FILTERS,
+} stats_stage_t;
+
+#define STATS_FILTER(k) ((stats_stage_t)(STATS_FILTERS + (k)))
+
+typedef enum stats_format {
+    STATS_TABLE,
+    STATS_JSON,
+} stats_format_t;
+
+/* the filters give the name of the STATS_FILTER() stages */
+
+void stats_start(const filter_chain_t* filters);
+bool stats_enabled(void);
+uint64_t stats_now(void);
+
+/* adds the time since begin, a value of stats_now(), to the busy or blocked time of the stage */
+
+void stats_busy(stats_stage_t stage, uint64_t begin, size_t items);
+void stats_blocked(stats_stage_t stage, uint64_t begin);
+
+/*
+ * the latency of an image starts at begin, taken before its id was known, and ends at stats_image_end(), an image
+ * a filter dropped ends at stats_image_drop() without a latency
+ */
+
+void stats_image_begin(size_t id, uint64_t begin);
+void stats_image_end(size_t id);
+void stats_image_drop(size_t id);
+
+/*
+ * for the pipelines moving threads between the stages, the threads of the stage when the run ends and at most
+ * during it, and the moves made, only reported for the stages given
+ */
+
+void stats_threads(stats_stage_t stage, int threads, int peak_threads);
+void stats_thread_moves(size_t moves);
+
+/* frames the cache served without going through the pipeline, counted with the images, and frames it missed */
+
+void stats_cache(size_t hits, size_t misses);
+
+/* prints the statistics since stats_start() and frees them */
+
+void stats_report(FILE* file, stats_format_t format, const char* pipeline);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* INCLUDE_STATS_H_ */
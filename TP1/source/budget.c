@@ -0,0 +1,102 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "budget.h"
+#include "id-map.h"
+#include "log.h"
+
+/* the reservations of the images in flight are kept by id */
+
+struct budget {
+    pthread_mutex_t mutex;
+    pthread_cond_t released;
+    size_t max_bytes;
+    size_t used;
+    size_t peak;
+    id_map_t reserved; /* size_t by id */
+};
+
+budget_t* budget_create(size_t max_bytes) {
+    budget_t* budget = calloc(1, sizeof(*budget));
+    if (budget == NULL) {
+        LOG_ERROR_ERRNO("calloc");
+        goto fail_exit;
+    }
+
+    budget->max_bytes = max_bytes;
+    id_map_init(&budget->reserved, sizeof(size_t));
+    pthread_mutex_init(&budget->mutex, NULL);
+    pthread_cond_init(&budget->released, NULL);
+
+    return budget;
+
+fail_exit:
+    return NULL;
+}
+
+void budget_destroy(budget_t* budget) {
+    pthread_cond_destroy(&budget->released);
+    pthread_mutex_destroy(&budget->mutex);
+    id_map_destroy(&budget->reserved);
+    free(budget);
+}
+
+static bool fits(budget_t* budget, size_t bytes) {
+    return budget->max_bytes == 0 || budget->used == 0 || budget->used + bytes <= budget->max_bytes;
+}
+
+/* called with the mutex held once the reservation fits */
+
+static int reserve(budget_t* budget, size_t id, size_t bytes) {
+    size_t* reserved = id_map_put(&budget->reserved, id);
+    if (reserved == NULL) {
+        return -1;
+    }
+
+    *reserved    += bytes;
+    budget->used += bytes;
+    if (budget->used > budget->peak) {
+        budget->peak = budget->used;
+    }
+
+    return 0;
+}
+
+int budget_acquire(budget_t* budget, size_t id, size_t bytes) {
+    pthread_mutex_lock(&budget->mutex);
+
+    while (!fits(budget, bytes)) {
+        pthread_cond_wait(&budget->released, &budget->mutex);
+    }
+
+    int ret = reserve(budget, id, bytes);
+    pthread_mutex_unlock(&budget->mutex);
+    return ret;
+}
+
+bool budget_try_acquire(budget_t* budget, size_t id, size_t bytes) {
+    pthread_mutex_lock(&budget->mutex);
+    bool granted = fits(budget, bytes) && reserve(budget, id, bytes) == 0;
+    pthread_mutex_unlock(&budget->mutex);
+    return granted;
+}
+
+void budget_release(budget_t* budget, size_t id) {
+    pthread_mutex_lock(&budget->mutex);
+
+    size_t* reserved = id_map_get(&budget->reserved, id);
+    if (reserved != NULL) {
+        budget->used -= *reserved;
+        id_map_remove(&budget->reserved, id);
+        pthread_cond_broadcast(&budget->released);
+    }
+
+    pthread_mutex_unlock(&budget->mutex);
+}
+
+size_t budget_peak(budget_t* budget) {
+    pthread_mutex_lock(&budget->mutex);
+    size_t peak = budget->peak;
+    pthread_mutex_unlock(&budget->mutex);
+    return peak;
+}
@@ -0,0 +1,113 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "deque.h"
+#include "log.h"
+
+/*
+ * memory orderings follow "Correct and Efficient Work-Stealing for Weak Memory Models" (Lê et al., PPoPP 2013)
+ * with a fixed array instead of a growable one, the owner pops from the bottom in LIFO order so the item it just
+ * pushed is the next one it runs, thieves take the oldest item from the top
+ */
+
+#define CACHE_LINE_SIZE 64
+
+struct deque {
+    size_t size;
+    _Atomic(void*)* items;
+    _Alignas(CACHE_LINE_SIZE) atomic_llong top;
+    _Alignas(CACHE_LINE_SIZE) atomic_llong bottom;
+};
+
+deque_t* deque_create(size_t size) {
+    if (size == 0) {
+        LOG_ERROR("deque size must be positive");
+        goto fail_exit;
+    }
+
+    deque_t* deque = aligned_alloc(CACHE_LINE_SIZE, sizeof(*deque));
+    if (deque == NULL) {
+        LOG_ERROR_ERRNO("aligned_alloc");
+        goto fail_exit;
+    }
+
+    deque->size  = size;
+    deque->items = calloc(size, sizeof(*deque->items));
+    if (deque->items == NULL) {
+        LOG_ERROR_ERRNO("calloc");
+        goto fail_free_deque;
+    }
+
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+
+    return deque;
+
+fail_free_deque:
+    free(deque);
+fail_exit:
+    return NULL;
+}
+
+void deque_destroy(deque_t* deque) {
+    free(deque->items);
+    free(deque);
+}
+
+int deque_push(deque_t* deque, void* ptr) {
+    long long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long long top    = atomic_load_explicit(&deque->top, memory_order_acquire);
+
+    if (bottom - top >= (long long)deque->size) {
+        return -1;
+    }
+
+    atomic_store_explicit(&deque->items[bottom % deque->size], ptr, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+
+    return 0;
+}
+
+void* deque_pop(deque_t* deque) {
+    long long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    void* ptr = atomic_load_explicit(&deque->items[bottom % deque->size], memory_order_relaxed);
+
+    if (top == bottom) {
+        /* last item, race against the thieves for it */
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+                                                     memory_order_relaxed)) {
+            ptr = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+
+    return ptr;
+}
+
+void* deque_steal(deque_t* deque) {
+    long long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+    if (top >= bottom) {
+        return NULL;
+    }
+
+    void* ptr = atomic_load_explicit(&deque->items[top % deque->size], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        return NULL;
+    }
+
+    return ptr;
+}
@@ -0,0 +1,417 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter-chain.h"
+#include "filter.h"
+#include "log.h"
+
+/*
+ * a stage is either a scale up, a run of pointwise filters or one of the other filters of filter.h, the name of a
+ * stage is the description of its filters, so "scale_up:3" or "add_pixel:0:0:64+desaturate"
+ */
+
+#define MAX_ARGS 3
+
+typedef enum chain_kind {
+    CHAIN_SCALE_UP,
+    CHAIN_POINTWISE,
+    CHAIN_FILTER,
+} chain_kind_t;
+
+typedef void (*chain_rows_t)(image_t* image, image_t* new_image, size_t row_begin, size_t row_end);
+
+typedef struct chain_stage {
+    char* name;
+    chain_kind_t kind;
+    size_t factor;                /* CHAIN_SCALE_UP */
+    filter_pointwise_t* ops;      /* CHAIN_POINTWISE */
+    size_t nb_ops;                /* CHAIN_POINTWISE */
+    image_t* (*filter)(image_t*); /* CHAIN_FILTER */
+    chain_rows_t rows;            /* CHAIN_FILTER, NULL when the filter can't compute bands */
+    size_t border;                /* CHAIN_FILTER, pixels lost on every side */
+} chain_stage_t;
+
+struct filter_chain {
+    chain_stage_t* stages;
+    size_t nb_stages;
+};
+
+static const struct {
+    const char* name;
+    image_t* (*filter)(image_t*);
+    chain_rows_t rows;
+    size_t border;
+} chain_filters[] = {
+    {"sobel", filter_sobel, filter_sobel_rows, 1},
+    {"sharpen", filter_sharpen, filter_sharpen_rows, 1},
+    {"edge_identity", filter_edge_identity, NULL, 1},
+    {"edge_detect", filter_edge_detect, NULL, 1},
+    {"box_blur", filter_box_blur, NULL, 1},
+    {"gaussian_blur", filter_gaussian_blur, NULL, 1},
+    {"horizontal_flip", filter_horizontal_flip, NULL, 0},
+    {"vertical_flip", filter_vertical_flip, NULL, 0},
+};
+
+static const struct {
+    const char* name;
+    filter_pointwise_op_t op;
+    size_t nb_args;
+} chain_pointwise[] = {
+    {"to_hsv", FILTER_OP_TO_HSV, 0},
+    {"to_rgb", FILTER_OP_TO_RGB, 0},
+    {"add_pixel", FILTER_OP_ADD_PIXEL, 3},
+    {"desaturate", FILTER_OP_DESATURATE, 0},
+};
+
+#define NB_CHAIN_FILTERS (sizeof(chain_filters) / sizeof(chain_filters[0]))
+#define NB_CHAIN_POINTWISE (sizeof(chain_pointwise) / sizeof(chain_pointwise[0]))
+
+static bool token_is(const char* token, size_t length, const char* name) {
+    return strlen(name) == length && strncmp(token, name, length) == 0;
+}
+
+/* parses the ':' separated numbers of args, returns how many there are or -1 */
+
+static int parse_args(const char* args, size_t length, unsigned long values[MAX_ARGS]) {
+    int count = 0;
+
+    while (length > 0) {
+        if (count == MAX_ARGS || *args != ':') {
+            return -1;
+        }
+        args++;
+        length--;
+
+        char* end;
+        errno           = 0;
+        values[count++] = strtoul(args, &end, 10);
+        if (errno != 0 || end == args || *args == '-' || (size_t)(end - args) > length) {
+            return -1;
+        }
+
+        length -= end - args;
+        args    = end;
+    }
+
+    return count;
+}
+
+static chain_stage_t* append_stage(filter_chain_t* chain, chain_kind_t kind, const char* token, size_t length) {
+    chain_stage_t* stages = realloc(chain->stages, (chain->nb_stages + 1) * sizeof(*stages));
+    if (stages == NULL) {
+        LOG_ERROR_ERRNO("realloc");
+        return NULL;
+    }
+    chain->stages = stages;
+
+    chain_stage_t* stage = &stages[chain->nb_stages];
+    memset(stage, 0, sizeof(*stage));
+
+    stage->kind = kind;
+    stage->name = strndup(token, length);
+    if (stage->name == NULL) {
+        LOG_ERROR_ERRNO("strndup");
+        return NULL;
+    }
+
+    chain->nb_stages++;
+    return stage;
+}
+
+/* adds a pointwise filter to the last stage when it is pointwise too, else to a new stage */
+
+static int append_pointwise(filter_chain_t* chain, const filter_pointwise_t* op, const char* token, size_t length) {
+    chain_stage_t* stage = NULL;
+
+    if (chain->nb_stages > 0 && chain->stages[chain->nb_stages - 1].kind == CHAIN_POINTWISE) {
+        stage = &chain->stages[chain->nb_stages - 1];
+
+        size_t name_length = strlen(stage->name);
+        char* name         = realloc(stage->name, name_length + length + 2);
+        if (name == NULL) {
+            LOG_ERROR_ERRNO("realloc");
+            return -1;
+        }
+
+        name[name_length] = '+';
+        memcpy(&name[name_length + 1], token, length);
+        name[name_length + length + 1] = '\0';
+        stage->name                    = name;
+    } else {
+        stage = append_stage(chain, CHAIN_POINTWISE, token, length);
+        if (stage == NULL) {
+            return -1;
+        }
+    }
+
+    filter_pointwise_t* ops = realloc(stage->ops, (stage->nb_ops + 1) * sizeof(*ops));
+    if (ops == NULL) {
+        LOG_ERROR_ERRNO("realloc");
+        return -1;
+    }
+
+    ops[stage->nb_ops++] = *op;
+    stage->ops           = ops;
+    return 0;
+}
+
+static int parse_filter(filter_chain_t* chain, const char* token, size_t length, const char* description) {
+    size_t name_length = strcspn(token, ":,");
+    unsigned long args[MAX_ARGS];
+
+    int nb_args = parse_args(token + name_length, length - name_length, args);
+    if (nb_args < 0) {
+        LOG_ERROR("invalid arguments to filter `%.*s` in `%s`", (int)length, token, description);
+        return -1;
+    }
+
+    if (token_is(token, name_length, "scale_up")) {
+        size_t factor = (nb_args == 0) ? 2 : args[0];
+        if (nb_args > 1 || factor == 0) {
+            LOG_ERROR("scale_up takes one factor of at least 1, got `%.*s`", (int)length, token);
+            return -1;
+        }
+
+        chain_stage_t* stage = append_stage(chain, CHAIN_SCALE_UP, token, length);
+        if (stage == NULL) {
+            return -1;
+        }
+
+        stage->factor = factor;
+        return 0;
+    }
+
+    for (size_t k = 0; k < NB_CHAIN_POINTWISE; k++) {
+        if (!token_is(token, name_length, chain_pointwise[k].name)) {
+            continue;
+        }
+
+        if ((size_t)nb_args != chain_pointwise[k].nb_args) {
+            LOG_ERROR("filter %s takes %zu arguments, got `%.*s`", chain_pointwise[k].name, chain_pointwise[k].nb_args,
+                      (int)length, token);
+            return -1;
+        }
+
+        filter_pointwise_t op = {.op = chain_pointwise[k].op};
+        for (int i = 0; i < nb_args; i++) {
+            if (args[i] > 255) {
+                LOG_ERROR("pixel value %lu out of range in `%.*s`", args[i], (int)length, token);
+                return -1;
+            }
+            op.pixel.bytes[i] = args[i];
+        }
+
+        return append_pointwise(chain, &op, token, length);
+    }
+
+    for (size_t k = 0; k < NB_CHAIN_FILTERS; k++) {
+        if (!token_is(token, name_length, chain_filters[k].name)) {
+            continue;
+        }
+
+        if (nb_args != 0) {
+            LOG_ERROR("filter %s takes no argument, got `%.*s`", chain_filters[k].name, (int)length, token);
+            return -1;
+        }
+
+        chain_stage_t* stage = append_stage(chain, CHAIN_FILTER, token, length);
+        if (stage == NULL) {
+            return -1;
+        }
+
+        stage->filter = chain_filters[k].filter;
+        stage->rows   = chain_filters[k].rows;
+        stage->border = chain_filters[k].border;
+        return 0;
+    }
+
+    LOG_ERROR("unknown filter `%.*s` in `%s`", (int)name_length, token, description);
+    return -1;
+}
+
+filter_chain_t* filter_chain_parse(const char* description) {
+    filter_chain_t* chain = calloc(1, sizeof(*chain));
+    if (chain == NULL) {
+        LOG_ERROR_ERRNO("calloc");
+        goto fail_exit;
+    }
+
+    const char* token = description;
+    while (1) {
+        size_t length = strcspn(token, ",");
+        if (length == 0) {
+            LOG_ERROR("empty filter in `%s`", description);
+            goto fail_destroy_chain;
+        }
+
+        if (parse_filter(chain, token, length, description) < 0) {
+            goto fail_destroy_chain;
+        }
+
+        if (token[length] == '\0') {
+            break;
+        }
+        token += length + 1;
+    }
+
+    return chain;
+
+fail_destroy_chain:
+    filter_chain_destroy(chain);
+fail_exit:
+    return NULL;
+}
+
+void filter_chain_destroy(filter_chain_t* chain) {
+    if (chain == NULL) {
+        return;
+    }
+
+    for (size_t s = 0; s < chain->nb_stages; s++) {
+        free(chain->stages[s].name);
+        free(chain->stages[s].ops);
+    }
+    free(chain->stages);
+    free(chain);
+}
+
+size_t filter_chain_length(const filter_chain_t* chain) {
+    return chain->nb_stages;
+}
+
+const char* filter_chain_stage_name(const filter_chain_t* chain, size_t stage) {
+    return chain->stages[stage].name;
+}
+
+bool filter_chain_stage_size(const filter_chain_t* chain, size_t stage, size_t width, size_t height,
+                             size_t* new_width, size_t* new_height) {
+    const chain_stage_t* s = &chain->stages[stage];
+
+    /* the filters with a border return NULL rather than an empty image */
+
+    if (s->kind == CHAIN_FILTER && s->border > 0 && (width < 2 * s->border + 1 || height < 2 * s->border + 1)) {
+        *new_width  = 0;
+        *new_height = 0;
+        return false;
+    }
+
+    switch (s->kind) {
+    case CHAIN_SCALE_UP:
+        *new_width  = s->factor * width;
+        *new_height = s->factor * height;
+        break;
+    case CHAIN_POINTWISE:
+        *new_width  = width;
+        *new_height = height;
+        break;
+    case CHAIN_FILTER:
+        *new_width  = width - 2 * s->border;
+        *new_height = height - 2 * s->border;
+        break;
+    }
+
+    return true;
+}
+
+bool filter_chain_accepts(const filter_chain_t* chain, size_t width, size_t height) {
+    for (size_t s = 0; s < chain->nb_stages; s++) {
+        if (!filter_chain_stage_size(chain, s, width, height, &width, &height)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+size_t filter_chain_footprint(const filter_chain_t* chain, size_t width, size_t height) {
+    size_t footprint = width * height * sizeof(pixel_t);
+
+    for (size_t s = 0; s < chain->nb_stages; s++) {
+        size_t new_width, new_height;
+        filter_chain_stage_size(chain, s, width, height, &new_width, &new_height);
+
+        size_t bytes = (width * height + new_width * new_height) * sizeof(pixel_t);
+        footprint    = (bytes > footprint) ? bytes : footprint;
+        width        = new_width;
+        height       = new_height;
+    }
+
+    return footprint;
+}
+
+image_t* filter_chain_stage_apply(const filter_chain_t* chain, size_t stage, image_t* image) {
+    const chain_stage_t* s = &chain->stages[stage];
+
+    switch (s->kind) {
+    case CHAIN_SCALE_UP:
+        return filter_scale_up(image, s->factor);
+    case CHAIN_POINTWISE:
+        return filter_pointwise(image, s->ops, s->nb_ops);
+    case CHAIN_FILTER:
+        return s->filter(image);
+    }
+
+    return NULL;
+}
+
+bool filter_chain_stage_has_rows(const filter_chain_t* chain, size_t stage) {
+    return chain->stages[stage].kind != CHAIN_FILTER || chain->stages[stage].rows != NULL;
+}
+
+void filter_chain_stage_rows(const filter_chain_t* chain, size_t stage, image_t* image, image_t* new_image,
+                             size_t row_begin, size_t row_end) {
+    const chain_stage_t* s = &chain->stages[stage];
+
+    switch (s->kind) {
+    case CHAIN_SCALE_UP:
+        filter_scale_up_rows(image, new_image, s->factor, row_begin, row_end);
+        break;
+    case CHAIN_POINTWISE:
+        filter_pointwise_rows(image, new_image, s->ops, s->nb_ops, row_begin, row_end);
+        break;
+    case CHAIN_FILTER:
+        s->rows(image, new_image, row_begin, row_end);
+        break;
+    }
+}
+
+/* how many stages from this one filter_scale_sharpen_sobel() covers, 0 or 3 */
+
+static size_t fused_stages(const filter_chain_t* chain, size_t stage) {
+    const chain_stage_t* s = &chain->stages[stage];
+
+    if (stage + 2 < chain->nb_stages && s[0].kind == CHAIN_SCALE_UP && s[1].kind == CHAIN_FILTER &&
+        s[1].filter == filter_sharpen && s[2].kind == CHAIN_FILTER && s[2].filter == filter_sobel) {
+        return 3;
+    }
+
+    return 0;
+}
+
+image_t* filter_chain_apply(const filter_chain_t* chain, image_t* image) {
+    image_t* current = image;
+
+    for (size_t s = 0; s < chain->nb_stages;) {
+        image_t* next = NULL;
+        size_t fused  = fused_stages(chain, s);
+
+        if (fused > 0) {
+            next = filter_scale_sharpen_sobel(current, chain->stages[s].factor);
+            s   += fused;
+        } else {
+            next = filter_chain_stage_apply(chain, s, current);
+            s++;
+        }
+
+        if (current != image) {
+            image_destroy(current);
+        }
+        if (next == NULL) {
+            return NULL;
+        }
+        current = next;
+    }
+
+    return current;
+}
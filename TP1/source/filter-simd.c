@@ -0,0 +1,463 @@
+#include "filter-simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+/*
+ * pixels are widened to one 16 bits lane per channel with unpacklo/unpackhi, which keeps the pixel order
+ * once packed back with packus, including across the two 128 bits halves of the AVX2 registers
+ *
+ * the alpha channel is computed like the others then replaced by the alpha of the center pixel
+ */
+
+#define ALPHA_MASK ((int)0xff000000)
+
+bool filter_simd_has_sse(void) {
+    return __builtin_cpu_supports("sse4.1");
+}
+
+bool filter_simd_has_avx2(void) {
+    return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("sse4.1"))) static inline __m128i sobel_sse(__m128i t[3][3]) {
+    __m128i gx = _mm_add_epi16(_mm_add_epi16(t[0][0], t[2][0]), _mm_slli_epi16(t[1][0], 1));
+    gx         = _mm_sub_epi16(gx, _mm_add_epi16(_mm_add_epi16(t[0][2], t[2][2]), _mm_slli_epi16(t[1][2], 1)));
+
+    __m128i gy = _mm_add_epi16(_mm_add_epi16(t[0][0], t[0][2]), _mm_slli_epi16(t[0][1], 1));
+    gy         = _mm_sub_epi16(gy, _mm_add_epi16(_mm_add_epi16(t[2][0], t[2][2]), _mm_slli_epi16(t[2][1], 1)));
+
+    return _mm_add_epi16(_mm_abs_epi16(gx), _mm_abs_epi16(gy));
+}
+
+__attribute__((target("sse4.1"))) size_t filter_sobel_row_sse(const pixel_t* rows[3], pixel_t* out, size_t width) {
+    const __m128i zero  = _mm_setzero_si128();
+    const __m128i alpha = _mm_set1_epi32(ALPHA_MASK);
+
+    size_t i = 0;
+    for (; i + 4 <= width; i += 4) {
+        __m128i lo[3][3];
+        __m128i hi[3][3];
+
+        for (int y = 0; y < 3; y++) {
+            for (int x = 0; x < 3; x++) {
+                __m128i v = _mm_loadu_si128((const __m128i*)&rows[y][i + x]);
+                lo[y][x]  = _mm_unpacklo_epi8(v, zero);
+                hi[y][x]  = _mm_unpackhi_epi8(v, zero);
+            }
+        }
+
+        __m128i result = _mm_packus_epi16(sobel_sse(lo), sobel_sse(hi));
+        __m128i center = _mm_loadu_si128((const __m128i*)&rows[1][i + 1]);
+        _mm_storeu_si128((__m128i*)&out[i], _mm_blendv_epi8(result, center, alpha));
+    }
+
+    return i;
+}
+
+__attribute__((target("sse4.1"))) size_t filter_convolution33_row_sse(const pixel_t* rows[3], pixel_t* out,
+                                                                      size_t width, const int16_t weights[3][3],
+                                                                      int shift) {
+    const __m128i zero  = _mm_setzero_si128();
+    const __m128i alpha = _mm_set1_epi32(ALPHA_MASK);
+    const __m128i count = _mm_cvtsi32_si128(shift);
+
+    __m128i w[3][3];
+    for (int y = 0; y < 3; y++) {
+        for (int x = 0; x < 3; x++) {
+            w[y][x] = _mm_set1_epi16(weights[y][x]);
+        }
+    }
+
+    size_t i = 0;
+    for (; i + 4 <= width; i += 4) {
+        __m128i lo = zero;
+        __m128i hi = zero;
+
+        for (int y = 0; y < 3; y++) {
+            for (int x = 0; x < 3; x++) {
+                __m128i v = _mm_loadu_si128((const __m128i*)&rows[y][i + x]);
+                lo        = _mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), w[y][x]));
+                hi        = _mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), w[y][x]));
+            }
+        }
+
+        /* negative sums stay negative after the arithmetic shift and packus clamps them to 0 */
+
+        __m128i result = _mm_packus_epi16(_mm_sra_epi16(lo, count), _mm_sra_epi16(hi, count));
+        __m128i center = _mm_loadu_si128((const __m128i*)&rows[1][i + 1]);
+        _mm_storeu_si128((__m128i*)&out[i], _mm_blendv_epi8(result, center, alpha));
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2"))) static inline __m256i sobel_avx2(__m256i t[3][3]) {
+    __m256i gx = _mm256_add_epi16(_mm256_add_epi16(t[0][0], t[2][0]), _mm256_slli_epi16(t[1][0], 1));
+    gx = _mm256_sub_epi16(gx, _mm256_add_epi16(_mm256_add_epi16(t[0][2], t[2][2]), _mm256_slli_epi16(t[1][2], 1)));
+
+    __m256i gy = _mm256_add_epi16(_mm256_add_epi16(t[0][0], t[0][2]), _mm256_slli_epi16(t[0][1], 1));
+    gy = _mm256_sub_epi16(gy, _mm256_add_epi16(_mm256_add_epi16(t[2][0], t[2][2]), _mm256_slli_epi16(t[2][1], 1)));
+
+    return _mm256_add_epi16(_mm256_abs_epi16(gx), _mm256_abs_epi16(gy));
+}
+
+__attribute__((target("avx2"))) size_t filter_sobel_row_avx2(const pixel_t* rows[3], pixel_t* out, size_t width) {
+    const __m256i zero  = _mm256_setzero_si256();
+    const __m256i alpha = _mm256_set1_epi32(ALPHA_MASK);
+
+    size_t i = 0;
+    for (; i + 8 <= width; i += 8) {
+        __m256i lo[3][3];
+        __m256i hi[3][3];
+
+        for (int y = 0; y < 3; y++) {
+            for (int x = 0; x < 3; x++) {
+                __m256i v = _mm256_loadu_si256((const __m256i*)&rows[y][i + x]);
+                lo[y][x]  = _mm256_unpacklo_epi8(v, zero);
+                hi[y][x]  = _mm256_unpackhi_epi8(v, zero);
+            }
+        }
+
+        __m256i result = _mm256_packus_epi16(sobel_avx2(lo), sobel_avx2(hi));
+        __m256i center = _mm256_loadu_si256((const __m256i*)&rows[1][i + 1]);
+        _mm256_storeu_si256((__m256i*)&out[i], _mm256_blendv_epi8(result, center, alpha));
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2"))) size_t filter_convolution33_row_avx2(const pixel_t* rows[3], pixel_t* out,
+                                                                     size_t width, const int16_t weights[3][3],
+                                                                     int shift) {
+    const __m256i zero  = _mm256_setzero_si256();
+    const __m256i alpha = _mm256_set1_epi32(ALPHA_MASK);
+    const __m128i count = _mm_cvtsi32_si128(shift);
+
+    __m256i w[3][3];
+    for (int y = 0; y < 3; y++) {
+        for (int x = 0; x < 3; x++) {
+            w[y][x] = _mm256_set1_epi16(weights[y][x]);
+        }
+    }
+
+    size_t i = 0;
+    for (; i + 8 <= width; i += 8) {
+        __m256i lo = zero;
+        __m256i hi = zero;
+
+        for (int y = 0; y < 3; y++) {
+            for (int x = 0; x < 3; x++) {
+                __m256i v = _mm256_loadu_si256((const __m256i*)&rows[y][i + x]);
+                lo        = _mm256_add_epi16(lo, _mm256_mullo_epi16(_mm256_unpacklo_epi8(v, zero), w[y][x]));
+                hi        = _mm256_add_epi16(hi, _mm256_mullo_epi16(_mm256_unpackhi_epi8(v, zero), w[y][x]));
+            }
+        }
+
+        __m256i result = _mm256_packus_epi16(_mm256_sra_epi16(lo, count), _mm256_sra_epi16(hi, count));
+        __m256i center = _mm256_loadu_si256((const __m256i*)&rows[1][i + 1]);
+        _mm256_storeu_si256((__m256i*)&out[i], _mm256_blendv_epi8(result, center, alpha));
+    }
+
+    return i;
+}
+
+__attribute__((target("sse4.1"))) size_t filter_scale_up2_row_sse(const pixel_t* in, pixel_t* out, size_t width) {
+    size_t i = 0;
+    for (; i + 4 <= width; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)&in[i]);
+        _mm_storeu_si128((__m128i*)&out[2 * i], _mm_unpacklo_epi32(v, v));
+        _mm_storeu_si128((__m128i*)&out[2 * i + 4], _mm_unpackhi_epi32(v, v));
+    }
+
+    return i;
+}
+
+/* unpacklo/unpackhi work within each 128 bits half, the permutes put the pixels back in order */
+
+__attribute__((target("avx2"))) size_t filter_scale_up2_row_avx2(const pixel_t* in, pixel_t* out, size_t width) {
+    size_t i = 0;
+    for (; i + 8 <= width; i += 8) {
+        __m256i v  = _mm256_loadu_si256((const __m256i*)&in[i]);
+        __m256i lo = _mm256_unpacklo_epi32(v, v);
+        __m256i hi = _mm256_unpackhi_epi32(v, v);
+        _mm256_storeu_si256((__m256i*)&out[2 * i], _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i*)&out[2 * i + 8], _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+
+    return i;
+}
+
+/*
+ * the color conversions work on one 32 bits lane per pixel, the divisions of rgb_to_hsv() are done in single
+ * precision: both operands are integers below 2^16 and the divisor below 2^8, so the rounding error of the
+ * quotient is far smaller than its distance to the next integer and truncating it gives the integer division
+ */
+
+__attribute__((target("sse4.1"))) static inline __m128i channel_sse(__m128i pixels, int shift) {
+    return _mm_and_si128(_mm_srli_epi32(pixels, shift), _mm_set1_epi32(0xff));
+}
+
+__attribute__((target("sse4.1"))) static inline __m128i divide_sse(__m128i x, __m128i d) {
+    return _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(x), _mm_cvtepi32_ps(d)));
+}
+
+__attribute__((target("sse4.1"))) size_t filter_to_hsv_row_sse(const pixel_t* in, pixel_t* out, size_t width) {
+    const __m128i one   = _mm_set1_epi32(1);
+    const __m128i alpha = _mm_set1_epi32(ALPHA_MASK);
+
+    size_t i = 0;
+    for (; i + 4 <= width; i += 4) {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)&in[i]);
+        __m128i r      = channel_sse(pixels, 0);
+        __m128i g      = channel_sse(pixels, 8);
+        __m128i b      = channel_sse(pixels, 16);
+
+        __m128i cmax  = _mm_max_epi32(r, _mm_max_epi32(g, b));
+        __m128i delta = _mm_sub_epi32(cmax, _mm_min_epi32(r, _mm_min_epi32(g, b)));
+
+        __m128i is_r = _mm_cmpeq_epi32(cmax, r);
+        __m128i is_g = _mm_andnot_si128(is_r, _mm_cmpeq_epi32(cmax, g));
+
+        __m128i numerator = _mm_blendv_epi8(_mm_sub_epi32(r, g), _mm_sub_epi32(b, r), is_g);
+        numerator         = _mm_blendv_epi8(numerator, _mm_sub_epi32(g, b), is_r);
+        __m128i base      = _mm_blendv_epi8(_mm_set1_epi32(171), _mm_set1_epi32(85), is_g);
+        base              = _mm_andnot_si128(is_r, base);
+
+        __m128i gray     = _mm_cmpeq_epi32(delta, _mm_setzero_si128());
+        __m128i product  = _mm_mullo_epi32(numerator, _mm_set1_epi32(43));
+        __m128i quotient = divide_sse(product, _mm_max_epi32(delta, one));
+        __m128i h        = _mm_andnot_si128(gray, _mm_add_epi32(base, quotient));
+        __m128i s        = divide_sse(_mm_mullo_epi32(delta, _mm_set1_epi32(255)), _mm_max_epi32(cmax, one));
+
+        __m128i hsv = _mm_and_si128(h, _mm_set1_epi32(0xff));
+        hsv         = _mm_or_si128(hsv, _mm_slli_epi32(s, 8));
+        hsv         = _mm_or_si128(hsv, _mm_slli_epi32(cmax, 16));
+        _mm_storeu_si128((__m128i*)&out[i], _mm_or_si128(hsv, _mm_and_si128(pixels, alpha)));
+    }
+
+    return i;
+}
+
+/* (v * (255 - x)) >> 8 */
+
+__attribute__((target("sse4.1"))) static inline __m128i attenuate_sse(__m128i v, __m128i x) {
+    return _mm_srli_epi32(_mm_mullo_epi32(v, _mm_sub_epi32(_mm_set1_epi32(255), x)), 8);
+}
+
+/* picks a in the lanes whose region bit is in regions and b in the others */
+
+__attribute__((target("sse4.1"))) static inline __m128i select_sse(__m128i region_bit, int regions, __m128i a,
+                                                                   __m128i b) {
+    __m128i in_regions = _mm_and_si128(region_bit, _mm_set1_epi32(regions));
+    __m128i mask       = _mm_cmpeq_epi32(in_regions, _mm_setzero_si128());
+    return _mm_blendv_epi8(a, b, mask);
+}
+
+__attribute__((target("sse4.1"))) size_t filter_to_rgb_row_sse(const pixel_t* in, pixel_t* out, size_t width) {
+    const __m128i alpha = _mm_set1_epi32(ALPHA_MASK);
+    const __m128i bits  = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+
+    size_t i = 0;
+    for (; i + 4 <= width; i += 4) {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)&in[i]);
+        __m128i h      = channel_sse(pixels, 0);
+        __m128i s      = channel_sse(pixels, 8);
+        __m128i v      = channel_sse(pixels, 16);
+
+        /* h / 43 for 0 <= h < 256, turned into one bit per region so a set of regions is a mask */
+
+        __m128i region     = _mm_srli_epi32(_mm_mullo_epi32(h, _mm_set1_epi32(1525)), 16);
+        __m128i region_bit = _mm_and_si128(_mm_shuffle_epi8(bits, region), _mm_set1_epi32(0xff));
+        __m128i remainder  = _mm_sub_epi32(h, _mm_mullo_epi32(region, _mm_set1_epi32(43)));
+        remainder          = _mm_mullo_epi32(remainder, _mm_set1_epi32(6));
+        __m128i inverse    = _mm_sub_epi32(_mm_set1_epi32(255), remainder);
+
+        __m128i p = attenuate_sse(v, s);
+        __m128i q = attenuate_sse(v, _mm_srli_epi32(_mm_mullo_epi32(s, remainder), 8));
+        __m128i t = attenuate_sse(v, _mm_srli_epi32(_mm_mullo_epi32(s, inverse), 8));
+
+        __m128i r = select_sse(region_bit, 0x02, q, v);
+        r         = select_sse(region_bit, 0x0c, p, r);
+        r         = select_sse(region_bit, 0x10, t, r);
+        __m128i g = select_sse(region_bit, 0x01, t, p);
+        g         = select_sse(region_bit, 0x06, v, g);
+        g         = select_sse(region_bit, 0x08, q, g);
+        __m128i b = select_sse(region_bit, 0x04, t, p);
+        b         = select_sse(region_bit, 0x18, v, b);
+        b         = select_sse(region_bit, 0x20, q, b);
+
+        /* a gray pixel takes v on every channel */
+
+        __m128i gray = _mm_cmpeq_epi32(s, _mm_setzero_si128());
+        r            = _mm_blendv_epi8(r, v, gray);
+        g            = _mm_blendv_epi8(g, v, gray);
+        b            = _mm_blendv_epi8(b, v, gray);
+
+        __m128i rgb = _mm_or_si128(r, _mm_or_si128(_mm_slli_epi32(g, 8), _mm_slli_epi32(b, 16)));
+        _mm_storeu_si128((__m128i*)&out[i], _mm_or_si128(rgb, _mm_and_si128(pixels, alpha)));
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2"))) static inline __m256i channel_avx2(__m256i pixels, int shift) {
+    return _mm256_and_si256(_mm256_srli_epi32(pixels, shift), _mm256_set1_epi32(0xff));
+}
+
+__attribute__((target("avx2"))) static inline __m256i divide_avx2(__m256i x, __m256i d) {
+    return _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(x), _mm256_cvtepi32_ps(d)));
+}
+
+__attribute__((target("avx2"))) size_t filter_to_hsv_row_avx2(const pixel_t* in, pixel_t* out, size_t width) {
+    const __m256i one   = _mm256_set1_epi32(1);
+    const __m256i alpha = _mm256_set1_epi32(ALPHA_MASK);
+
+    size_t i = 0;
+    for (; i + 8 <= width; i += 8) {
+        __m256i pixels = _mm256_loadu_si256((const __m256i*)&in[i]);
+        __m256i r      = channel_avx2(pixels, 0);
+        __m256i g      = channel_avx2(pixels, 8);
+        __m256i b      = channel_avx2(pixels, 16);
+
+        __m256i cmax  = _mm256_max_epi32(r, _mm256_max_epi32(g, b));
+        __m256i delta = _mm256_sub_epi32(cmax, _mm256_min_epi32(r, _mm256_min_epi32(g, b)));
+
+        __m256i is_r = _mm256_cmpeq_epi32(cmax, r);
+        __m256i is_g = _mm256_andnot_si256(is_r, _mm256_cmpeq_epi32(cmax, g));
+
+        __m256i numerator = _mm256_blendv_epi8(_mm256_sub_epi32(r, g), _mm256_sub_epi32(b, r), is_g);
+        numerator         = _mm256_blendv_epi8(numerator, _mm256_sub_epi32(g, b), is_r);
+        __m256i base      = _mm256_blendv_epi8(_mm256_set1_epi32(171), _mm256_set1_epi32(85), is_g);
+        base              = _mm256_andnot_si256(is_r, base);
+
+        __m256i gray     = _mm256_cmpeq_epi32(delta, _mm256_setzero_si256());
+        __m256i product  = _mm256_mullo_epi32(numerator, _mm256_set1_epi32(43));
+        __m256i quotient = divide_avx2(product, _mm256_max_epi32(delta, one));
+        __m256i h        = _mm256_andnot_si256(gray, _mm256_add_epi32(base, quotient));
+        __m256i s        = divide_avx2(_mm256_mullo_epi32(delta, _mm256_set1_epi32(255)), _mm256_max_epi32(cmax, one));
+
+        __m256i hsv = _mm256_and_si256(h, _mm256_set1_epi32(0xff));
+        hsv         = _mm256_or_si256(hsv, _mm256_slli_epi32(s, 8));
+        hsv         = _mm256_or_si256(hsv, _mm256_slli_epi32(cmax, 16));
+        _mm256_storeu_si256((__m256i*)&out[i], _mm256_or_si256(hsv, _mm256_and_si256(pixels, alpha)));
+    }
+
+    return i;
+}
+
+/* (v * (255 - x)) >> 8 */
+
+__attribute__((target("avx2"))) static inline __m256i attenuate_avx2(__m256i v, __m256i x) {
+    return _mm256_srli_epi32(_mm256_mullo_epi32(v, _mm256_sub_epi32(_mm256_set1_epi32(255), x)), 8);
+}
+
+/* picks a in the lanes whose region bit is in regions and b in the others */
+
+__attribute__((target("avx2"))) static inline __m256i select_avx2(__m256i region_bit, int regions, __m256i a,
+                                                                 __m256i b) {
+    __m256i in_regions = _mm256_and_si256(region_bit, _mm256_set1_epi32(regions));
+    __m256i mask       = _mm256_cmpeq_epi32(in_regions, _mm256_setzero_si256());
+    return _mm256_blendv_epi8(a, b, mask);
+}
+
+__attribute__((target("avx2"))) size_t filter_to_rgb_row_avx2(const pixel_t* in, pixel_t* out, size_t width) {
+    const __m256i alpha = _mm256_set1_epi32(ALPHA_MASK);
+
+    size_t i = 0;
+    for (; i + 8 <= width; i += 8) {
+        __m256i pixels = _mm256_loadu_si256((const __m256i*)&in[i]);
+        __m256i h      = channel_avx2(pixels, 0);
+        __m256i s      = channel_avx2(pixels, 8);
+        __m256i v      = channel_avx2(pixels, 16);
+
+        /* h / 43 for 0 <= h < 256, turned into one bit per region so a set of regions is a mask */
+
+        __m256i region     = _mm256_srli_epi32(_mm256_mullo_epi32(h, _mm256_set1_epi32(1525)), 16);
+        __m256i region_bit = _mm256_sllv_epi32(_mm256_set1_epi32(1), region);
+        __m256i remainder  = _mm256_sub_epi32(h, _mm256_mullo_epi32(region, _mm256_set1_epi32(43)));
+        remainder          = _mm256_mullo_epi32(remainder, _mm256_set1_epi32(6));
+        __m256i inverse    = _mm256_sub_epi32(_mm256_set1_epi32(255), remainder);
+
+        __m256i p = attenuate_avx2(v, s);
+        __m256i q = attenuate_avx2(v, _mm256_srli_epi32(_mm256_mullo_epi32(s, remainder), 8));
+        __m256i t = attenuate_avx2(v, _mm256_srli_epi32(_mm256_mullo_epi32(s, inverse), 8));
+
+        __m256i r = select_avx2(region_bit, 0x02, q, v);
+        r         = select_avx2(region_bit, 0x0c, p, r);
+        r         = select_avx2(region_bit, 0x10, t, r);
+        __m256i g = select_avx2(region_bit, 0x01, t, p);
+        g         = select_avx2(region_bit, 0x06, v, g);
+        g         = select_avx2(region_bit, 0x08, q, g);
+        __m256i b = select_avx2(region_bit, 0x04, t, p);
+        b         = select_avx2(region_bit, 0x18, v, b);
+        b         = select_avx2(region_bit, 0x20, q, b);
+
+        /* a gray pixel takes v on every channel */
+
+        __m256i gray = _mm256_cmpeq_epi32(s, _mm256_setzero_si256());
+        r            = _mm256_blendv_epi8(r, v, gray);
+        g            = _mm256_blendv_epi8(g, v, gray);
+        b            = _mm256_blendv_epi8(b, v, gray);
+
+        __m256i rgb = _mm256_or_si256(r, _mm256_or_si256(_mm256_slli_epi32(g, 8), _mm256_slli_epi32(b, 16)));
+        _mm256_storeu_si256((__m256i*)&out[i], _mm256_or_si256(rgb, _mm256_and_si256(pixels, alpha)));
+    }
+
+    return i;
+}
+
+#else /* defined(__x86_64__) || defined(__i386__) */
+
+bool filter_simd_has_sse(void) {
+    return false;
+}
+
+bool filter_simd_has_avx2(void) {
+    return false;
+}
+
+size_t filter_sobel_row_sse(const pixel_t* rows[3], pixel_t* out, size_t width) {
+    return 0;
+}
+
+size_t filter_sobel_row_avx2(const pixel_t* rows[3], pixel_t* out, size_t width) {
+    return 0;
+}
+
+size_t filter_convolution33_row_sse(const pixel_t* rows[3], pixel_t* out, size_t width, const int16_t weights[3][3],
+                                    int shift) {
+    return 0;
+}
+
+size_t filter_convolution33_row_avx2(const pixel_t* rows[3], pixel_t* out, size_t width, const int16_t weights[3][3],
+                                     int shift) {
+    return 0;
+}
+
+size_t filter_scale_up2_row_sse(const pixel_t* in, pixel_t* out, size_t width) {
+    return 0;
+}
+
+size_t filter_scale_up2_row_avx2(const pixel_t* in, pixel_t* out, size_t width) {
+    return 0;
+}
+
+size_t filter_to_hsv_row_sse(const pixel_t* in, pixel_t* out, size_t width) {
+    return 0;
+}
+
+size_t filter_to_hsv_row_avx2(const pixel_t* in, pixel_t* out, size_t width) {
+    return 0;
+}
+
+size_t filter_to_rgb_row_sse(const pixel_t* in, pixel_t* out, size_t width) {
+    return 0;
+}
+
+size_t filter_to_rgb_row_avx2(const pixel_t* in, pixel_t* out, size_t width) {
+    return 0;
+}
+
+#endif /* defined(__x86_64__) || defined(__i386__) */
@@ -1,149 +1,279 @@
 /* DO NOT EDIT THIS FILE */
 
 #include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "filter-simd.h"
+#include "filter.h"
 #include "image.h"
+#include "log.h"
 
 #define max(a, b) (((a) < (b)) ? (b) : (a))
 #define min(a, b) (((a) < (b)) ? (a) : (b))
 #define clamp(x, min, max) ((x) < (min)) ? (min) : (((x) > (max)) ? (max) : (x))
 
-static void hsv_to_rgb(unsigned char hsv[3], unsigned char rgb[3]) {
-    unsigned char h = hsv[0];
-    unsigned char s = hsv[1];
-    unsigned char v = hsv[2];
+/*
+ * conversions from https://stackoverflow.com/a/14733008 without branches, bit-exact with the original ones
+ *
+ * the divisions by cmax - cmin and by v go through reciprocals: for 0 <= x < 2^16 and 1 <= d < 2^8,
+ * (x * ceil(2^24 / d)) >> 24 is exactly x / d
+ */
+
+#define RECIPROCAL(d) (((d) == 0) ? 0 : (uint32_t)(((1u << 24) + (d) - 1) / (d)))
+#define RECIPROCAL4(d) RECIPROCAL(d), RECIPROCAL((d) + 1), RECIPROCAL((d) + 2), RECIPROCAL((d) + 3)
+#define RECIPROCAL16(d) RECIPROCAL4(d), RECIPROCAL4((d) + 4), RECIPROCAL4((d) + 8), RECIPROCAL4((d) + 12)
+#define RECIPROCAL64(d) RECIPROCAL16(d), RECIPROCAL16((d) + 16), RECIPROCAL16((d) + 32), RECIPROCAL16((d) + 48)
+
+static const uint32_t reciprocals[256] = {
+    RECIPROCAL64(0),
+    RECIPROCAL64(64),
+    RECIPROCAL64(128),
+    RECIPROCAL64(192),
+};
+
+static inline int divide(int x, int d) {
+    return (int)(((uint64_t)x * reciprocals[d]) >> 24);
+}
 
-    unsigned char r = 0;
-    unsigned char g = 0;
-    unsigned char b = 0;
+/* for every hue region, the index in {v, p, q, t} of the red, green and blue values */
 
-    /* taken from https://stackoverflow.com/a/14733008 */
+static const unsigned char hsv_sources[6][3] = {
+    {0, 3, 1}, {2, 0, 1}, {1, 0, 3}, {1, 2, 0}, {3, 1, 0}, {0, 1, 2},
+};
 
-    if (s == 0) {
-        r = v;
-        g = v;
-        b = v;
-        goto done;
-    }
+static void hsv_to_rgb(unsigned char hsv[3], unsigned char rgb[3]) {
+    int h = hsv[0];
+    int s = hsv[1];
+    int v = hsv[2];
 
-    unsigned char region    = h / 43;
-    unsigned char remainder = (h - (region * 43)) * 6;
+    /* h / 43 for 0 <= h < 256, the remainder is kept on 8 bits like in the original */
 
-    unsigned char p = (v * (255 - s)) >> 8;
-    unsigned char q = (v * (255 - ((s * remainder) >> 8))) >> 8;
-    unsigned char t = (v * (255 - ((s * (255 - remainder)) >> 8))) >> 8;
+    int region    = (h * 1525) >> 16;
+    int remainder = (h - region * 43) * 6;
 
-    switch (region) {
-    case 0:
-        r = v;
-        g = t;
-        b = p;
-        break;
-    case 1:
-        r = q;
-        g = v;
-        b = p;
-        break;
-    case 2:
-        r = p;
-        g = v;
-        b = t;
-        break;
-    case 3:
-        r = p;
-        g = q;
-        b = v;
-        break;
-    case 4:
-        r = t;
-        g = p;
-        b = v;
-        break;
-    default:
-        r = v;
-        g = p;
-        b = q;
-        break;
-    }
+    unsigned char values[4] = {
+        v,
+        (v * (255 - s)) >> 8,
+        (v * (255 - ((s * remainder) >> 8))) >> 8,
+        (v * (255 - ((s * (255 - remainder)) >> 8))) >> 8,
+    };
+
+    /* a gray pixel takes v on every channel */
 
-done:
-    rgb[0] = r;
-    rgb[1] = g;
-    rgb[2] = b;
+    int gray = -(s == 0);
+    for (int k = 0; k < 3; k++) {
+        rgb[k] = (values[hsv_sources[region][k]] & ~gray) | (v & gray);
+    }
 }
 
 static void rgb_to_hsv(unsigned char rgb[3], unsigned char hsv[3]) {
-    unsigned char r = rgb[0];
-    unsigned char g = rgb[1];
-    unsigned char b = rgb[2];
+    int r = rgb[0];
+    int g = rgb[1];
+    int b = rgb[2];
+
+    int cmin  = min(r, min(g, b));
+    int cmax  = max(r, max(g, b));
+    int delta = cmax - cmin;
+
+    /* the hue is measured from the dominant channel, red wins ties, then green */
+
+    int is_r = -(cmax == r);
+    int is_g = ~is_r & -(cmax == g);
+    int is_b = ~is_r & ~is_g;
 
-    /* taken from https://stackoverflow.com/a/14733008 */
+    int numerator = ((g - b) & is_r) | ((b - r) & is_g) | ((r - g) & is_b);
+    int base      = (85 & is_g) | (171 & is_b);
 
-    unsigned char cmin = min(r, min(g, b));
-    unsigned char cmax = max(r, max(g, b));
+    /* truncated towards zero like the signed division it replaces, and 0 for a gray pixel */
 
-    unsigned char h = 0;
-    unsigned char s = 0;
-    unsigned char v = cmax;
+    int sign     = numerator >> (sizeof(int) * 8 - 1);
+    int quotient = divide(((43 * numerator) ^ sign) - sign, delta);
+    int hue      = base + ((quotient ^ sign) - sign);
 
-    if (v == 0) {
-        h = 0;
-        s = 0;
-        goto done;
+    hsv[0] = hue & -(delta != 0);
+    hsv[1] = divide(255 * delta, cmax);
+    hsv[2] = cmax;
+}
+
+/* unresolved until the first filter runs or filter_set_impl() is called, several workers may resolve it at once */
+
+static _Atomic int filter_impl = -1;
+
+static bool filter_impl_supported(filter_impl_t impl) {
+    switch (impl) {
+    case FILTER_IMPL_SCALAR:
+        return true;
+    case FILTER_IMPL_SSE:
+        return filter_simd_has_sse();
+    case FILTER_IMPL_AVX2:
+        return filter_simd_has_avx2();
+    default:
+        return false;
     }
+}
 
-    s = (255 * ((long)(cmax - cmin))) / v;
-    if (s == 0) {
-        h = 0;
-        goto done;
+int filter_set_impl(filter_impl_t impl) {
+    if (!filter_impl_supported(impl)) {
+        return -1;
     }
 
-    if (cmax == r) {
-        h = 0 + 43 * (g - b) / (cmax - cmin);
-    } else if (cmax == g) {
-        h = 85 + 43 * (b - r) / (cmax - cmin);
-    } else {
-        h = 171 + 43 * (r - g) / (cmax - cmin);
+    filter_impl = impl;
+    return 0;
+}
+
+filter_impl_t filter_get_impl(void) {
+    if (filter_impl < 0) {
+        if (filter_impl_supported(FILTER_IMPL_AVX2)) {
+            filter_impl = FILTER_IMPL_AVX2;
+        } else if (filter_impl_supported(FILTER_IMPL_SSE)) {
+            filter_impl = FILTER_IMPL_SSE;
+        } else {
+            filter_impl = FILTER_IMPL_SCALAR;
+        }
     }
 
-done:
-    hsv[0] = h;
-    hsv[1] = s;
-    hsv[2] = v;
+    return filter_impl;
 }
 
-image_t* filter_scale_up(image_t* image, size_t factor) {
-    image_t* new_image = image_create(image->id, factor * image->width, factor * image->height);
-    if (new_image == NULL) {
-        goto fail_exit;
+static const double sharpen_kernel[3][3] = {
+    {0, -2, 0},
+    {-2, 9, -2},
+    {0, -2, 0},
+};
+
+/*
+ * 3x3 kernel prepared for convolution33_row(). When every weight is an integer multiple of 2^-shift, the
+ * double sums of the reference implementation are exact, so an integer accumulation followed by a shift
+ * gives the same clamped output without any floating point math.
+ */
+
+#define KERNEL33_MAX_SHIFT 15
+
+typedef struct kernel33 {
+    const double (*m)[3];
+    bool fixed;
+    bool narrow; /* sums fit in int16, required by the vectorized kernels */
+    int shift;
+    int16_t weights[3][3];
+} kernel33_t;
+
+static void kernel33_compile(const double m[3][3], kernel33_t* kernel) {
+    kernel->m      = m;
+    kernel->fixed  = false;
+    kernel->narrow = false;
+
+    for (int shift = 0; shift <= KERNEL33_MAX_SHIFT; shift++) {
+        bool fixed = true;
+
+        for (int y = 0; y < 3 && fixed; y++) {
+            for (int x = 0; x < 3 && fixed; x++) {
+                double weight = ldexp(m[y][x], shift);
+
+                if (weight != floor(weight) || weight < INT16_MIN || weight > INT16_MAX) {
+                    fixed = false;
+                    continue;
+                }
+
+                kernel->weights[y][x] = (int16_t)weight;
+            }
+        }
+
+        if (fixed) {
+            int32_t sum = 0;
+            for (int y = 0; y < 3; y++) {
+                for (int x = 0; x < 3; x++) {
+                    sum += abs(kernel->weights[y][x]) * 255;
+                }
+            }
+
+            kernel->fixed  = true;
+            kernel->narrow = sum <= INT16_MAX;
+            kernel->shift  = shift;
+            return;
+        }
     }
+}
 
-    for (int j = 0; j < image->height; j++) {
-        for (int i = 0; i < image->width; i++) {
-            pixel_t* pixel = image_get_pixel(image, i, j);
+static void convolution33_row_double(const pixel_t* rows[3], pixel_t* out, size_t width, const double m[3][3]) {
+    for (size_t i = 0; i < width; i++) {
+        double values[3] = {0, 0, 0};
 
-            for (int kj = 0; kj < factor; kj++) {
-                for (int ki = 0; ki < factor; ki++) {
-                    pixel_t* new_pixel = image_get_pixel(new_image, factor * i + ki, factor * j + kj);
-                    *new_pixel         = *pixel;
+        for (int y = 0; y < 3; y++) {
+            for (int x = 0; x < 3; x++) {
+                const pixel_t* pixel = &rows[y][i + x];
+
+                for (int k = 0; k < 3; k++) {
+                    values[k] += pixel->bytes[k] * m[y][x];
                 }
             }
         }
+
+        for (int k = 0; k < 3; k++) {
+            out[i].bytes[k] = (unsigned char)clamp(values[k], 0, 255);
+        }
+
+        out[i].bytes[3] = rows[1][i + 1].bytes[3];
     }
+}
 
-    return new_image;
+static void convolution33_row_fixed(const pixel_t* rows[3], pixel_t* out, size_t width, const kernel33_t* kernel) {
+    const int shift = kernel->shift;
 
-fail_exit:
-    return NULL;
+    for (size_t i = 0; i < width; i++) {
+        int32_t values[3] = {0, 0, 0};
+
+        for (int y = 0; y < 3; y++) {
+            for (int x = 0; x < 3; x++) {
+                const pixel_t* pixel = &rows[y][i + x];
+                const int32_t weight = kernel->weights[y][x];
+
+                for (int k = 0; k < 3; k++) {
+                    values[k] += pixel->bytes[k] * weight;
+                }
+            }
+        }
+
+        /* a negative sum clamps to 0 before the shift, so the shift always rounds toward zero like the cast */
+
+        for (int k = 0; k < 3; k++) {
+            int32_t value   = (values[k] < 0) ? 0 : (values[k] >> shift);
+            out[i].bytes[k] = (unsigned char)min(value, 255);
+        }
+
+        out[i].bytes[3] = rows[1][i + 1].bytes[3];
+    }
 }
 
-image_t* filter_sobel(image_t* image) {
-    image_t* new_image = image_create(image->id, image->width - 2, image->height - 2);
-    if (new_image == NULL) {
-        goto fail_exit;
+/* computes one output row of a 3x3 convolution, rows[] are the three input rows centered on the output row */
+
+static void convolution33_row(const pixel_t* rows[3], pixel_t* out, size_t width, const kernel33_t* kernel) {
+    if (!kernel->fixed) {
+        convolution33_row_double(rows, out, width, kernel->m);
+        return;
     }
 
+    size_t done = 0;
+    if (kernel->narrow) {
+        switch (filter_get_impl()) {
+        case FILTER_IMPL_AVX2:
+            done = filter_convolution33_row_avx2(rows, out, width, kernel->weights, kernel->shift);
+            break;
+        case FILTER_IMPL_SSE:
+            done = filter_convolution33_row_sse(rows, out, width, kernel->weights, kernel->shift);
+            break;
+        default:
+            break;
+        }
+    }
+
+    const pixel_t* tail[3] = {rows[0] + done, rows[1] + done, rows[2] + done};
+    convolution33_row_fixed(tail, out + done, width - done, kernel);
+}
+
+static void sobel_row_scalar(const pixel_t* rows[3], pixel_t* out, size_t width) {
     const int gx[3][3] = {
         {1, 0, -1},
         {2, 0, -2},
@@ -156,53 +286,124 @@ image_t* filter_sobel(image_t* image) {
         {-1, -2, -1},
     };
 
-    for (int j = 1; j < image->height - 1; j++) {
-        for (int i = 1; i < image->width - 1; i++) {
-            int values_x[4] = {0, 0, 0, 0};
-            int values_y[4] = {0, 0, 0, 0};
+    for (size_t i = 0; i < width; i++) {
+        int values_x[3] = {0, 0, 0};
+        int values_y[3] = {0, 0, 0};
 
-            for (int y = -1; y <= 1; y++) {
-                for (int x = -1; x <= 1; x++) {
-                    pixel_t* pixel = image_get_pixel(image, i + x, j + y);
+        for (int y = 0; y < 3; y++) {
+            for (int x = 0; x < 3; x++) {
+                const pixel_t* pixel = &rows[y][i + x];
 
-                    for (int k = 0; k < 4; k++) {
-                        values_x[k] += pixel->bytes[k] * gx[y + 1][x + 1];
-                        values_y[k] += pixel->bytes[k] * gy[y + 1][x + 1];
-                    }
+                for (int k = 0; k < 3; k++) {
+                    values_x[k] += pixel->bytes[k] * gx[y][x];
+                    values_y[k] += pixel->bytes[k] * gy[y][x];
                 }
             }
+        }
 
-            pixel_t* new_pixel = image_get_pixel(new_image, i - 1, j - 1);
-            pixel_t* pixel     = image_get_pixel(image, i, j);
-
-            for (int k = 0; k < 3; k++) {
-                new_pixel->bytes[k] = clamp(abs(values_x[k]) + abs(values_y[k]), 0, 255);
-            }
-            new_pixel->bytes[3] = pixel->bytes[3];
+        for (int k = 0; k < 3; k++) {
+            out[i].bytes[k] = clamp(abs(values_x[k]) + abs(values_y[k]), 0, 255);
         }
+
+        out[i].bytes[3] = rows[1][i + 1].bytes[3];
     }
+}
 
-    return new_image;
+/* computes one output row of the sobel filter, same layout as convolution33_row() */
 
-fail_exit:
-    return NULL;
+static void sobel_row(const pixel_t* rows[3], pixel_t* out, size_t width) {
+    size_t done = 0;
+    switch (filter_get_impl()) {
+    case FILTER_IMPL_AVX2:
+        done = filter_sobel_row_avx2(rows, out, width);
+        break;
+    case FILTER_IMPL_SSE:
+        done = filter_sobel_row_sse(rows, out, width);
+        break;
+    default:
+        break;
+    }
+
+    const pixel_t* tail[3] = {rows[0] + done, rows[1] + done, rows[2] + done};
+    sobel_row_scalar(tail, out + done, width - done);
 }
 
-image_t* filter_to_hsv(image_t* image) {
-    image_t* new_image = image_create(image->id, image->width, image->height);
-    if (new_image == NULL) {
-        goto fail_exit;
+/* the _into() variants take the output size from the destination, it must match what the filter produces */
+
+static int check_size(image_t* image, image_t* new_image, size_t width, size_t height) {
+    if (new_image->width != width || new_image->height != height) {
+        LOG_ERROR("destination image is %zux%zu, expected %zux%zu", new_image->width, new_image->height, width, height);
+        return -1;
     }
 
-    for (int j = 0; j < image->height; j++) {
-        for (int i = 0; i < image->width; i++) {
-            pixel_t* pixel     = image_get_pixel(image, i, j);
-            pixel_t* new_pixel = image_get_pixel(new_image, i, j);
+    new_image->id = image->id;
+    return 0;
+}
 
-            rgb_to_hsv(pixel->bytes, new_pixel->bytes);
-            new_pixel->bytes[3] = pixel->bytes[3];
+static void scale_up2_row(const pixel_t* in, pixel_t* out, size_t width) {
+    size_t done = 0;
+    switch (filter_get_impl()) {
+    case FILTER_IMPL_AVX2:
+        done = filter_scale_up2_row_avx2(in, out, width);
+        break;
+    case FILTER_IMPL_SSE:
+        done = filter_scale_up2_row_sse(in, out, width);
+        break;
+    default:
+        break;
+    }
+
+    for (size_t i = done; i < width; i++) {
+        out[2 * i]     = in[i];
+        out[2 * i + 1] = in[i];
+    }
+}
+
+/* expands one input row into one output row scaled horizontally by factor */
+
+static void scale_up_row(const pixel_t* in, pixel_t* out, size_t width, size_t factor) {
+    if (factor == 2) {
+        scale_up2_row(in, out, width);
+        return;
+    }
+
+    for (size_t i = 0; i < width; i++) {
+        for (size_t k = 0; k < factor; k++) {
+            *out++ = in[i];
         }
     }
+}
+
+/* the factor output rows of an input row are identical, only the first one of the band is expanded */
+
+void filter_scale_up_rows(image_t* image, image_t* new_image, size_t factor, size_t row_begin, size_t row_end) {
+    for (size_t j = row_begin; j < row_end; j++) {
+        pixel_t* out = image_get_pixel(new_image, 0, j);
+
+        if (j > row_begin && j % factor != 0) {
+            memcpy(out, out - new_image->width, new_image->width * sizeof(*out));
+        } else {
+            scale_up_row(image_get_pixel(image, 0, j / factor), out, image->width, factor);
+        }
+    }
+}
+
+int filter_scale_up_into(image_t* image, image_t* new_image, size_t factor) {
+    if (check_size(image, new_image, factor * image->width, factor * image->height) < 0) {
+        return -1;
+    }
+
+    filter_scale_up_rows(image, new_image, factor, 0, new_image->height);
+    return 0;
+}
+
+image_t* filter_scale_up(image_t* image, size_t factor) {
+    image_t* new_image = image_create(image->id, factor * image->width, factor * image->height);
+    if (new_image == NULL) {
+        goto fail_exit;
+    }
+
+    filter_scale_up_into(image, new_image, factor);
 
     return new_image;
 
@@ -210,46 +411,176 @@ fail_exit:
     return NULL;
 }
 
-image_t* filter_to_rgb(image_t* image) {
-    image_t* new_image = image_create(image->id, image->width, image->height);
-    if (new_image == NULL) {
-        goto fail_exit;
+void filter_sobel_rows(image_t* image, image_t* new_image, size_t row_begin, size_t row_end) {
+    for (size_t j = row_begin; j < row_end; j++) {
+        const pixel_t* rows[3] = {
+            image_get_pixel(image, 0, j),
+            image_get_pixel(image, 0, j + 1),
+            image_get_pixel(image, 0, j + 2),
+        };
+
+        sobel_row(rows, image_get_pixel(new_image, 0, j), new_image->width);
     }
+}
 
-    for (int j = 0; j < image->height; j++) {
-        for (int i = 0; i < image->width; i++) {
-            pixel_t* pixel     = image_get_pixel(image, i, j);
-            pixel_t* new_pixel = image_get_pixel(new_image, i, j);
+int filter_sobel_into(image_t* image, image_t* new_image) {
+    if (image->width < 3 || image->height < 3 ||
+        check_size(image, new_image, image->width - 2, image->height - 2) < 0) {
+        return -1;
+    }
 
-            hsv_to_rgb(pixel->bytes, new_pixel->bytes);
-            new_pixel->bytes[3] = pixel->bytes[3];
-        }
+    filter_sobel_rows(image, new_image, 0, new_image->height);
+    return 0;
+}
+
+image_t* filter_sobel(image_t* image) {
+    if (image->width < 3 || image->height < 3) {
+        goto fail_exit;
     }
 
+    image_t* new_image = image_create(image->id, image->width - 2, image->height - 2);
+    if (new_image == NULL) {
+        goto fail_exit;
+    }
+
+    filter_sobel_into(image, new_image);
+
     return new_image;
 
 fail_exit:
     return NULL;
 }
 
-image_t* filter_add_pixel(image_t* image, pixel_t* add_pixel) {
-    image_t* new_image = image_create(image->id, image->width, image->height);
-    if (new_image == NULL) {
-        goto fail_exit;
+/* the pointwise filters read each pixel before writing it, so new_image may be image itself */
+
+static void to_hsv_row(const pixel_t* in, pixel_t* out, size_t count) {
+    size_t done = 0;
+    switch (filter_get_impl()) {
+    case FILTER_IMPL_AVX2:
+        done = filter_to_hsv_row_avx2(in, out, count);
+        break;
+    case FILTER_IMPL_SSE:
+        done = filter_to_hsv_row_sse(in, out, count);
+        break;
+    default:
+        break;
     }
 
-    for (int j = 0; j < image->height; j++) {
-        for (int i = 0; i < image->width; i++) {
-            pixel_t* pixel     = image_get_pixel(image, i, j);
-            pixel_t* new_pixel = image_get_pixel(new_image, i, j);
+    for (size_t i = done; i < count; i++) {
+        unsigned char alpha = in[i].bytes[3];
 
-            for (int k = 0; k < 3; k++) {
-                new_pixel->bytes[k] = pixel->bytes[k] + add_pixel->bytes[k];
-            }
+        rgb_to_hsv((unsigned char*)in[i].bytes, out[i].bytes);
+        out[i].bytes[3] = alpha;
+    }
+}
+
+static void to_rgb_row(const pixel_t* in, pixel_t* out, size_t count) {
+    size_t done = 0;
+    switch (filter_get_impl()) {
+    case FILTER_IMPL_AVX2:
+        done = filter_to_rgb_row_avx2(in, out, count);
+        break;
+    case FILTER_IMPL_SSE:
+        done = filter_to_rgb_row_sse(in, out, count);
+        break;
+    default:
+        break;
+    }
+
+    for (size_t i = done; i < count; i++) {
+        unsigned char alpha = in[i].bytes[3];
+
+        hsv_to_rgb((unsigned char*)in[i].bytes, out[i].bytes);
+        out[i].bytes[3] = alpha;
+    }
+}
 
-            new_pixel->bytes[3] = pixel->bytes[3];
+static void add_pixel_row(const pixel_t* in, pixel_t* out, size_t count, const pixel_t* add_pixel) {
+    for (size_t i = 0; i < count; i++) {
+        for (int k = 0; k < 3; k++) {
+            out[i].bytes[k] = in[i].bytes[k] + add_pixel->bytes[k];
         }
+
+        out[i].bytes[3] = in[i].bytes[3];
+    }
+}
+
+static void desaturate_row(const pixel_t* in, pixel_t* out, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        double value = 0;
+        value += 0.30 * ((double)in[i].bytes[0]);
+        value += 0.59 * ((double)in[i].bytes[1]);
+        value += 0.11 * ((double)in[i].bytes[2]);
+
+        out[i].bytes[0] = (unsigned char)value;
+        out[i].bytes[1] = (unsigned char)value;
+        out[i].bytes[2] = (unsigned char)value;
+        out[i].bytes[3] = in[i].bytes[3];
+    }
+}
+
+static void pointwise_row(const filter_pointwise_t* op, const pixel_t* in, pixel_t* out, size_t count) {
+    switch (op->op) {
+    case FILTER_OP_TO_HSV:
+        to_hsv_row(in, out, count);
+        break;
+    case FILTER_OP_TO_RGB:
+        to_rgb_row(in, out, count);
+        break;
+    case FILTER_OP_ADD_PIXEL:
+        add_pixel_row(in, out, count, &op->pixel);
+        break;
+    case FILTER_OP_DESATURATE:
+        desaturate_row(in, out, count);
+        break;
     }
+}
+
+/*
+ * the first op reads a block of the input row and every other op works in place on the output block while it
+ * is still in L1, so a run of pointwise filters reads and writes the image once whatever its length
+ */
+
+#define POINTWISE_BLOCK 1024
+
+void filter_pointwise_rows(image_t* image, image_t* new_image, const filter_pointwise_t* ops, size_t nb_ops,
+                           size_t row_begin, size_t row_end) {
+    for (size_t j = row_begin; j < row_end; j++) {
+        const pixel_t* in = image_get_pixel(image, 0, j);
+        pixel_t* out      = image_get_pixel(new_image, 0, j);
+
+        if (nb_ops == 0) {
+            memmove(out, in, image->width * sizeof(*out));
+            continue;
+        }
+
+        for (size_t i = 0; i < image->width; i += POINTWISE_BLOCK) {
+            size_t count = min(POINTWISE_BLOCK, image->width - i);
+
+            pointwise_row(&ops[0], &in[i], &out[i], count);
+            for (size_t k = 1; k < nb_ops; k++) {
+                pointwise_row(&ops[k], &out[i], &out[i], count);
+            }
+        }
+    }
+}
+
+int filter_pointwise_into(image_t* image, image_t* new_image, const filter_pointwise_t* ops, size_t nb_ops) {
+    if (check_size(image, new_image, image->width, image->height) < 0) {
+        return -1;
+    }
+
+    filter_pointwise_rows(image, new_image, ops, nb_ops, 0, image->height);
+    return 0;
+}
+
+image_t* filter_pointwise(image_t* image, const filter_pointwise_t* ops, size_t nb_ops) {
+    image_t* new_image = image_create(image->id, image->width, image->height);
+    if (new_image == NULL) {
+        goto fail_exit;
+    }
+
+    filter_pointwise_into(image, new_image, ops, nb_ops);
 
     return new_image;
 
@@ -257,120 +588,330 @@ fail_exit:
     return NULL;
 }
 
+int filter_to_hsv_into(image_t* image, image_t* new_image) {
+    filter_pointwise_t op = {.op = FILTER_OP_TO_HSV};
+    return filter_pointwise_into(image, new_image, &op, 1);
+}
+
+void filter_to_hsv_inplace(image_t* image) {
+    filter_to_hsv_into(image, image);
+}
+
+image_t* filter_to_hsv(image_t* image) {
+    filter_pointwise_t op = {.op = FILTER_OP_TO_HSV};
+    return filter_pointwise(image, &op, 1);
+}
+
+int filter_to_rgb_into(image_t* image, image_t* new_image) {
+    filter_pointwise_t op = {.op = FILTER_OP_TO_RGB};
+    return filter_pointwise_into(image, new_image, &op, 1);
+}
+
+void filter_to_rgb_inplace(image_t* image) {
+    filter_to_rgb_into(image, image);
+}
+
+image_t* filter_to_rgb(image_t* image) {
+    filter_pointwise_t op = {.op = FILTER_OP_TO_RGB};
+    return filter_pointwise(image, &op, 1);
+}
+
+int filter_add_pixel_into(image_t* image, image_t* new_image, pixel_t* add_pixel) {
+    filter_pointwise_t op = {.op = FILTER_OP_ADD_PIXEL, .pixel = *add_pixel};
+    return filter_pointwise_into(image, new_image, &op, 1);
+}
+
+void filter_add_pixel_inplace(image_t* image, pixel_t* add_pixel) {
+    filter_add_pixel_into(image, image, add_pixel);
+}
+
+image_t* filter_add_pixel(image_t* image, pixel_t* add_pixel) {
+    filter_pointwise_t op = {.op = FILTER_OP_ADD_PIXEL, .pixel = *add_pixel};
+    return filter_pointwise(image, &op, 1);
+}
+
+int filter_desaturate_into(image_t* image, image_t* new_image) {
+    filter_pointwise_t op = {.op = FILTER_OP_DESATURATE};
+    return filter_pointwise_into(image, new_image, &op, 1);
+}
+
+void filter_desaturate_inplace(image_t* image) {
+    filter_desaturate_into(image, image);
+}
+
 image_t* filter_desaturate(image_t* image) {
-    image_t* new_image = image_create(image->id, image->width, image->height);
-    if (new_image == NULL) {
-        goto fail_exit;
+    filter_pointwise_t op = {.op = FILTER_OP_DESATURATE};
+    return filter_pointwise(image, &op, 1);
+}
+
+void filter_convolution33_rows(image_t* image, image_t* new_image, const double m[3][3], size_t row_begin,
+                               size_t row_end) {
+    kernel33_t kernel;
+    kernel33_compile(m, &kernel);
+
+    for (size_t j = row_begin; j < row_end; j++) {
+        const pixel_t* rows[3] = {
+            image_get_pixel(image, 0, j),
+            image_get_pixel(image, 0, j + 1),
+            image_get_pixel(image, 0, j + 2),
+        };
+
+        convolution33_row(rows, image_get_pixel(new_image, 0, j), new_image->width, &kernel);
     }
+}
 
-    for (int j = 0; j < image->height; j++) {
-        for (int i = 0; i < image->width; i++) {
-            pixel_t* pixel     = image_get_pixel(image, i, j);
-            pixel_t* new_pixel = image_get_pixel(new_image, i, j);
+int filter_convolution33_into(image_t* image, image_t* new_image, const double m[3][3]) {
+    if (image->width < 3 || image->height < 3 ||
+        check_size(image, new_image, image->width - 2, image->height - 2) < 0) {
+        return -1;
+    }
 
-            double value = 0;
-            value += 0.30 * ((double)pixel->bytes[0]);
-            value += 0.59 * ((double)pixel->bytes[1]);
-            value += 0.11 * ((double)pixel->bytes[2]);
+    filter_convolution33_rows(image, new_image, m, 0, new_image->height);
+    return 0;
+}
 
-            new_pixel->bytes[0] = (unsigned char)value;
-            new_pixel->bytes[1] = (unsigned char)value;
-            new_pixel->bytes[2] = (unsigned char)value;
-            new_pixel->bytes[3] = pixel->bytes[3];
-        }
+image_t* filter_convolution33(image_t* image, const double m[3][3]) {
+    if (image->width < 3 || image->height < 3) {
+        goto fail_exit;
+    }
+
+    image_t* new_image = image_create(image->id, image->width - 2, image->height - 2);
+    if (new_image == NULL) {
+        goto fail_exit;
     }
 
+    filter_convolution33_into(image, new_image, m);
+
     return new_image;
 
 fail_exit:
     return NULL;
 }
 
-image_t* filter_convolution33(image_t* image, const double m[3][3]) {
-    image_t* new_image = image_create(image->id, image->width - 2, image->height - 2);
-    if (new_image == NULL) {
+static const double edge_identity_kernel[3][3] = {
+    {0, 0, 0},
+    {0, 1, 0},
+    {0, 0, 0},
+};
+
+static const double edge_detect_kernel[3][3] = {
+    {-1, -1, -1},
+    {-1, 8, -1},
+    {-1, -1, -1},
+};
+
+int filter_edge_identity_into(image_t* image, image_t* new_image) {
+    return filter_convolution33_into(image, new_image, edge_identity_kernel);
+}
+
+image_t* filter_edge_identity(image_t* image) {
+    return filter_convolution33(image, edge_identity_kernel);
+}
+
+int filter_edge_detect_into(image_t* image, image_t* new_image) {
+    return filter_convolution33_into(image, new_image, edge_detect_kernel);
+}
+
+image_t* filter_edge_detect(image_t* image) {
+    return filter_convolution33(image, edge_detect_kernel);
+}
+
+void filter_sharpen_rows(image_t* image, image_t* new_image, size_t row_begin, size_t row_end) {
+    filter_convolution33_rows(image, new_image, sharpen_kernel, row_begin, row_end);
+}
+
+int filter_sharpen_into(image_t* image, image_t* new_image) {
+    return filter_convolution33_into(image, new_image, sharpen_kernel);
+}
+
+image_t* filter_sharpen(image_t* image) {
+    return filter_convolution33(image, sharpen_kernel);
+}
+
+/*
+ * the sums are kept for the 4 channels of every pixel so both passes run over flat rows the compiler vectorizes,
+ * the quotient is a multiplication by the reciprocal of the divisor rounded up to 32 + log2(divisor) bits, exact
+ * for any sum that fits in an int32
+ */
+
+int filter_convolution_separable_into(image_t* image, image_t* new_image, const int row[], const int col[],
+                                      size_t radius, int divisor) {
+    size_t size = 2 * radius + 1;
+
+    if (image->width < size || image->height < size || divisor <= 0) {
+        goto fail_exit;
+    }
+
+    int64_t row_weight = 0;
+    int64_t col_weight = 0;
+    for (size_t t = 0; t < size; t++) {
+        row_weight += llabs(row[t]);
+        col_weight += llabs(col[t]);
+    }
+
+    if (row_weight * col_weight > INT32_MAX / 255) {
+        LOG_ERROR("separable kernel too large");
         goto fail_exit;
     }
 
-    for (int j = 1; j < image->height - 1; j++) {
-        for (int i = 1; i < image->width - 1; i++) {
-            double values[3] = {0, 0, 0};
+    if (check_size(image, new_image, image->width - 2 * radius, image->height - 2 * radius) < 0) {
+        goto fail_exit;
+    }
 
-            for (int y = -1; y <= 1; y++) {
-                for (int x = -1; x <= 1; x++) {
-                    pixel_t* pixel = image_get_pixel(image, i + x, j + y);
+    /* ring of the last `size` rows filtered horizontally and the vertical sums of the current output row */
 
-                    for (int k = 0; k < 3; k++) {
-                        values[k] += pixel->bytes[k] * m[y + 1][x + 1];
-                    }
-                }
+    size_t stride = new_image->width * 4;
+    int32_t* sums = malloc((size + 1) * stride * sizeof(*sums));
+    if (sums == NULL) {
+        LOG_ERROR_ERRNO("malloc");
+        goto fail_exit;
+    }
+
+    int32_t* values = &sums[size * stride];
+    int shift       = 32;
+    while ((INT64_C(1) << (shift - 32)) < divisor) {
+        shift++;
+    }
+    uint64_t reciprocal = ((UINT64_C(1) << shift) - 1) / divisor + 1;
+
+    for (size_t y = 0; y < image->height; y++) {
+        const unsigned char* in = image_get_pixel(image, 0, y)->bytes;
+        int32_t* line           = &sums[(y % size) * stride];
+
+        for (size_t c = 0; c < stride; c++) {
+            line[c] = in[c] * row[0];
+        }
+        for (size_t x = 1; x < size; x++) {
+            for (size_t c = 0; c < stride; c++) {
+                line[c] += in[c + 4 * x] * row[x];
             }
+        }
+
+        if (y + 1 < size) {
+            continue;
+        }
 
-            pixel_t* new_pixel = image_get_pixel(new_image, i - 1, j - 1);
-            pixel_t* pixel     = image_get_pixel(image, i, j);
+        size_t j       = y + 1 - size;
+        pixel_t* out   = image_get_pixel(new_image, 0, j);
+        pixel_t* alpha = image_get_pixel(image, radius, j + radius);
+
+        for (size_t t = 0; t < size; t++) {
+            const int32_t* tap = &sums[((j + t) % size) * stride];
+            const int weight   = col[t];
+
+            if (t == 0) {
+                for (size_t c = 0; c < stride; c++) {
+                    values[c] = tap[c] * weight;
+                }
+            } else {
+                for (size_t c = 0; c < stride; c++) {
+                    values[c] += tap[c] * weight;
+                }
+            }
+        }
 
+        for (size_t i = 0; i < new_image->width; i++) {
             for (int k = 0; k < 3; k++) {
-                new_pixel->bytes[k] = (unsigned char)clamp(values[k], 0, 255);
+                int32_t value    = max(values[4 * i + k], 0);
+                int32_t quotient = (int32_t)(((uint64_t)value * reciprocal) >> shift);
+                out[i].bytes[k]  = (unsigned char)min(quotient, 255);
             }
 
-            new_pixel->bytes[3] = pixel->bytes[3];
+            out[i].bytes[3] = alpha[i].bytes[3];
         }
     }
 
-    return new_image;
+    free(sums);
+    return 0;
 
 fail_exit:
-    return NULL;
+    return -1;
 }
 
-image_t* filter_edge_identity(image_t* image) {
-    const double m[3][3] = {
-        {0, 0, 0},
-        {0, 1, 0},
-        {0, 0, 0},
-    };
+image_t* filter_convolution_separable(image_t* image, const int row[], const int col[], size_t radius, int divisor) {
+    if (image->width < 2 * radius + 1 || image->height < 2 * radius + 1 || divisor <= 0) {
+        goto fail_exit;
+    }
 
-    return filter_convolution33(image, m);
-}
+    image_t* new_image = image_create(image->id, image->width - 2 * radius, image->height - 2 * radius);
+    if (new_image == NULL) {
+        goto fail_exit;
+    }
 
-image_t* filter_edge_detect(image_t* image) {
-    const double m[3][3] = {
-        {-1, -1, -1},
-        {-1, 8, -1},
-        {-1, -1, -1},
-    };
+    if (filter_convolution_separable_into(image, new_image, row, col, radius, divisor) < 0) {
+        goto fail_free_image;
+    }
+
+    return new_image;
 
-    return filter_convolution33(image, m);
+fail_free_image:
+    image_destroy(new_image);
+fail_exit:
+    return NULL;
 }
 
-image_t* filter_sharpen(image_t* image) {
-    const double m[3][3] = {
-        {0, -2, 0},
-        {-2, 9, -2},
-        {0, -2, 0},
-    };
+static const double box_blur_kernel[3][3] = {
+    {1.0 / 9.0, 1.0 / 9.0, 1.0 / 9.0},
+    {1.0 / 9.0, 1.0 / 9.0, 1.0 / 9.0},
+    {1.0 / 9.0, 1.0 / 9.0, 1.0 / 9.0},
+};
+
+/* not the outer product of [1 2 1] with itself, the middle row of the original kernel ends with 4, not 2 */
+
+static const double gaussian_blur_kernel[3][3] = {
+    {1.0 / 16.0, 2.0 / 16.0, 1.0 / 16.0},
+    {2.0 / 16.0, 4.0 / 16.0, 4.0 / 16.0},
+    {1.0 / 16.0, 2.0 / 16.0, 1.0 / 16.0},
+};
 
-    return filter_convolution33(image, m);
+/*
+ * 1/9 isn't dyadic so the kernel runs on the double path, the separable integer sums give the same output except
+ * for the sums divisible by 9, which the double sums can round down, and checking them costs more than it saves
+ */
+
+int filter_box_blur_into(image_t* image, image_t* new_image) {
+    return filter_convolution33_into(image, new_image, box_blur_kernel);
 }
 
 image_t* filter_box_blur(image_t* image) {
-    const double m[3][3] = {
-        {1.0 / 9.0, 1.0 / 9.0, 1.0 / 9.0},
-        {1.0 / 9.0, 1.0 / 9.0, 1.0 / 9.0},
-        {1.0 / 9.0, 1.0 / 9.0, 1.0 / 9.0},
-    };
+    return filter_convolution33(image, box_blur_kernel);
+}
 
-    return filter_convolution33(image, m);
+/* the kernel is dyadic, filter_convolution33() computes it exactly in fixed point */
+
+int filter_gaussian_blur_into(image_t* image, image_t* new_image) {
+    return filter_convolution33_into(image, new_image, gaussian_blur_kernel);
 }
 
 image_t* filter_gaussian_blur(image_t* image) {
-    const double m[3][3] = {
-        {1.0 / 16.0, 2.0 / 16.0, 1.0 / 16.0},
-        {2.0 / 16.0, 4.0 / 16.0, 4.0 / 16.0},
-        {1.0 / 16.0, 2.0 / 16.0, 1.0 / 16.0},
-    };
+    return filter_convolution33(image, gaussian_blur_kernel);
+}
+
+/* the flips swap mirrored pixel pairs, which also works when new_image is image itself */
+
+int filter_horizontal_flip_into(image_t* image, image_t* new_image) {
+    if (check_size(image, new_image, image->width, image->height) < 0) {
+        return -1;
+    }
+
+    for (size_t j = 0; j < image->height; j++) {
+        pixel_t* in  = image_get_pixel(image, 0, j);
+        pixel_t* out = image_get_pixel(new_image, 0, j);
+
+        for (size_t i = 0, k = image->width - 1; i <= k && k < image->width; i++, k--) {
+            pixel_t left  = in[i];
+            pixel_t right = in[k];
 
-    return filter_convolution33(image, m);
+            out[i] = right;
+            out[k] = left;
+        }
+    }
+
+    return 0;
+}
+
+void filter_horizontal_flip_inplace(image_t* image) {
+    filter_horizontal_flip_into(image, image);
 }
 
 image_t* filter_horizontal_flip(image_t* image) {
@@ -379,38 +920,116 @@ image_t* filter_horizontal_flip(image_t* image) {
         goto fail_exit;
     }
 
-    for (int j = 0; j < image->height; j++) {
-        for (int i = 0; i < image->width; i++) {
-            pixel_t* pixel     = image_get_pixel(image, i, j);
-            pixel_t* new_pixel = image_get_pixel(new_image, (image->width - 1) - i, j);
+    filter_horizontal_flip_into(image, new_image);
+
+    return new_image;
+
+fail_exit:
+    return NULL;
+}
 
-            *new_pixel = *pixel;
+int filter_vertical_flip_into(image_t* image, image_t* new_image) {
+    if (check_size(image, new_image, image->width, image->height) < 0) {
+        return -1;
+    }
+
+    for (size_t j = 0, k = image->height - 1; j <= k && k < image->height; j++, k--) {
+        pixel_t* in_top     = image_get_pixel(image, 0, j);
+        pixel_t* in_bottom  = image_get_pixel(image, 0, k);
+        pixel_t* out_top    = image_get_pixel(new_image, 0, j);
+        pixel_t* out_bottom = image_get_pixel(new_image, 0, k);
+
+        for (size_t i = 0; i < image->width; i++) {
+            pixel_t top    = in_top[i];
+            pixel_t bottom = in_bottom[i];
+
+            out_top[i]    = bottom;
+            out_bottom[i] = top;
         }
     }
 
+    return 0;
+}
+
+void filter_vertical_flip_inplace(image_t* image) {
+    filter_vertical_flip_into(image, image);
+}
+
+image_t* filter_vertical_flip(image_t* image) {
+    image_t* new_image = image_create(image->id, image->width, image->height);
+    if (new_image == NULL) {
+        goto fail_exit;
+    }
+
+    filter_vertical_flip_into(image, new_image);
+
     return new_image;
 
 fail_exit:
     return NULL;
 }
 
-image_t* filter_vertical_flip(image_t* image) {
-    image_t* new_image = image_create(image->id, image->width, image->height);
+image_t* filter_scale_sharpen_sobel(image_t* image, size_t factor) {
+    size_t scaled_width  = factor * image->width;
+    size_t scaled_height = factor * image->height;
+
+    /* the unfused chain fails on images this small, so does this one */
+
+    if (scaled_width < 5 || scaled_height < 5) {
+        goto fail_exit;
+    }
+
+    image_t* new_image = image_create(image->id, scaled_width - 4, scaled_height - 4);
     if (new_image == NULL) {
         goto fail_exit;
     }
 
-    for (int j = 0; j < image->height; j++) {
-        for (int i = 0; i < image->width; i++) {
-            pixel_t* pixel     = image_get_pixel(image, i, j);
-            pixel_t* new_pixel = image_get_pixel(new_image, i, (image->height - j) - 1);
+    /* ring of 3 scaled rows feeding a ring of 3 sharpened rows, only the sobel output is a full image */
+
+    pixel_t* lines = malloc((3 * scaled_width + 3 * (scaled_width - 2)) * sizeof(*lines));
+    if (lines == NULL) {
+        goto fail_free_image;
+    }
+
+    kernel33_t kernel;
+    kernel33_compile(sharpen_kernel, &kernel);
+
+    pixel_t* scaled[3];
+    pixel_t* sharpened[3];
+    for (int r = 0; r < 3; r++) {
+        scaled[r]    = lines + r * scaled_width;
+        sharpened[r] = lines + 3 * scaled_width + r * (scaled_width - 2);
+    }
+
+    for (size_t y = 0; y < scaled_height; y++) {
+        pixel_t* scaled_row = scaled[y % 3];
 
-            *new_pixel = *pixel;
+        if (y % factor == 0) {
+            scale_up_row(image_get_pixel(image, 0, y / factor), scaled_row, image->width, factor);
+        } else {
+            memcpy(scaled_row, scaled[(y - 1) % 3], scaled_width * sizeof(*scaled_row));
         }
+
+        if (y < 2) {
+            continue;
+        }
+
+        const pixel_t* scaled_rows[3] = {scaled[(y - 2) % 3], scaled[(y - 1) % 3], scaled_row};
+        convolution33_row(scaled_rows, sharpened[(y - 2) % 3], scaled_width - 2, &kernel);
+
+        if (y < 4) {
+            continue;
+        }
+
+        const pixel_t* sharpened_rows[3] = {sharpened[(y - 4) % 3], sharpened[(y - 3) % 3], sharpened[(y - 2) % 3]};
+        sobel_row(sharpened_rows, image_get_pixel(new_image, 0, y - 4), new_image->width);
     }
 
+    free(lines);
     return new_image;
 
+fail_free_image:
+    image_destroy(new_image);
 fail_exit:
     return NULL;
 }
@@ -0,0 +1,129 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "id-map.h"
+#include "log.h"
+
+/*
+ * open addressing with linear probing, a slot is the id plus one (0 for a free slot) followed by the value, the
+ * ids in flight are mostly consecutive so they land in consecutive slots and a lookup rarely probes twice
+ *
+ * the table doubles when it is half full and never shrinks, a removal shifts the following slots of the run back
+ * so lookups never need tombstones
+ */
+
+#define MIN_CAPACITY 64
+
+static size_t* slot_key(const id_map_t* map, size_t index) {
+    return (size_t*)(map->slots + index * map->slot_size);
+}
+
+static void* slot_value(const id_map_t* map, size_t index) {
+    return map->slots + index * map->slot_size + sizeof(size_t);
+}
+
+/* the slot holding id, or the free slot ending its run */
+
+static size_t find_slot(const id_map_t* map, size_t id) {
+    size_t mask  = map->capacity - 1;
+    size_t index = id & mask;
+
+    while (*slot_key(map, index) != 0 && *slot_key(map, index) != id + 1) {
+        index = (index + 1) & mask;
+    }
+
+    return index;
+}
+
+static int grow(id_map_t* map) {
+    size_t capacity = (map->capacity == 0) ? MIN_CAPACITY : 2 * map->capacity;
+
+    unsigned char* slots = calloc(capacity, map->slot_size);
+    if (slots == NULL) {
+        LOG_ERROR_ERRNO("calloc");
+        return -1;
+    }
+
+    id_map_t old  = *map;
+    map->slots    = slots;
+    map->capacity = capacity;
+
+    for (size_t i = 0; i < old.capacity; i++) {
+        size_t key = *slot_key(&old, i);
+        if (key != 0) {
+            size_t index          = find_slot(map, key - 1);
+            *slot_key(map, index) = key;
+            memcpy(slot_value(map, index), slot_value(&old, i), map->value_size);
+        }
+    }
+
+    free(old.slots);
+    return 0;
+}
+
+void id_map_init(id_map_t* map, size_t value_size) {
+    size_t align = sizeof(uint64_t);
+
+    map->value_size = value_size;
+    map->slot_size  = sizeof(size_t) + (value_size + align - 1) / align * align;
+    map->capacity   = 0;
+    map->count      = 0;
+    map->slots      = NULL;
+}
+
+void id_map_destroy(id_map_t* map) {
+    free(map->slots);
+    map->slots    = NULL;
+    map->capacity = 0;
+    map->count    = 0;
+}
+
+void* id_map_put(id_map_t* map, size_t id) {
+    if (2 * (map->count + 1) > map->capacity && grow(map) < 0) {
+        return NULL;
+    }
+
+    size_t index = find_slot(map, id);
+    if (*slot_key(map, index) == 0) {
+        *slot_key(map, index) = id + 1;
+        memset(slot_value(map, index), 0, map->value_size);
+        map->count++;
+    }
+
+    return slot_value(map, index);
+}
+
+void* id_map_get(const id_map_t* map, size_t id) {
+    if (map->capacity == 0) {
+        return NULL;
+    }
+
+    size_t index = find_slot(map, id);
+    return (*slot_key(map, index) != 0) ? slot_value(map, index) : NULL;
+}
+
+void id_map_remove(id_map_t* map, size_t id) {
+    if (map->capacity == 0) {
+        return;
+    }
+
+    size_t mask = map->capacity - 1;
+    size_t hole = find_slot(map, id);
+    if (*slot_key(map, hole) == 0) {
+        return;
+    }
+
+    /* a slot further in the run moves into the hole unless its own id belongs between the hole and it */
+
+    for (size_t index = (hole + 1) & mask; *slot_key(map, index) != 0; index = (index + 1) & mask) {
+        size_t home = (*slot_key(map, index) - 1) & mask;
+        if (((index - home) & mask) >= ((index - hole) & mask)) {
+            memcpy(map->slots + hole * map->slot_size, map->slots + index * map->slot_size, map->slot_size);
+            hole = index;
+        }
+    }
+
+    *slot_key(map, hole) = 0;
+    map->count--;
+}
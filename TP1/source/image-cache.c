@@ -0,0 +1,381 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <linux/fs.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "filter-chain.h"
+#include "id-map.h"
+#include "image-cache.h"
+#include "image-loader.h"
+#include "log.h"
+#include "stats.h"
+
+/*
+ * the result of a frame only depends on the bytes of its input file, the filter chain and the output encoding,
+ * the cache keeps every output under a 128 bits hash of these, so a frame whose hash is already there gets the
+ * previous output copied to its output path without being decoded, filtered or encoded
+ *
+ * the input is read once, hashed and decoded from memory, the key of every frame handed to the pipeline waits by
+ * id for its save, which copies the output into the cache, entries and outputs never share an inode since the
+ * outputs are rewritten in place by runs without the cache, the copies are reflinks where the file system has them
+ */
+
+#define BUFFER_SIZE 512
+
+typedef struct cache_key {
+    uint64_t hash[2];
+    bool set;
+} cache_key_t;
+
+struct image_cache {
+    const char* dir_name;
+    uint64_t seed; /* hash of the filter chain and the output encoding */
+    pthread_mutex_t mutex;
+    id_map_t keys; /* cache_key_t by id, from the load to the save of the frame */
+    size_t hits;
+    size_t misses;
+};
+
+static uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t fmix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/*
+ * two independent lanes multiplying and rotating every 8 bytes word, a few GB/s which is nothing next to a PNG
+ * decode, the cache only has to tell frames apart, not resist a crafted collision
+ */
+
+static void hash_word(uint64_t word, uint64_t* a, uint64_t* b) {
+    *a = rotl(*a ^ (word * 0x87c37b91114253d5ULL), 31) * 0x4cf5ad432745937fULL;
+    *b = rotl(*b ^ (word * 0x9fb21c651e98df25ULL), 27) * 0x52dce729da3ed6fbULL;
+}
+
+static void hash_bytes(const void* data, size_t size, uint64_t seed, uint64_t hash[2]) {
+    const unsigned char* bytes = data;
+    uint64_t a                 = seed ^ 0x9e3779b97f4a7c15ULL;
+    uint64_t b                 = ~seed ^ size;
+    uint64_t word;
+    size_t i;
+
+    for (i = 0; i + 8 <= size; i += 8) {
+        memcpy(&word, bytes + i, 8);
+        hash_word(word, &a, &b);
+    }
+
+    if (i < size) {
+        word = 0;
+        memcpy(&word, bytes + i, size - i);
+        hash_word(word, &a, &b);
+    }
+
+    hash[0] = fmix(a ^ rotl(b, 17));
+    hash[1] = fmix(b ^ rotl(a, 41));
+}
+
+static cache_key_t take_key(image_cache_t* cache, size_t id) {
+    cache_key_t key = {.set = false};
+
+    pthread_mutex_lock(&cache->mutex);
+    cache_key_t* value = id_map_get(&cache->keys, id);
+    if (value != NULL) {
+        key = *value;
+        id_map_remove(&cache->keys, id);
+    }
+    pthread_mutex_unlock(&cache->mutex);
+
+    return key;
+}
+
+static int put_key(image_cache_t* cache, size_t id, cache_key_t key) {
+    int ret = 0;
+
+    pthread_mutex_lock(&cache->mutex);
+    cache_key_t* value = id_map_put(&cache->keys, id);
+    if (value == NULL) {
+        ret = -1;
+    } else {
+        *value = key;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    return ret;
+}
+
+/* the entry of the key, named after the hash with the extension of the output file */
+
+static int entry_name(image_cache_t* cache, const cache_key_t* key, const char* output, char* buffer,
+                      size_t buffer_size) {
+    const char* extension = strrchr(output, '.');
+
+    int count = snprintf(buffer, buffer_size, "%s/%016llx%016llx%s", cache->dir_name,
+                         (unsigned long long)key->hash[0], (unsigned long long)key->hash[1], extension);
+    if (count >= buffer_size - 1) {
+        LOG_ERROR("buffer too small");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void* read_file(const char* filename, size_t* size) {
+    struct stat st;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        LOG_ERROR_ERRNO("open");
+        goto fail_exit;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        LOG_ERROR_ERRNO("fstat");
+        goto fail_close_file;
+    }
+
+    char* data = malloc(st.st_size > 0 ? st.st_size : 1);
+    if (data == NULL) {
+        LOG_ERROR_ERRNO("malloc");
+        goto fail_close_file;
+    }
+
+    size_t done = 0;
+    while (done < st.st_size) {
+        ssize_t ret = read(fd, data + done, st.st_size - done);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            LOG_ERROR_ERRNO("read");
+            goto fail_free_data;
+        }
+        if (ret == 0) {
+            break;
+        }
+        done += ret;
+    }
+
+    close(fd);
+    *size = done;
+    return data;
+
+fail_free_data:
+    free(data);
+fail_close_file:
+    close(fd);
+fail_exit:
+    return NULL;
+}
+
+/*
+ * copies through a temporary file of its own renamed at the end, so neither another thread copying the same entry
+ * nor another process ever sees a partial file, fails with errno set to ENOENT when from doesn't exist
+ */
+
+static int copy_file(const char* from, const char* to) {
+    char tmp[BUFFER_SIZE];
+    struct stat st;
+
+    int count = snprintf(tmp, BUFFER_SIZE, "%s.XXXXXX", to);
+    if (count >= BUFFER_SIZE - 1) {
+        LOG_ERROR("buffer too small");
+        goto fail_exit;
+    }
+
+    int in = open(from, O_RDONLY);
+    if (in < 0) {
+        goto fail_exit;
+    }
+
+    if (fstat(in, &st) < 0) {
+        LOG_ERROR_ERRNO("fstat");
+        goto fail_close_in;
+    }
+
+    int out = mkstemp(tmp);
+    if (out < 0) {
+        LOG_ERROR_ERRNO("mkstemp");
+        goto fail_close_in;
+    }
+
+    if (fchmod(out, 0644) < 0) {
+        LOG_ERROR_ERRNO("fchmod");
+        goto fail_close_out;
+    }
+
+    /* the clone shares the blocks until one of the files is written, not the inode */
+
+    off_t offset = (ioctl(out, FICLONE, in) == 0) ? st.st_size : 0;
+    while (offset < st.st_size) {
+        if (sendfile(out, in, &offset, st.st_size - offset) <= 0) {
+            LOG_ERROR_ERRNO("sendfile");
+            goto fail_close_out;
+        }
+    }
+
+    if (close(out) < 0) {
+        LOG_ERROR_ERRNO("close");
+        goto fail_unlink;
+    }
+
+    if (rename(tmp, to) < 0) {
+        LOG_ERROR_ERRNO("rename");
+        goto fail_unlink;
+    }
+
+    close(in);
+    return 0;
+
+fail_close_out:
+    close(out);
+fail_unlink:
+    unlink(tmp);
+fail_close_in:
+    close(in);
+fail_exit:
+    return -1;
+}
+
+image_t* image_cache_next(image_dir_t* image_dir) {
+    image_cache_t* cache = image_dir->cache;
+    char input[BUFFER_SIZE];
+    char output[BUFFER_SIZE];
+    char entry[BUFFER_SIZE];
+
+    while (!image_dir->stop) {
+        size_t id = image_dir->load_current;
+        image_format_t format;
+
+        if (image_dir_find_format(image_dir, id, input, BUFFER_SIZE, &format) < 0) {
+            if (id == 0) {
+                LOG_ERROR("no image found in directory `%s`", image_dir->input_dir_name);
+            }
+            goto fail_exit;
+        }
+
+        size_t size;
+        void* data = read_file(input, &size);
+        if (data == NULL) {
+            goto fail_exit;
+        }
+
+        cache_key_t key = {.set = true};
+        hash_bytes(data, size, cache->seed, key.hash);
+
+        if (image_dir_output_name(image_dir, id, output, BUFFER_SIZE) < 0 ||
+            entry_name(cache, &key, output, entry, BUFFER_SIZE) < 0) {
+            free(data);
+            goto fail_exit;
+        }
+
+        if (copy_file(entry, output) == 0) {
+            free(data);
+            cache->hits++;
+            image_dir->load_current++;
+            continue;
+        }
+
+        image_t* image = image_decode(format, data, size);
+        free(data);
+        if (image == NULL || put_key(cache, id, key) < 0) {
+            image_destroy(image);
+            goto fail_exit;
+        }
+
+        cache->misses++;
+        image->id = image_dir->load_current++;
+        return image;
+    }
+
+fail_exit:
+    return NULL;
+}
+
+void image_cache_saved(image_dir_t* image_dir, size_t id, const char* filename) {
+    image_cache_t* cache = image_dir->cache;
+    char entry[BUFFER_SIZE];
+
+    cache_key_t key = take_key(cache, id);
+    if (!key.set || entry_name(cache, &key, filename, entry, BUFFER_SIZE) < 0) {
+        return;
+    }
+
+    /* an entry already there is the same output, a frame that can't be cached is only processed again next time */
+
+    if (access(entry, F_OK) == 0) {
+        return;
+    }
+
+    if (copy_file(filename, entry) < 0) {
+        LOG_ERROR("can't add `%s` to the cache (%s)", filename, strerror(errno));
+    }
+}
+
+void image_cache_dropped(image_dir_t* image_dir, size_t id) {
+    take_key(image_dir->cache, id);
+}
+
+int image_dir_start_cache(image_dir_t* image_dir, const char* cache_dir_name, const struct filter_chain* filters) {
+    char salt[BUFFER_SIZE];
+
+    if (mkdir(cache_dir_name, 0755) < 0 && errno != EEXIST) {
+        LOG_ERROR("mkdir `%s` (%s)", cache_dir_name, strerror(errno));
+        goto fail_exit;
+    }
+
+    image_cache_t* cache = calloc(1, sizeof(*cache));
+    if (cache == NULL) {
+        LOG_ERROR_ERRNO("calloc");
+        goto fail_exit;
+    }
+
+    /* the PNG settings change the bytes of the outputs, not their pixels, but a rerun asking for them expects them */
+
+    uint64_t hash[2] = {0, 0};
+    int count        = snprintf(salt, BUFFER_SIZE, "%d %d %d %zu", image_dir->output_format, image_png_options.level,
+                                image_png_options.filters, image_png_options.threads);
+    hash_bytes(salt, count, 0, hash);
+
+    for (size_t s = 0; s < filter_chain_length(filters); s++) {
+        const char* name = filter_chain_stage_name(filters, s);
+        hash_bytes(name, strlen(name), hash[0] ^ s, hash);
+    }
+
+    cache->dir_name = cache_dir_name;
+    cache->seed     = hash[0] ^ hash[1];
+    pthread_mutex_init(&cache->mutex, NULL);
+    id_map_init(&cache->keys, sizeof(cache_key_t));
+    image_dir->cache = cache;
+    return 0;
+
+fail_exit:
+    return -1;
+}
+
+void image_dir_stop_cache(image_dir_t* image_dir) {
+    image_cache_t* cache = image_dir->cache;
+    if (cache == NULL) {
+        return;
+    }
+
+    stats_cache(cache->hits, cache->misses);
+
+    pthread_mutex_destroy(&cache->mutex);
+    id_map_destroy(&cache->keys);
+    free(cache);
+    image_dir->cache = NULL;
+}
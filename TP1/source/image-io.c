@@ -0,0 +1,645 @@
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "image-io.h"
+#include "image-loader.h"
+#include "log.h"
+#include "queue.h"
+
+/*
+ * the stages only ever touch memory: image_io_load_next() decodes a file whose bytes were read while the images
+ * before it went through the pipeline, image_io_save() encodes to a buffer and hands it over to be written
+ *
+ * io_uring is driven through the raw system calls, a single reaper thread waits for the completions and resubmits
+ * the rest of short transfers, when the kernel refuses io_uring (too old, or forbidden by a seccomp policy as in
+ * most containers) the same requests are served by blocking pread()/pwrite() on a few I/O threads
+ *
+ * opening and closing the files stays synchronous, it doesn't move any data and is served from the dentry cache,
+ * at most MAX_IN_FLIGHT requests are submitted at once so the completion ring can never overflow
+ */
+
+#define BUFFER_SIZE 256
+#define MAX_IN_FLIGHT 64
+#define MAX_TRANSFER (1U << 30)
+#define NB_IO_THREADS 4
+#define REAPER_POLL_MS 1 /* how often the reaper reads the completion ring once it can't wait for it */
+
+typedef enum io_op {
+    IO_READ,
+    IO_WRITE,
+} io_op_t;
+
+typedef struct io_request {
+    io_op_t op;
+    int fd;
+    unsigned char* data;
+    size_t size;
+    size_t done;
+    int error;     /* errno of the failed transfer */
+    bool complete; /* read requests only, writes are freed once complete */
+    image_format_t format;
+    char path[BUFFER_SIZE];
+} io_request_t;
+
+typedef struct uring {
+    int fd;
+    void* ring;
+    size_t ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    pthread_t reaper;
+} uring_t;
+
+struct image_io {
+    image_io_backend_t backend;
+    pthread_mutex_t mutex; /* protects everything below and the submission ring */
+    pthread_cond_t completed;
+    size_t in_flight;
+    size_t writes_pending;
+    bool write_failed;
+
+    uring_t uring;
+    queue_t* queue;
+    pthread_t threads[NB_IO_THREADS];
+    size_t nb_threads;
+
+    /* read ahead window, only used by the thread calling image_dir_load_next() */
+    io_request_t** reads;
+    size_t depth;
+    size_t next_id; /* next id to submit */
+    size_t end_id;  /* first id that has no file or failed to load */
+};
+
+static void request_finish(image_io_t* io, io_request_t* request) {
+    if (request->op == IO_WRITE && request->error != 0) {
+        LOG_ERROR("couldn't write `%s` (%s)", request->path, strerror(request->error));
+    }
+
+    if (close(request->fd) < 0 && request->op == IO_WRITE && request->error == 0) {
+        LOG_ERROR_ERRNO("close");
+        request->error = errno;
+    }
+
+    if (request->op == IO_WRITE) {
+        free(request->data);
+    }
+
+    pthread_mutex_lock(&io->mutex);
+
+    io->in_flight--;
+    if (request->op == IO_WRITE) {
+        io->writes_pending--;
+        io->write_failed |= (request->error != 0);
+        free(request);
+    } else {
+        request->complete = true;
+    }
+
+    pthread_cond_broadcast(&io->completed);
+    pthread_mutex_unlock(&io->mutex);
+}
+
+/* the rings are shared with the kernel, the indexes it reads or writes are accessed with acquire and release */
+
+static int uring_submit_locked(uring_t* uring, io_request_t* request) {
+    unsigned tail              = *uring->sq_tail;
+    unsigned index             = tail & *uring->sq_mask;
+    struct io_uring_sqe* entry = &uring->sqes[index];
+
+    memset(entry, 0, sizeof(*entry));
+
+    if (request == NULL) {
+        entry->opcode = IORING_OP_NOP;
+    } else {
+        size_t length    = request->size - request->done;
+        entry->opcode    = (request->op == IO_READ) ? IORING_OP_READ : IORING_OP_WRITE;
+        entry->fd        = request->fd;
+        entry->addr      = (uintptr_t)(request->data + request->done);
+        entry->len       = (length < MAX_TRANSFER) ? length : MAX_TRANSFER;
+        entry->off       = request->done;
+        entry->user_data = (uintptr_t)request;
+    }
+
+    uring->sq_array[index] = index;
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    while (syscall(SYS_io_uring_enter, uring->fd, 1, 0, 0, NULL, 0) < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            LOG_ERROR_ERRNO("io_uring_enter");
+            /* the kernel only reads the ring inside io_uring_enter(), the entry can still be taken back */
+            __atomic_store_n(uring->sq_tail, tail, __ATOMIC_RELEASE);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void uring_complete(image_io_t* io, io_request_t* request, int res) {
+    if (res > 0 && request->done + res < request->size) {
+        request->done += res;
+
+        pthread_mutex_lock(&io->mutex);
+        int ret = uring_submit_locked(&io->uring, request);
+        pthread_mutex_unlock(&io->mutex);
+
+        if (ret == 0) {
+            return;
+        }
+        request->error = EIO;
+    } else if (res < 0) {
+        request->error = -res;
+    } else if (res == 0) {
+        request->error = EIO; /* the file got shorter than its size */
+    } else {
+        request->done += res;
+    }
+
+    request_finish(io, request);
+}
+
+/*
+ * the kernel posts the completions in the shared ring whether anyone waits for them or not, when waiting fails the
+ * reaper keeps reading the ring every REAPER_POLL_MS so the requests in flight still complete, the requests
+ * submitted after that fail on their own since submitting goes through the same system call
+ */
+
+static void* uring_reaper(void* arg) {
+    image_io_t* io = arg;
+    uring_t* uring = &io->uring;
+    bool stopping  = false;
+    bool polling   = false;
+
+    const struct timespec period = {.tv_sec = 0, .tv_nsec = REAPER_POLL_MS * 1000000L};
+
+    while (!stopping) {
+        if (polling) {
+            nanosleep(&period, NULL);
+        } else if (syscall(SYS_io_uring_enter, uring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+                   errno != EINTR) {
+            LOG_ERROR_ERRNO("io_uring_enter");
+            polling = true;
+        }
+
+        unsigned head = *uring->cq_head;
+        unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+        /*
+         * requests are submitted with the mutex held, going through it once per batch orders what the submitters
+         * wrote before the completions are handled without relying on the kernel, which the C memory model and
+         * the thread sanitizer know nothing about
+         */
+
+        pthread_mutex_lock(&io->mutex);
+        pthread_mutex_unlock(&io->mutex);
+
+        for (; head != tail; head++) {
+            struct io_uring_cqe* entry = &uring->cqes[head & *uring->cq_mask];
+            io_request_t* request      = (io_request_t*)(uintptr_t)entry->user_data;
+            int res                    = entry->res;
+
+            /* release the entry before resubmitting, which may need it */
+
+            __atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+            if (request == NULL) {
+                stopping = true;
+            } else {
+                uring_complete(io, request, res);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static bool uring_supports(int fd) {
+    size_t size                  = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, size);
+    if (probe == NULL) {
+        return false;
+    }
+
+    bool supported = syscall(SYS_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+                     probe->last_op >= IORING_OP_WRITE && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+                     (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+
+    free(probe);
+    return supported;
+}
+
+/* returns -1 without logging anything when io_uring isn't usable, the caller falls back to the I/O threads */
+
+static int uring_setup(uring_t* uring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    uring->fd = syscall(SYS_io_uring_setup, MAX_IN_FLIGHT, &params);
+    if (uring->fd < 0) {
+        goto fail_exit;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !uring_supports(uring->fd)) {
+        goto fail_close_ring;
+    }
+
+    size_t sq_size   = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size   = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    uring->ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    uring->ring = mmap(NULL, uring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd,
+                       IORING_OFF_SQ_RING);
+    if (uring->ring == MAP_FAILED) {
+        goto fail_close_ring;
+    }
+
+    uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd,
+                       IORING_OFF_SQES);
+    if (uring->sqes == MAP_FAILED) {
+        goto fail_unmap_ring;
+    }
+
+    unsigned char* ring = uring->ring;
+    uring->sq_tail      = (unsigned*)(ring + params.sq_off.tail);
+    uring->sq_mask      = (unsigned*)(ring + params.sq_off.ring_mask);
+    uring->sq_array     = (unsigned*)(ring + params.sq_off.array);
+    uring->cq_head      = (unsigned*)(ring + params.cq_off.head);
+    uring->cq_tail      = (unsigned*)(ring + params.cq_off.tail);
+    uring->cq_mask      = (unsigned*)(ring + params.cq_off.ring_mask);
+    uring->cqes         = (struct io_uring_cqe*)(ring + params.cq_off.cqes);
+
+    return 0;
+
+fail_unmap_ring:
+    munmap(uring->ring, uring->ring_size);
+fail_close_ring:
+    close(uring->fd);
+fail_exit:
+    return -1;
+}
+
+static void uring_teardown(uring_t* uring) {
+    munmap(uring->sqes, uring->sqes_size);
+    munmap(uring->ring, uring->ring_size);
+    close(uring->fd);
+}
+
+static void* io_thread(void* arg) {
+    image_io_t* io = arg;
+
+    while (1) {
+        io_request_t* request = queue_pop(io->queue);
+        if (request == NULL) {
+            break;
+        }
+
+        while (request->done < request->size) {
+            unsigned char* data = request->data + request->done;
+            size_t length       = request->size - request->done;
+
+            ssize_t ret = (request->op == IO_READ) ? pread(request->fd, data, length, request->done)
+                                                   : pwrite(request->fd, data, length, request->done);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret <= 0) {
+                request->error = (ret < 0) ? errno : EIO;
+                break;
+            }
+
+            request->done += ret;
+        }
+
+        request_finish(io, request);
+    }
+
+    return NULL;
+}
+
+static void submit(image_io_t* io, io_request_t* request) {
+    pthread_mutex_lock(&io->mutex);
+
+    while (io->in_flight >= MAX_IN_FLIGHT) {
+        pthread_cond_wait(&io->completed, &io->mutex);
+    }
+
+    io->in_flight++;
+    if (request->op == IO_WRITE) {
+        io->writes_pending++;
+    }
+
+    if (request->size == 0) {
+        pthread_mutex_unlock(&io->mutex);
+        request_finish(io, request);
+        return;
+    }
+
+    if (io->backend == IMAGE_IO_URING) {
+        int ret = uring_submit_locked(&io->uring, request);
+        pthread_mutex_unlock(&io->mutex);
+
+        if (ret < 0) {
+            request->error = EIO;
+            request_finish(io, request);
+        }
+        return;
+    }
+
+    pthread_mutex_unlock(&io->mutex);
+
+    /* the queue holds MAX_IN_FLIGHT requests and the stop markers, it never blocks here */
+
+    if (queue_push(io->queue, request) < 0) {
+        request->error = EIO;
+        request_finish(io, request);
+    }
+}
+
+static io_request_t* read_request(const char* path, image_format_t format) {
+    io_request_t* request = calloc(1, sizeof(*request));
+    if (request == NULL) {
+        LOG_ERROR_ERRNO("calloc");
+        goto fail_exit;
+    }
+
+    request->op     = IO_READ;
+    request->format = format;
+    strcpy(request->path, path);
+
+    request->fd = open(path, O_RDONLY);
+    if (request->fd < 0) {
+        LOG_ERROR_ERRNO("open");
+        goto fail_free_request;
+    }
+
+    struct stat st;
+    if (fstat(request->fd, &st) < 0) {
+        LOG_ERROR_ERRNO("fstat");
+        goto fail_close_file;
+    }
+
+    request->size = st.st_size;
+    request->data = malloc(request->size);
+    if (request->data == NULL && request->size > 0) {
+        LOG_ERROR_ERRNO("malloc");
+        goto fail_close_file;
+    }
+
+    return request;
+
+fail_close_file:
+    close(request->fd);
+fail_free_request:
+    free(request);
+fail_exit:
+    return NULL;
+}
+
+static void read_ahead(image_io_t* io, image_dir_t* image_dir) {
+    char buffer[BUFFER_SIZE];
+
+    while (io->next_id < io->end_id && io->next_id < image_dir->load_current + io->depth) {
+        image_format_t format;
+        if (image_dir_find_format(image_dir, io->next_id, buffer, BUFFER_SIZE, &format) < 0) {
+            io->end_id = io->next_id;
+            break;
+        }
+
+        io_request_t* request = read_request(buffer, format);
+        if (request == NULL) {
+            io->end_id = io->next_id;
+            break;
+        }
+
+        io->reads[io->next_id % io->depth] = request;
+        io->next_id++;
+
+        submit(io, request);
+    }
+}
+
+static void read_wait(image_io_t* io, io_request_t* request) {
+    pthread_mutex_lock(&io->mutex);
+    while (!request->complete) {
+        pthread_cond_wait(&io->completed, &io->mutex);
+    }
+    pthread_mutex_unlock(&io->mutex);
+}
+
+static void read_free(io_request_t* request) {
+    free(request->data);
+    free(request);
+}
+
+image_t* image_io_load_next(image_dir_t* image_dir) {
+    image_io_t* io = image_dir->io;
+    size_t id      = image_dir->load_current;
+
+    read_ahead(io, image_dir);
+
+    image_t* image = NULL;
+
+    if (id < io->end_id) {
+        io_request_t* request     = io->reads[id % io->depth];
+        io->reads[id % io->depth] = NULL;
+
+        read_wait(io, request);
+
+        /* the slot is free again, the next file starts reading while this one is decoded */
+
+        image_dir->load_current++;
+        read_ahead(io, image_dir);
+
+        if (request->error != 0) {
+            LOG_ERROR("couldn't read `%s` (%s)", request->path, strerror(request->error));
+        } else {
+            image = image_decode(request->format, request->data, request->size);
+            if (image == NULL) {
+                LOG_ERROR("couldn't decode `%s`", request->path);
+            }
+        }
+
+        read_free(request);
+
+        if (image == NULL) {
+            image_dir->load_current = id;
+            io->end_id              = id;
+        } else {
+            image->id = id;
+        }
+    }
+
+    if (image == NULL && id == 0) {
+        LOG_ERROR("no image found in directory `%s`", image_dir->input_dir_name);
+    }
+
+    return image;
+}
+
+int image_io_save(image_dir_t* image_dir, image_t* image, const char* filename) {
+    image_io_t* io = image_dir->io;
+
+    io_request_t* request = calloc(1, sizeof(*request));
+    if (request == NULL) {
+        LOG_ERROR_ERRNO("calloc");
+        goto fail_exit;
+    }
+
+    request->op = IO_WRITE;
+    strcpy(request->path, filename);
+
+    void* data;
+    if (image_encode(image, image_dir->output_format, &data, &request->size) < 0) {
+        goto fail_free_request;
+    }
+    request->data = data;
+
+    request->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (request->fd < 0) {
+        LOG_ERROR_ERRNO("open");
+        goto fail_free_data;
+    }
+
+    submit(io, request);
+    return 0;
+
+fail_free_data:
+    free(request->data);
+fail_free_request:
+    free(request);
+fail_exit:
+    return -1;
+}
+
+int image_dir_start_io(image_dir_t* image_dir, image_io_backend_t backend, size_t depth) {
+    if (backend == IMAGE_IO_SYNC) {
+        return 0;
+    }
+
+    image_io_t* io = calloc(1, sizeof(*io));
+    if (io == NULL) {
+        LOG_ERROR_ERRNO("calloc");
+        goto fail_exit;
+    }
+
+    io->depth   = (depth == 0) ? 1 : depth;
+    io->next_id = image_dir->load_current;
+    io->end_id  = SIZE_MAX;
+
+    io->reads = calloc(io->depth, sizeof(*io->reads));
+    if (io->reads == NULL) {
+        LOG_ERROR_ERRNO("calloc");
+        goto fail_free_io;
+    }
+
+    pthread_mutex_init(&io->mutex, NULL);
+    pthread_cond_init(&io->completed, NULL);
+
+    io->backend = backend;
+    if (io->backend == IMAGE_IO_URING && uring_setup(&io->uring) < 0) {
+        io->backend = IMAGE_IO_THREADS;
+    }
+
+    if (io->backend == IMAGE_IO_URING) {
+        errno = pthread_create(&io->uring.reaper, NULL, uring_reaper, io);
+        if (errno != 0) {
+            LOG_ERROR_ERRNO("pthread_create");
+            uring_teardown(&io->uring);
+            goto fail_destroy_mutex;
+        }
+    } else {
+        io->queue = queue_create(MAX_IN_FLIGHT + NB_IO_THREADS);
+        if (io->queue == NULL) {
+            goto fail_destroy_mutex;
+        }
+
+        for (; io->nb_threads < NB_IO_THREADS; io->nb_threads++) {
+            errno = pthread_create(&io->threads[io->nb_threads], NULL, io_thread, io);
+            if (errno != 0) {
+                LOG_ERROR_ERRNO("pthread_create");
+                image_dir->io = io;
+                image_dir_stop_io(image_dir);
+                goto fail_exit;
+            }
+        }
+    }
+
+    image_dir->io = io;
+    return 0;
+
+fail_destroy_mutex:
+    pthread_cond_destroy(&io->completed);
+    pthread_mutex_destroy(&io->mutex);
+    free(io->reads);
+fail_free_io:
+    free(io);
+fail_exit:
+    return -1;
+}
+
+int image_dir_stop_io(image_dir_t* image_dir) {
+    image_io_t* io = image_dir->io;
+    if (io == NULL) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < io->depth; i++) {
+        if (io->reads[i] != NULL) {
+            read_wait(io, io->reads[i]);
+            read_free(io->reads[i]);
+        }
+    }
+
+    pthread_mutex_lock(&io->mutex);
+    while (io->in_flight > 0) {
+        pthread_cond_wait(&io->completed, &io->mutex);
+    }
+    int ret = io->write_failed ? -1 : 0;
+
+    if (io->backend == IMAGE_IO_URING) {
+        /* a no-op without a request wakes the reaper up for the last time */
+        if (uring_submit_locked(&io->uring, NULL) == 0) {
+            pthread_mutex_unlock(&io->mutex);
+            pthread_join(io->uring.reaper, NULL);
+        } else {
+            pthread_mutex_unlock(&io->mutex);
+            pthread_cancel(io->uring.reaper);
+            pthread_join(io->uring.reaper, NULL);
+        }
+        uring_teardown(&io->uring);
+    } else {
+        pthread_mutex_unlock(&io->mutex);
+        for (size_t i = 0; i < io->nb_threads; i++) {
+            queue_push(io->queue, NULL);
+        }
+        for (size_t i = 0; i < io->nb_threads; i++) {
+            pthread_join(io->threads[i], NULL);
+        }
+        queue_destroy(io->queue);
+    }
+
+    pthread_cond_destroy(&io->completed);
+    pthread_mutex_destroy(&io->mutex);
+    free(io->reads);
+    free(io);
+
+    image_dir->io = NULL;
+    return ret;
+}
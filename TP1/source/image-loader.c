@@ -0,0 +1,211 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "image-loader.h"
+#include "log.h"
+
+/*
+ * every loader thread reserves the next id under the mutex, decodes the file outside of it and parks the image
+ * in the slot of its id, image_loader_next() hands the slots out in id order so the output names don't depend
+ * on which thread decoded what
+ *
+ * ids are only reserved up to `depth` past the one the pipeline waits for, which bounds the memory used by
+ * decoded images nobody asked for yet and makes sure two reserved ids never share a slot, a thread that reserves
+ * an id also tells the kernel to start reading the file it will most likely reserve next
+ */
+
+#define BUFFER_SIZE 256
+#define DEPTH_PER_THREAD 2
+
+struct image_loader {
+    image_dir_t* image_dir;
+    pthread_t* threads;
+    size_t nb_threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready; /* a slot was filled or the end was found */
+    pthread_cond_t space; /* the pipeline took an image */
+    image_t** slots;
+    size_t depth;
+    size_t next_id; /* next id to reserve */
+    size_t end_id;  /* first id that has no file or failed to load */
+    bool stopping;
+};
+
+static void prefetch(image_dir_t* image_dir, size_t id) {
+    char buffer[BUFFER_SIZE];
+
+    if (image_dir_find(image_dir, id, buffer, BUFFER_SIZE) == NULL) {
+        return;
+    }
+
+    int fd = open(buffer, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+static void* loader_thread(void* arg) {
+    image_loader_t* loader = arg;
+    image_dir_t* image_dir = loader->image_dir;
+    char buffer[BUFFER_SIZE];
+
+    while (1) {
+        pthread_mutex_lock(&loader->mutex);
+
+        while (!loader->stopping && loader->next_id < loader->end_id &&
+               loader->next_id >= image_dir->load_current + loader->depth) {
+            pthread_cond_wait(&loader->space, &loader->mutex);
+        }
+
+        if (loader->stopping || loader->next_id >= loader->end_id) {
+            pthread_mutex_unlock(&loader->mutex);
+            break;
+        }
+
+        size_t id = loader->next_id++;
+        pthread_mutex_unlock(&loader->mutex);
+
+        prefetch(image_dir, id + loader->nb_threads);
+
+        image_t* image    = NULL;
+        image_load_t load = image_dir_find(image_dir, id, buffer, BUFFER_SIZE);
+        if (load != NULL) {
+            image = load(buffer);
+        }
+
+        pthread_mutex_lock(&loader->mutex);
+
+        if (image != NULL) {
+            image->id                         = id;
+            loader->slots[id % loader->depth] = image;
+        } else if (id < loader->end_id) {
+            loader->end_id = id;
+        }
+
+        pthread_cond_broadcast(&loader->ready);
+        pthread_mutex_unlock(&loader->mutex);
+    }
+
+    return NULL;
+}
+
+image_t* image_loader_next(image_dir_t* image_dir) {
+    image_loader_t* loader = image_dir->loader;
+
+    pthread_mutex_lock(&loader->mutex);
+
+    size_t id = image_dir->load_current;
+    while (loader->slots[id % loader->depth] == NULL && id < loader->end_id && !image_dir->stop) {
+        pthread_cond_wait(&loader->ready, &loader->mutex);
+    }
+
+    /* an image past the end can't be returned, the files must stay contiguous like in the synchronous loader */
+
+    image_t* image = NULL;
+    if (id < loader->end_id && !image_dir->stop) {
+        image                             = loader->slots[id % loader->depth];
+        loader->slots[id % loader->depth] = NULL;
+        image_dir->load_current++;
+        pthread_cond_broadcast(&loader->space);
+    }
+
+    pthread_mutex_unlock(&loader->mutex);
+
+    if (image == NULL && id == 0 && !image_dir->stop) {
+        LOG_ERROR("no image found in directory `%s`", image_dir->input_dir_name);
+    }
+
+    return image;
+}
+
+int image_dir_start_loaders(image_dir_t* image_dir, size_t nb_threads) {
+    if (nb_threads <= 1) {
+        return 0;
+    }
+
+    image_loader_t* loader = calloc(1, sizeof(*loader));
+    if (loader == NULL) {
+        LOG_ERROR_ERRNO("calloc");
+        goto fail_exit;
+    }
+
+    loader->image_dir  = image_dir;
+    loader->nb_threads = nb_threads;
+    loader->depth      = DEPTH_PER_THREAD * nb_threads;
+    loader->next_id    = image_dir->load_current;
+    loader->end_id     = SIZE_MAX;
+
+    loader->slots = calloc(loader->depth, sizeof(*loader->slots));
+    if (loader->slots == NULL) {
+        LOG_ERROR_ERRNO("calloc");
+        goto fail_free_loader;
+    }
+
+    loader->threads = calloc(nb_threads, sizeof(*loader->threads));
+    if (loader->threads == NULL) {
+        LOG_ERROR_ERRNO("calloc");
+        goto fail_free_slots;
+    }
+
+    pthread_mutex_init(&loader->mutex, NULL);
+    pthread_cond_init(&loader->ready, NULL);
+    pthread_cond_init(&loader->space, NULL);
+
+    image_dir->loader = loader;
+
+    for (size_t i = 0; i < nb_threads; i++) {
+        errno = pthread_create(&loader->threads[i], NULL, loader_thread, loader);
+        if (errno != 0) {
+            LOG_ERROR_ERRNO("pthread_create");
+            loader->nb_threads = i;
+            image_dir_stop_loaders(image_dir);
+            goto fail_exit;
+        }
+    }
+
+    return 0;
+
+fail_free_slots:
+    free(loader->slots);
+fail_free_loader:
+    free(loader);
+fail_exit:
+    return -1;
+}
+
+void image_dir_stop_loaders(image_dir_t* image_dir) {
+    image_loader_t* loader = image_dir->loader;
+    if (loader == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&loader->mutex);
+    loader->stopping = true;
+    pthread_cond_broadcast(&loader->space);
+    pthread_mutex_unlock(&loader->mutex);
+
+    for (size_t i = 0; i < loader->nb_threads; i++) {
+        pthread_join(loader->threads[i], NULL);
+    }
+
+    for (size_t i = 0; i < loader->depth; i++) {
+        if (loader->slots[i] != NULL) {
+            image_destroy(loader->slots[i]);
+        }
+    }
+
+    pthread_cond_destroy(&loader->space);
+    pthread_cond_destroy(&loader->ready);
+    pthread_mutex_destroy(&loader->mutex);
+    free(loader->threads);
+    free(loader->slots);
+    free(loader);
+
+    image_dir->loader = NULL;
+}
@@ -0,0 +1,445 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "image-png.h"
+#include "log.h"
+
+/*
+ * PNG encoder compressing one image on several threads the way pigz does, without libpng
+ *
+ * the filtered rows are cut in chunks of about CHUNK_BYTES, every chunk is deflated on its own as a raw stream
+ * primed with the last 32 KiB of the chunk before it, so matches can still cross chunk boundaries, and ends on a
+ * byte aligned sync flush, the streams are then concatenated behind a zlib header and closed with the combined
+ * adler32, every chunk is written as its own IDAT
+ *
+ * the chunks are filtered first (a row only depends on the row above in the image) and deflated in a second
+ * round of workers since a chunk's dictionary comes from the filtered bytes of the previous chunk
+ */
+
+#define CHUNK_BYTES (128 * 1024)
+#define DICTIONARY_BYTES (32 * 1024)
+#define BYTES_PER_PIXEL 4
+
+typedef struct chunk {
+    size_t row_begin;
+    size_t row_end;
+    unsigned char* out; /* 2 bytes of room for the zlib header and 4 for the adler32 trailer */
+    size_t out_size;
+    size_t out_used;
+    uLong adler;
+    int ret;
+} chunk_t;
+
+typedef struct encoder {
+    image_t* image;
+    int level;
+    int filters;
+    size_t stride; /* filter byte then the row */
+    unsigned char* filtered;
+    chunk_t* chunks;
+    size_t nb_chunks;
+    atomic_size_t next;
+} encoder_t;
+
+/* what a worker keeps from one chunk to the next */
+
+typedef struct scratch {
+    unsigned char* rows; /* a candidate row then a row of zeros used above the first row */
+    z_stream stream;     /* reset between the chunks instead of set up for each of them */
+    bool stream_ready;
+} scratch_t;
+
+typedef void (*encoder_step_t)(encoder_t* encoder, size_t index, scratch_t* scratch);
+
+static unsigned char paeth(int a, int b, int c) {
+    int p  = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+
+    if (pa <= pb && pa <= pc) {
+        return a;
+    }
+    return (pb <= pc) ? b : c;
+}
+
+/* up is a row of zeros for the first row of the image */
+
+static void filter_row(const unsigned char* row, const unsigned char* up, unsigned char* out, size_t size, int type) {
+    const size_t bpp = BYTES_PER_PIXEL;
+
+    switch (type) {
+    case 0:
+        memcpy(out, row, size);
+        break;
+    case 1:
+        memcpy(out, row, bpp);
+        for (size_t i = bpp; i < size; i++) {
+            out[i] = row[i] - row[i - bpp];
+        }
+        break;
+    case 2:
+        for (size_t i = 0; i < size; i++) {
+            out[i] = row[i] - up[i];
+        }
+        break;
+    case 3:
+        for (size_t i = 0; i < bpp; i++) {
+            out[i] = row[i] - (up[i] >> 1);
+        }
+        for (size_t i = bpp; i < size; i++) {
+            out[i] = row[i] - ((row[i - bpp] + up[i]) >> 1);
+        }
+        break;
+    default:
+        for (size_t i = 0; i < bpp; i++) {
+            out[i] = row[i] - up[i];
+        }
+        for (size_t i = bpp; i < size; i++) {
+            out[i] = row[i] - paeth(row[i - bpp], up[i], up[i - bpp]);
+        }
+        break;
+    }
+}
+
+/* sum of the filtered bytes taken as signed values, the heuristic libpng uses to pick a filter */
+
+static size_t filter_cost(const unsigned char* out, size_t size) {
+    size_t cost = 0;
+    for (size_t i = 0; i < size; i++) {
+        cost += abs((signed char)out[i]);
+    }
+    return cost;
+}
+
+static void filter_chunk(encoder_t* encoder, size_t index, scratch_t* scratch) {
+    chunk_t* chunk       = &encoder->chunks[index];
+    size_t size          = encoder->stride - 1;
+    unsigned char* rows  = scratch->rows;
+    unsigned char* zeros = rows + size;
+
+    for (size_t j = chunk->row_begin; j < chunk->row_end; j++) {
+        const unsigned char* row = (const unsigned char*)image_get_pixel(encoder->image, 0, j);
+        const unsigned char* up  = (j > 0) ? (const unsigned char*)image_get_pixel(encoder->image, 0, j - 1) : zeros;
+        unsigned char* out       = &encoder->filtered[j * encoder->stride];
+
+        int best_type    = -1;
+        size_t best_cost = SIZE_MAX;
+
+        for (int type = 0; type < 5; type++) {
+            if (!(encoder->filters & (IMAGE_PNG_FILTER_NONE << type))) {
+                continue;
+            }
+
+            unsigned char* candidate = (best_type < 0) ? out + 1 : rows;
+            filter_row(row, up, candidate, size, type);
+
+            /* a single allowed filter needs no cost */
+
+            if (encoder->filters == (IMAGE_PNG_FILTER_NONE << type)) {
+                best_type = type;
+                break;
+            }
+
+            size_t cost = filter_cost(candidate, size);
+            if (cost < best_cost) {
+                if (candidate == rows) {
+                    memcpy(out + 1, rows, size);
+                }
+                best_type = type;
+                best_cost = cost;
+            }
+        }
+
+        out[0] = best_type;
+    }
+}
+
+static void deflate_chunk(encoder_t* encoder, size_t index, scratch_t* scratch) {
+    chunk_t* chunk   = &encoder->chunks[index];
+    z_stream* stream = &scratch->stream;
+
+    /* the chunk couldn't be filtered */
+
+    if (chunk->ret < 0) {
+        return;
+    }
+
+    if (!scratch->stream_ready) {
+        memset(stream, 0, sizeof(*stream));
+        if (deflateInit2(stream, encoder->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            LOG_ERROR("deflateInit2 failed");
+            chunk->ret = -1;
+            return;
+        }
+        scratch->stream_ready = true;
+    } else if (deflateReset(stream) != Z_OK) {
+        LOG_ERROR("deflateReset failed");
+        chunk->ret = -1;
+        return;
+    }
+
+    unsigned char* begin = &encoder->filtered[chunk->row_begin * encoder->stride];
+    size_t size          = (chunk->row_end - chunk->row_begin) * encoder->stride;
+
+    if (index > 0) {
+        size_t dictionary = begin - encoder->filtered;
+        if (dictionary > DICTIONARY_BYTES) {
+            dictionary = DICTIONARY_BYTES;
+        }
+        deflateSetDictionary(stream, begin - dictionary, dictionary);
+    }
+
+    bool last         = (index + 1 == encoder->nb_chunks);
+    stream->next_in   = begin;
+    stream->avail_in  = size;
+    stream->next_out  = chunk->out + 2;
+    stream->avail_out = chunk->out_size - 2 - 4;
+
+    int ret = deflate(stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (ret != (last ? Z_STREAM_END : Z_OK) || stream->avail_in != 0) {
+        LOG_ERROR("deflate failed (%d)", ret);
+        chunk->ret = -1;
+        return;
+    }
+
+    chunk->out_used = chunk->out_size - 2 - 4 - stream->avail_out;
+    chunk->adler    = adler32(adler32(0, NULL, 0), begin, size);
+}
+
+typedef struct worker {
+    encoder_t* encoder;
+    encoder_step_t step;
+} worker_t;
+
+static void* encoder_worker(void* arg) {
+    worker_t* worker   = arg;
+    encoder_t* encoder = worker->encoder;
+    scratch_t scratch  = {.rows = calloc(2, encoder->stride), .stream_ready = false};
+    size_t index;
+
+    while ((index = atomic_fetch_add(&encoder->next, 1)) < encoder->nb_chunks) {
+        if (scratch.rows == NULL) {
+            encoder->chunks[index].ret = -1;
+            continue;
+        }
+        worker->step(encoder, index, &scratch);
+    }
+
+    if (scratch.stream_ready) {
+        deflateEnd(&scratch.stream);
+    }
+    free(scratch.rows);
+    return NULL;
+}
+
+/* runs step on every chunk, the calling thread takes part and picks up the work of helpers that didn't start */
+
+static void encoder_run(encoder_t* encoder, encoder_step_t step, size_t nb_threads) {
+    worker_t worker = {.encoder = encoder, .step = step};
+    pthread_t threads[nb_threads];
+
+    atomic_store(&encoder->next, 0);
+
+    size_t started = 1;
+    for (; started < nb_threads; started++) {
+        if (pthread_create(&threads[started], NULL, encoder_worker, &worker) != 0) {
+            break;
+        }
+    }
+
+    encoder_worker(&worker);
+
+    for (size_t i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+static void put_u32(unsigned char* out, uint32_t value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+static int write_chunk(FILE* file, const char* type, const unsigned char* data, size_t size) {
+    unsigned char header[8];
+    unsigned char trailer[4];
+
+    put_u32(header, size);
+    memcpy(header + 4, type, 4);
+
+    /* crc32() takes a NULL buffer as a request for the initial value, IEND has no data */
+
+    uLong crc = crc32(crc32(0, NULL, 0), header + 4, 4);
+    if (size > 0) {
+        crc = crc32(crc, data, size);
+    }
+    put_u32(trailer, crc);
+
+    if (fwrite(header, 1, sizeof(header), file) != sizeof(header) ||
+        (size > 0 && fwrite(data, 1, size, file) != size) ||
+        fwrite(trailer, 1, sizeof(trailer), file) != sizeof(trailer)) {
+        LOG_ERROR_ERRNO("fwrite");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int write_png(encoder_t* encoder, FILE* file) {
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+    /* 8 bit depth, RGBA, deflate, adaptive filtering, not interlaced */
+
+    unsigned char ihdr[13] = {[8] = 8, [9] = 6, [10] = 0, [11] = 0, [12] = 0};
+    put_u32(ihdr, encoder->image->width);
+    put_u32(ihdr + 4, encoder->image->height);
+
+    if (fwrite(signature, 1, sizeof(signature), file) != sizeof(signature)) {
+        LOG_ERROR_ERRNO("fwrite");
+        return -1;
+    }
+
+    if (write_chunk(file, "IHDR", ihdr, sizeof(ihdr)) < 0) {
+        return -1;
+    }
+
+    /* zlib header with the FLEVEL hint zlib itself would write for this level */
+
+    int level      = (encoder->level == Z_DEFAULT_COMPRESSION) ? 6 : encoder->level;
+    int flevel     = (level < 2) ? 0 : (level < 6) ? 1 : (level == 6) ? 2 : 3;
+    unsigned flags = (0x78 << 8) | (flevel << 6);
+    flags += 31 - flags % 31;
+
+    uLong adler = adler32(0, NULL, 0);
+
+    for (size_t i = 0; i < encoder->nb_chunks; i++) {
+        chunk_t* chunk      = &encoder->chunks[i];
+        unsigned char* data = chunk->out + 2;
+        size_t size         = chunk->out_used;
+
+        adler = adler32_combine(adler, chunk->adler, (chunk->row_end - chunk->row_begin) * encoder->stride);
+
+        if (i == 0) {
+            data -= 2;
+            size += 2;
+            data[0] = flags >> 8;
+            data[1] = flags;
+        }
+
+        if (i + 1 == encoder->nb_chunks) {
+            put_u32(data + size, adler);
+            size += 4;
+        }
+
+        if (write_chunk(file, "IDAT", data, size) < 0) {
+            return -1;
+        }
+    }
+
+    return write_chunk(file, "IEND", NULL, 0);
+}
+
+int image_write_png_parallel(image_t* image, FILE* file, const image_png_options_t* options) {
+    encoder_t encoder = {
+        .image   = image,
+        .level   = (options->level < 0) ? Z_DEFAULT_COMPRESSION : options->level,
+        .filters = (options->filters == 0) ? IMAGE_PNG_FILTER_ALL : options->filters,
+        .stride  = 1 + image->width * BYTES_PER_PIXEL,
+    };
+
+    if (image->width == 0 || image->height == 0) {
+        LOG_ERROR("can't save an empty image");
+        goto fail_exit;
+    }
+
+    size_t rows_per_chunk = (CHUNK_BYTES + encoder.stride - 1) / encoder.stride;
+    encoder.nb_chunks     = (image->height + rows_per_chunk - 1) / rows_per_chunk;
+
+    size_t nb_threads = (options->threads < encoder.nb_chunks) ? options->threads : encoder.nb_chunks;
+    if (nb_threads == 0) {
+        nb_threads = 1;
+    }
+
+    encoder.filtered = malloc(image->height * encoder.stride);
+    if (encoder.filtered == NULL) {
+        LOG_ERROR_ERRNO("malloc");
+        goto fail_exit;
+    }
+
+    encoder.chunks = calloc(encoder.nb_chunks, sizeof(*encoder.chunks));
+    if (encoder.chunks == NULL) {
+        LOG_ERROR_ERRNO("calloc");
+        goto fail_free_filtered;
+    }
+
+    size_t allocated = 0;
+    for (; allocated < encoder.nb_chunks; allocated++) {
+        chunk_t* chunk   = &encoder.chunks[allocated];
+        chunk->row_begin = allocated * rows_per_chunk;
+        chunk->row_end   = chunk->row_begin + rows_per_chunk;
+        if (chunk->row_end > image->height) {
+            chunk->row_end = image->height;
+        }
+
+        /* the sync flush adds an empty stored block on top of what deflateBound() accounts for */
+
+        chunk->out_size = 2 + deflateBound(NULL, (chunk->row_end - chunk->row_begin) * encoder.stride) + 16 + 4;
+        chunk->out      = malloc(chunk->out_size);
+        if (chunk->out == NULL) {
+            LOG_ERROR_ERRNO("malloc");
+            goto fail_free_chunks;
+        }
+    }
+
+    encoder_run(&encoder, filter_chunk, nb_threads);
+    encoder_run(&encoder, deflate_chunk, nb_threads);
+
+    for (size_t i = 0; i < encoder.nb_chunks; i++) {
+        if (encoder.chunks[i].ret < 0) {
+            goto fail_free_chunks;
+        }
+    }
+
+    int ret = write_png(&encoder, file);
+
+    for (size_t i = 0; i < encoder.nb_chunks; i++) {
+        free(encoder.chunks[i].out);
+    }
+    free(encoder.chunks);
+    free(encoder.filtered);
+
+    return ret;
+
+fail_free_chunks:
+    for (size_t i = 0; i < allocated; i++) {
+        free(encoder.chunks[i].out);
+    }
+    free(encoder.chunks);
+fail_free_filtered:
+    free(encoder.filtered);
+fail_exit:
+    return -1;
+}
+
+int image_save_png_parallel(image_t* image, char* filename, const image_png_options_t* options) {
+    FILE* file = fopen(filename, "wb");
+    if (file == NULL) {
+        LOG_ERROR_ERRNO("fopen");
+        return -1;
+    }
+
+    int ret = image_write_png_parallel(image, file, options);
+    if (fclose(file) != 0) {
+        LOG_ERROR_ERRNO("fclose");
+        ret = -1;
+    }
+
+    return ret;
+}
@@ -0,0 +1,276 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image-pool.h"
+#include "log.h"
+
+/*
+ * every buffer is preceded by a cache line holding its size class, so image_pool_put() does not need the size
+ * and the pixels stay aligned for the SIMD filters
+ *
+ * class 0 holds everything up to POOL_MIN_BYTES, above that a class covers a quarter of a power of two, which
+ * keeps the memory wasted by rounding under 25%
+ *
+ * the thread caches are bounded in bytes and only keep the buffers up to POOL_CACHE_MAX_BLOCK, the lock they save
+ * is nothing next to filling a larger frame, and a frame held by a thread that only frees them, like a saver,
+ * would stay out of both max_bytes and the in-flight budget of the pipeline for the whole run
+ */
+
+#define CACHE_LINE_SIZE 64
+#define POOL_HEADER_SIZE CACHE_LINE_SIZE
+#define POOL_MIN_SHIFT 12
+#define POOL_MIN_BYTES ((size_t)1 << POOL_MIN_SHIFT)
+#define POOL_NB_CLASSES ((64 - POOL_MIN_SHIFT) * 4 + 1)
+#define POOL_CACHE_SIZE 8
+#define POOL_CACHE_MAX_BYTES ((size_t)4 << 20)
+#define POOL_CACHE_MAX_BLOCK ((size_t)1 << 20)
+#define POOL_DEFAULT_MAX_BYTES ((size_t)256 << 20)
+
+typedef struct pool_block {
+    struct pool_block* next;
+    size_t class;
+    size_t bytes;
+} pool_block_t;
+
+typedef struct pool_cache {
+    image_pool_t* pool;
+    size_t count;
+    size_t bytes;
+    pool_block_t* blocks[POOL_CACHE_SIZE]; /* oldest first */
+} pool_cache_t;
+
+struct image_pool {
+    pthread_key_t cache_key;
+    pthread_mutex_t mutex;
+    size_t max_bytes;
+    size_t bytes; /* held by the free lists */
+    pool_block_t* free[POOL_NB_CLASSES];
+    atomic_size_t allocated;
+    atomic_size_t reused;
+    atomic_size_t released;
+};
+
+static pthread_once_t default_pool_once = PTHREAD_ONCE_INIT;
+static image_pool_t* default_pool;
+
+static size_t pool_class(size_t bytes, size_t* class_bytes) {
+    if (bytes <= POOL_MIN_BYTES) {
+        *class_bytes = POOL_MIN_BYTES;
+        return 0;
+    }
+
+    /* 2^shift < bytes <= 2^(shift + 1) */
+    int shift      = 63 - __builtin_clzll(bytes - 1);
+    size_t base    = (size_t)1 << shift;
+    size_t quarter = base >> 2;
+    size_t k       = (bytes - 1 - base) / quarter + 1;
+
+    *class_bytes = base + k * quarter;
+    return (shift - POOL_MIN_SHIFT) * 4 + k;
+}
+
+static pool_block_t* pool_block(pixel_t* pixels) {
+    return (pool_block_t*)((char*)pixels - POOL_HEADER_SIZE);
+}
+
+static pixel_t* pool_pixels(pool_block_t* block) {
+    return (pixel_t*)((char*)block + POOL_HEADER_SIZE);
+}
+
+static void pool_put_shared(image_pool_t* pool, pool_block_t* block) {
+    pthread_mutex_lock(&pool->mutex);
+
+    if (pool->bytes + block->bytes > pool->max_bytes) {
+        pthread_mutex_unlock(&pool->mutex);
+        free(block);
+        atomic_fetch_add(&pool->released, 1);
+        return;
+    }
+
+    block->next              = pool->free[block->class];
+    pool->free[block->class] = block;
+    pool->bytes += block->bytes;
+
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static pool_block_t* pool_get_shared(image_pool_t* pool, size_t class) {
+    pthread_mutex_lock(&pool->mutex);
+
+    pool_block_t* block = pool->free[class];
+    if (block != NULL) {
+        pool->free[class] = block->next;
+        pool->bytes -= block->bytes;
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+    return block;
+}
+
+/* runs when a thread exits, its buffers go back to the shared free lists for the other threads */
+static void pool_cache_release(void* arg) {
+    pool_cache_t* cache = arg;
+
+    for (size_t i = 0; i < cache->count; i++) {
+        pool_put_shared(cache->pool, cache->blocks[i]);
+    }
+    free(cache);
+}
+
+/* NULL when the cache couldn't be allocated, the shared free lists still work without it */
+static pool_cache_t* pool_cache(image_pool_t* pool) {
+    pool_cache_t* cache = pthread_getspecific(pool->cache_key);
+    if (cache != NULL) {
+        return cache;
+    }
+
+    cache = calloc(1, sizeof(*cache));
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->pool = pool;
+    if (pthread_setspecific(pool->cache_key, cache) != 0) {
+        free(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+image_pool_t* image_pool_create(size_t max_bytes) {
+    image_pool_t* pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) {
+        LOG_ERROR_ERRNO("calloc");
+        goto fail_exit;
+    }
+
+    pool->max_bytes = max_bytes;
+
+    errno = pthread_key_create(&pool->cache_key, pool_cache_release);
+    if (errno != 0) {
+        LOG_ERROR_ERRNO("pthread_key_create");
+        goto fail_free_pool;
+    }
+
+    errno = pthread_mutex_init(&pool->mutex, NULL);
+    if (errno != 0) {
+        LOG_ERROR_ERRNO("pthread_mutex_init");
+        goto fail_delete_key;
+    }
+
+    return pool;
+
+fail_delete_key:
+    pthread_key_delete(pool->cache_key);
+fail_free_pool:
+    free(pool);
+fail_exit:
+    return NULL;
+}
+
+void image_pool_destroy(image_pool_t* pool) {
+    pool_cache_t* cache = pthread_getspecific(pool->cache_key);
+    if (cache != NULL) {
+        pthread_setspecific(pool->cache_key, NULL);
+        pool_cache_release(cache);
+    }
+    pthread_key_delete(pool->cache_key);
+
+    for (size_t class = 0; class < POOL_NB_CLASSES; class++) {
+        while (pool->free[class] != NULL) {
+            pool_block_t* block = pool->free[class];
+            pool->free[class]   = block->next;
+            free(block);
+        }
+    }
+
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+pixel_t* image_pool_get(image_pool_t* pool, size_t count) {
+    if (count > (SIZE_MAX / 2 - POOL_HEADER_SIZE) / sizeof(pixel_t)) {
+        LOG_ERROR("image of %zu pixels is too large", count);
+        return NULL;
+    }
+
+    size_t class_bytes;
+    size_t class = pool_class(count * sizeof(pixel_t), &class_bytes);
+
+    /* the most recently freed buffer of the class is the most likely to still be in cache */
+
+    pool_cache_t* cache = pool_cache(pool);
+    if (cache != NULL) {
+        for (size_t i = cache->count; i-- > 0;) {
+            pool_block_t* block = cache->blocks[i];
+            if (block->class == class) {
+                memmove(&cache->blocks[i], &cache->blocks[i + 1], (cache->count - i - 1) * sizeof(*cache->blocks));
+                cache->count--;
+                cache->bytes -= block->bytes;
+                atomic_fetch_add_explicit(&pool->reused, 1, memory_order_relaxed);
+                return pool_pixels(block);
+            }
+        }
+    }
+
+    pool_block_t* block = pool_get_shared(pool, class);
+    if (block != NULL) {
+        atomic_fetch_add_explicit(&pool->reused, 1, memory_order_relaxed);
+        return pool_pixels(block);
+    }
+
+    block = aligned_alloc(CACHE_LINE_SIZE, POOL_HEADER_SIZE + class_bytes);
+    if (block == NULL) {
+        LOG_ERROR_ERRNO("aligned_alloc");
+        return NULL;
+    }
+
+    block->class = class;
+    block->bytes = class_bytes;
+    atomic_fetch_add_explicit(&pool->allocated, 1, memory_order_relaxed);
+
+    return pool_pixels(block);
+}
+
+void image_pool_put(image_pool_t* pool, pixel_t* pixels) {
+    if (pixels == NULL) {
+        return;
+    }
+
+    pool_block_t* block = pool_block(pixels);
+
+    pool_cache_t* cache = (block->bytes <= POOL_CACHE_MAX_BLOCK) ? pool_cache(pool) : NULL;
+    if (cache == NULL) {
+        pool_put_shared(pool, block);
+        return;
+    }
+
+    while (cache->count == POOL_CACHE_SIZE || cache->bytes + block->bytes > POOL_CACHE_MAX_BYTES) {
+        cache->bytes -= cache->blocks[0]->bytes;
+        pool_put_shared(pool, cache->blocks[0]);
+        memmove(&cache->blocks[0], &cache->blocks[1], (cache->count - 1) * sizeof(*cache->blocks));
+        cache->count--;
+    }
+
+    cache->blocks[cache->count++] = block;
+    cache->bytes                 += block->bytes;
+}
+
+void image_pool_get_stats(image_pool_t* pool, image_pool_stats_t* stats) {
+    stats->allocated = atomic_load(&pool->allocated);
+    stats->reused    = atomic_load(&pool->reused);
+    stats->released  = atomic_load(&pool->released);
+}
+
+static void default_pool_create(void) {
+    default_pool = image_pool_create(POOL_DEFAULT_MAX_BYTES);
+}
+
+image_pool_t* image_pool_default(void) {
+    pthread_once(&default_pool_once, default_pool_create);
+    return default_pool;
+}
@@ -0,0 +1,334 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "log.h"
+
+/*
+ * QOI ("Quite OK Image", https://qoiformat.org/qoi-specification.pdf), lossless like PNG but encoded and decoded
+ * in a single pass without entropy coding, always written as 4 channels
+ *
+ * the whole file goes through one buffer so it is read and written with a single system call
+ */
+
+#define QOI_HEADER_SIZE 14
+#define QOI_PADDING_SIZE 8
+#define QOI_MAX_PIXELS 400000000
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+#define QOI_OP_RGBA 0xff
+#define QOI_MASK_2 0xc0
+
+static const unsigned char qoi_padding[QOI_PADDING_SIZE] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+static unsigned int qoi_hash(pixel_t pixel) {
+    const unsigned char* p = pixel.bytes;
+    return (p[0] * 3 + p[1] * 5 + p[2] * 7 + p[3] * 11) % 64;
+}
+
+static bool pixel_equal(pixel_t a, pixel_t b) {
+    return memcmp(a.bytes, b.bytes, sizeof(a.bytes)) == 0;
+}
+
+static void put_u32(unsigned char* out, uint32_t value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+static uint32_t get_u32(const unsigned char* in) {
+    return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) | ((uint32_t)in[2] << 8) | in[3];
+}
+
+static size_t qoi_encode(image_t* image, unsigned char* out) {
+    size_t count = image->width * image->height;
+    pixel_t index[64];
+    pixel_t previous = {{0, 0, 0, 255}};
+    size_t run       = 0;
+    size_t n         = 0;
+
+    memset(index, 0, sizeof(index));
+
+    memcpy(&out[n], "qoif", 4);
+    put_u32(&out[n + 4], image->width);
+    put_u32(&out[n + 8], image->height);
+    out[n + 12] = 4;
+    out[n + 13] = 0;
+    n += QOI_HEADER_SIZE;
+
+    for (size_t i = 0; i < count; i++) {
+        pixel_t pixel = image->pixels[i];
+
+        if (pixel_equal(pixel, previous)) {
+            run++;
+            if (run == 62 || i + 1 == count) {
+                out[n++] = QOI_OP_RUN | (run - 1);
+                run      = 0;
+            }
+            continue;
+        }
+
+        if (run > 0) {
+            out[n++] = QOI_OP_RUN | (run - 1);
+            run      = 0;
+        }
+
+        unsigned int hash = qoi_hash(pixel);
+
+        if (pixel_equal(index[hash], pixel)) {
+            out[n++] = QOI_OP_INDEX | hash;
+        } else if (pixel.bytes[3] != previous.bytes[3]) {
+            out[n++] = QOI_OP_RGBA;
+            memcpy(&out[n], pixel.bytes, 4);
+            n += 4;
+        } else {
+            signed char dr   = pixel.bytes[0] - previous.bytes[0];
+            signed char dg   = pixel.bytes[1] - previous.bytes[1];
+            signed char db   = pixel.bytes[2] - previous.bytes[2];
+            signed char dr_g = dr - dg;
+            signed char db_g = db - dg;
+
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                out[n++] = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+            } else if (dg >= -32 && dg <= 31 && dr_g >= -8 && dr_g <= 7 && db_g >= -8 && db_g <= 7) {
+                out[n++] = QOI_OP_LUMA | (dg + 32);
+                out[n++] = (dr_g + 8) << 4 | (db_g + 8);
+            } else {
+                out[n++] = QOI_OP_RGB;
+                memcpy(&out[n], pixel.bytes, 3);
+                n += 3;
+            }
+        }
+
+        index[hash] = pixel;
+        previous    = pixel;
+    }
+
+    memcpy(&out[n], qoi_padding, QOI_PADDING_SIZE);
+    return n + QOI_PADDING_SIZE;
+}
+
+static int qoi_decode(const unsigned char* in, size_t size, image_t* image) {
+    size_t count = image->width * image->height;
+    size_t end   = size - QOI_PADDING_SIZE;
+    size_t n     = QOI_HEADER_SIZE;
+    pixel_t index[64];
+    pixel_t pixel = {{0, 0, 0, 255}};
+    size_t run    = 0;
+
+    memset(index, 0, sizeof(index));
+
+    for (size_t i = 0; i < count; i++) {
+        if (run > 0) {
+            run--;
+            image->pixels[i] = pixel;
+            continue;
+        }
+
+        if (n >= end) {
+            return -1;
+        }
+
+        unsigned char op = in[n++];
+
+        if (op == QOI_OP_RGB || op == QOI_OP_RGBA) {
+            size_t length = (op == QOI_OP_RGB) ? 3 : 4;
+            if (end - n < length) {
+                return -1;
+            }
+            memcpy(pixel.bytes, &in[n], length);
+            n += length;
+        } else if ((op & QOI_MASK_2) == QOI_OP_INDEX) {
+            pixel = index[op];
+        } else if ((op & QOI_MASK_2) == QOI_OP_DIFF) {
+            pixel.bytes[0] += ((op >> 4) & 0x03) - 2;
+            pixel.bytes[1] += ((op >> 2) & 0x03) - 2;
+            pixel.bytes[2] += (op & 0x03) - 2;
+        } else if ((op & QOI_MASK_2) == QOI_OP_LUMA) {
+            if (n >= end) {
+                return -1;
+            }
+            unsigned char next = in[n++];
+            int dg             = (op & 0x3f) - 32;
+            pixel.bytes[0] += dg - 8 + ((next >> 4) & 0x0f);
+            pixel.bytes[1] += dg;
+            pixel.bytes[2] += dg - 8 + (next & 0x0f);
+        } else {
+            run = op & 0x3f;
+        }
+
+        index[qoi_hash(pixel)] = pixel;
+        image->pixels[i]       = pixel;
+    }
+
+    return 0;
+}
+
+image_t* image_create_from_qoi_memory(const void* data, size_t size) {
+    const unsigned char* buffer = data;
+
+    if (buffer == NULL) {
+        LOG_ERROR_NULL_PTR();
+        goto fail_exit;
+    }
+
+    if (size < QOI_HEADER_SIZE + QOI_PADDING_SIZE) {
+        LOG_ERROR("too small to be a qoi file");
+        goto fail_exit;
+    }
+
+    size_t width  = get_u32(&buffer[4]);
+    size_t height = get_u32(&buffer[8]);
+
+    if (memcmp(buffer, "qoif", 4) != 0 || width == 0 || height == 0 || height > QOI_MAX_PIXELS / width) {
+        LOG_ERROR("not a valid qoi file");
+        goto fail_exit;
+    }
+
+    image_t* image = image_create(0, width, height);
+    if (image == NULL) {
+        goto fail_exit;
+    }
+
+    if (qoi_decode(buffer, size, image) < 0) {
+        LOG_ERROR("truncated qoi file");
+        goto fail_free_image;
+    }
+
+    return image;
+
+fail_free_image:
+    image_destroy(image);
+fail_exit:
+    return NULL;
+}
+
+image_t* image_create_from_qoi(char* filename) {
+    if (filename == NULL) {
+        LOG_ERROR_NULL_PTR();
+        goto fail_exit;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        LOG_ERROR_ERRNO("open");
+        goto fail_exit;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        LOG_ERROR_ERRNO("fstat");
+        goto fail_close_file;
+    }
+
+    size_t size           = st.st_size;
+    unsigned char* buffer = malloc(size);
+    if (buffer == NULL) {
+        LOG_ERROR_ERRNO("malloc");
+        goto fail_close_file;
+    }
+
+    ssize_t ret = read(fd, buffer, size);
+    if (ret < 0) {
+        LOG_ERROR_ERRNO("read");
+        goto fail_free_buffer;
+    }
+    if ((size_t)ret != size) {
+        LOG_ERROR("short read on `%s`", filename);
+        goto fail_free_buffer;
+    }
+
+    image_t* image = image_create_from_qoi_memory(buffer, size);
+    if (image == NULL) {
+        LOG_ERROR("couldn't decode `%s`", filename);
+        goto fail_free_buffer;
+    }
+
+    free(buffer);
+    close(fd);
+
+    return image;
+
+fail_free_buffer:
+    free(buffer);
+fail_close_file:
+    close(fd);
+fail_exit:
+    return NULL;
+}
+
+int image_encode_qoi(image_t* image, void** data, size_t* size) {
+    if (image == NULL || data == NULL || size == NULL) {
+        LOG_ERROR_NULL_PTR();
+        goto fail_exit;
+    }
+
+    /* worst case is QOI_OP_RGBA for every pixel */
+
+    size_t max_size       = QOI_HEADER_SIZE + image->width * image->height * 5 + QOI_PADDING_SIZE;
+    unsigned char* buffer = malloc(max_size);
+    if (buffer == NULL) {
+        LOG_ERROR_ERRNO("malloc");
+        goto fail_exit;
+    }
+
+    *data = buffer;
+    *size = qoi_encode(image, buffer);
+    return 0;
+
+fail_exit:
+    return -1;
+}
+
+int image_save_qoi(image_t* image, char* filename) {
+    if (image == NULL || filename == NULL) {
+        LOG_ERROR_NULL_PTR();
+        goto fail_exit;
+    }
+
+    void* buffer;
+    size_t size;
+    if (image_encode_qoi(image, &buffer, &size) < 0) {
+        goto fail_exit;
+    }
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        LOG_ERROR_ERRNO("open");
+        goto fail_free_buffer;
+    }
+
+    ssize_t ret = write(fd, buffer, size);
+    if (ret < 0) {
+        LOG_ERROR_ERRNO("write");
+        goto fail_close_file;
+    }
+    if ((size_t)ret != size) {
+        LOG_ERROR("short write on `%s`", filename);
+        goto fail_close_file;
+    }
+
+    if (close(fd) < 0) {
+        LOG_ERROR_ERRNO("close");
+        goto fail_free_buffer;
+    }
+
+    free(buffer);
+    return 0;
+
+fail_close_file:
+    close(fd);
+fail_free_buffer:
+    free(buffer);
+fail_exit:
+    return -1;
+}
@@ -0,0 +1,193 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "log.h"
+
+/*
+ * raw frames are a 24 bytes header followed by the RGBA pixels as they are in memory, written with a single
+ * writev() and read straight into the pixel buffer, the header fields use the byte order of the machine since
+ * the files are only meant to be handed to another tool on the same host
+ */
+
+#define RAW_MAGIC "TP1RAW\0\1"
+#define RAW_MAX_PIXELS 400000000
+
+typedef struct raw_header {
+    char magic[8];
+    uint64_t width;
+    uint64_t height;
+} raw_header_t;
+
+image_t* image_create_from_raw(char* filename) {
+    if (filename == NULL) {
+        LOG_ERROR_NULL_PTR();
+        goto fail_exit;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        LOG_ERROR_ERRNO("open");
+        goto fail_exit;
+    }
+
+    raw_header_t header;
+    ssize_t ret = read(fd, &header, sizeof(header));
+    if (ret < 0) {
+        LOG_ERROR_ERRNO("read");
+        goto fail_close_file;
+    }
+
+    if (ret != sizeof(header) || memcmp(header.magic, RAW_MAGIC, sizeof(header.magic)) != 0 || header.width == 0 ||
+        header.height == 0 || header.height > RAW_MAX_PIXELS / header.width) {
+        LOG_ERROR("`%s` is not a valid raw file", filename);
+        goto fail_close_file;
+    }
+
+    image_t* image = image_create(0, header.width, header.height);
+    if (image == NULL) {
+        goto fail_close_file;
+    }
+
+    size_t size = image->width * image->height * sizeof(*image->pixels);
+    ret         = read(fd, image->pixels, size);
+    if (ret < 0) {
+        LOG_ERROR_ERRNO("read");
+        goto fail_free_image;
+    }
+    if ((size_t)ret != size) {
+        LOG_ERROR("`%s` is truncated", filename);
+        goto fail_free_image;
+    }
+
+    close(fd);
+    return image;
+
+fail_free_image:
+    image_destroy(image);
+fail_close_file:
+    close(fd);
+fail_exit:
+    return NULL;
+}
+
+image_t* image_create_from_raw_memory(const void* data, size_t size) {
+    if (data == NULL) {
+        LOG_ERROR_NULL_PTR();
+        goto fail_exit;
+    }
+
+    raw_header_t header;
+    if (size < sizeof(header)) {
+        LOG_ERROR("too small to be a raw file");
+        goto fail_exit;
+    }
+
+    memcpy(&header, data, sizeof(header));
+
+    if (memcmp(header.magic, RAW_MAGIC, sizeof(header.magic)) != 0 || header.width == 0 || header.height == 0 ||
+        header.height > RAW_MAX_PIXELS / header.width) {
+        LOG_ERROR("not a valid raw file");
+        goto fail_exit;
+    }
+
+    image_t* image = image_create(0, header.width, header.height);
+    if (image == NULL) {
+        goto fail_exit;
+    }
+
+    size_t pixels_size = image->width * image->height * sizeof(*image->pixels);
+    if (size - sizeof(header) < pixels_size) {
+        LOG_ERROR("truncated raw file");
+        goto fail_free_image;
+    }
+
+    memcpy(image->pixels, (const unsigned char*)data + sizeof(header), pixels_size);
+    return image;
+
+fail_free_image:
+    image_destroy(image);
+fail_exit:
+    return NULL;
+}
+
+int image_encode_raw(image_t* image, void** data, size_t* size) {
+    if (image == NULL || data == NULL || size == NULL) {
+        LOG_ERROR_NULL_PTR();
+        goto fail_exit;
+    }
+
+    raw_header_t header = {
+        .magic  = RAW_MAGIC,
+        .width  = image->width,
+        .height = image->height,
+    };
+
+    size_t pixels_size    = image->width * image->height * sizeof(*image->pixels);
+    unsigned char* buffer = malloc(sizeof(header) + pixels_size);
+    if (buffer == NULL) {
+        LOG_ERROR_ERRNO("malloc");
+        goto fail_exit;
+    }
+
+    memcpy(buffer, &header, sizeof(header));
+    memcpy(buffer + sizeof(header), image->pixels, pixels_size);
+
+    *data = buffer;
+    *size = sizeof(header) + pixels_size;
+    return 0;
+
+fail_exit:
+    return -1;
+}
+
+int image_save_raw(image_t* image, char* filename) {
+    if (image == NULL || filename == NULL) {
+        LOG_ERROR_NULL_PTR();
+        goto fail_exit;
+    }
+
+    raw_header_t header = {
+        .magic  = RAW_MAGIC,
+        .width  = image->width,
+        .height = image->height,
+    };
+
+    struct iovec iov[2] = {
+        {.iov_base = &header, .iov_len = sizeof(header)},
+        {.iov_base = image->pixels, .iov_len = image->width * image->height * sizeof(*image->pixels)},
+    };
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        LOG_ERROR_ERRNO("open");
+        goto fail_exit;
+    }
+
+    ssize_t ret = writev(fd, iov, 2);
+    if (ret < 0) {
+        LOG_ERROR_ERRNO("writev");
+        goto fail_close_file;
+    }
+    if ((size_t)ret != iov[0].iov_len + iov[1].iov_len) {
+        LOG_ERROR("short write on `%s`", filename);
+        goto fail_close_file;
+    }
+
+    if (close(fd) < 0) {
+        LOG_ERROR_ERRNO("close");
+        goto fail_exit;
+    }
+
+    return 0;
+
+fail_close_file:
+    close(fd);
+fail_exit:
+    return -1;
+}
@@ -0,0 +1,430 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "filter-chain.h"
+#include "image-socket.h"
+#include "log.h"
+
+/*
+ * the server is a pair of image_dir_t hooks, the load hook polls the listening socket and the connections,
+ * accepts the new ones and reads the next request from one that has data (round robin so a busy client can't
+ * starve the others), the save hook sends the reply to the connection the image came from, the drop hook a failure
+ * for an image a filter dropped
+ *
+ * a request is read with blocking calls once its first bytes are there, clients are expected to send whole
+ * frames, the requests waiting for their reply are kept in a list by image id, short since it holds the
+ * images in flight
+ *
+ * a connection is freed once it is closed by the client and every reply to it was sent, the load hook holds one
+ * reference while it polls it and every request waiting for its reply another
+ */
+
+#define MAX_CONNECTIONS 64
+#define LISTEN_BACKLOG 16
+#define POLL_MS 100 /* how often image_dir->stop is checked while no request comes */
+
+typedef struct connection {
+    int fd;
+    size_t refs;                /* under the server mutex */
+    pthread_mutex_t send_mutex; /* the replies of several save threads don't interleave */
+} connection_t;
+
+typedef struct pending {
+    size_t id;
+    uint64_t tag;
+    image_format_t format;
+    connection_t* connection;
+    struct pending* next;
+} pending_t;
+
+struct image_socket {
+    int listen_fd;
+    const char* path;
+    image_dir_hooks_t hooks;
+    const filter_chain_t* filters; /* frames they don't accept are replied a failure before the pipeline */
+    pthread_mutex_t mutex;
+    pending_t* pending;
+    connection_t* polled[MAX_CONNECTIONS]; /* only used by the load hook */
+    size_t nb_polled;
+    size_t next_polled;
+};
+
+static void release_connection(image_socket_t* server, connection_t* connection) {
+    pthread_mutex_lock(&server->mutex);
+    size_t refs = --connection->refs;
+    pthread_mutex_unlock(&server->mutex);
+
+    if (refs == 0) {
+        close(connection->fd);
+        pthread_mutex_destroy(&connection->send_mutex);
+        free(connection);
+    }
+}
+
+static void accept_connection(image_socket_t* server) {
+    int fd = accept(server->listen_fd, NULL, NULL);
+    if (fd < 0) {
+        LOG_ERROR_ERRNO("accept");
+        return;
+    }
+
+    if (server->nb_polled == MAX_CONNECTIONS) {
+        LOG_ERROR("too many connections, closing the new one");
+        close(fd);
+        return;
+    }
+
+    connection_t* connection = malloc(sizeof(*connection));
+    if (connection == NULL) {
+        LOG_ERROR_ERRNO("malloc");
+        close(fd);
+        return;
+    }
+
+    connection->fd   = fd;
+    connection->refs = 1;
+    pthread_mutex_init(&connection->send_mutex, NULL);
+    server->polled[server->nb_polled++] = connection;
+}
+
+static void drop_connection(image_socket_t* server, size_t c) {
+    connection_t* connection = server->polled[c];
+
+    server->polled[c] = server->polled[--server->nb_polled];
+    release_connection(server, connection);
+}
+
+/* returns the bytes read, less than size at the end of the connection, -1 on error */
+
+static ssize_t receive_all(int fd, void* data, size_t size) {
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t ret = recv(fd, (char*)data + done, size - done, 0);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            return -1;
+        }
+        if (ret == 0) {
+            break;
+        }
+        done += ret;
+    }
+
+    return done;
+}
+
+static int send_all(int fd, const void* data, size_t size) {
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t ret = send(fd, (const char*)data + done, size - done, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            return -1;
+        }
+        done += ret;
+    }
+
+    return 0;
+}
+
+/* a client that went away doesn't stop the server, its replies are dropped */
+
+static void send_reply(connection_t* connection, uint64_t tag, uint32_t format, uint32_t status, const void* data,
+                       size_t size) {
+    image_socket_header_t header = {.format = format, .status = status, .tag = tag, .size = size};
+    memcpy(header.magic, IMAGE_SOCKET_MAGIC, sizeof(header.magic));
+
+    pthread_mutex_lock(&connection->send_mutex);
+    if (send_all(connection->fd, &header, sizeof(header)) < 0 || send_all(connection->fd, data, size) < 0) {
+        if (errno != EPIPE && errno != ECONNRESET) {
+            LOG_ERROR_ERRNO("send");
+        }
+    }
+    pthread_mutex_unlock(&connection->send_mutex);
+}
+
+/*
+ * reads the next request of the connection, returns 1 with *image set, or NULL once an error was replied when the
+ * frame doesn't decode or is too small for the filters, 0 at the end of the connection and -1 when it can't be read
+ * anymore
+ */
+
+static int receive_request(image_socket_t* server, connection_t* connection, image_socket_header_t* header,
+                           image_t** image) {
+    ssize_t ret = receive_all(connection->fd, header, sizeof(*header));
+    if (ret == 0 || (ret < 0 && errno == ECONNRESET)) {
+        return 0;
+    }
+    if (ret < 0) {
+        LOG_ERROR_ERRNO("recv");
+        goto fail_exit;
+    }
+
+    if (ret != sizeof(*header) || memcmp(header->magic, IMAGE_SOCKET_MAGIC, sizeof(header->magic)) != 0 ||
+        header->format > IMAGE_FORMAT_RAW || header->size > IMAGE_SOCKET_MAX_SIZE) {
+        LOG_ERROR("invalid request, closing the connection");
+        goto fail_exit;
+    }
+
+    void* data = malloc(header->size);
+    if (data == NULL) {
+        LOG_ERROR_ERRNO("malloc");
+        goto fail_exit;
+    }
+
+    ret = receive_all(connection->fd, data, header->size);
+    if (ret != header->size) {
+        LOG_ERROR("truncated request, closing the connection");
+        goto fail_free_data;
+    }
+
+    *image = image_decode(header->format, data, header->size);
+    free(data);
+
+    if (*image != NULL && !filter_chain_accepts(server->filters, (*image)->width, (*image)->height)) {
+        LOG_ERROR("frame of %zux%zu too small for the filters", (*image)->width, (*image)->height);
+        image_destroy(*image);
+        *image = NULL;
+    }
+
+    if (*image == NULL) {
+        send_reply(connection, header->tag, header->format, IMAGE_SOCKET_FAILED, NULL, 0);
+    }
+    return 1;
+
+fail_free_data:
+    free(data);
+fail_exit:
+    return -1;
+}
+
+static image_t* socket_load(image_dir_t* image_dir) {
+    image_socket_t* server = image_dir->hooks->arg;
+    struct pollfd fds[1 + MAX_CONNECTIONS];
+
+    while (!image_dir->stop) {
+        fds[0] = (struct pollfd){.fd = server->listen_fd, .events = POLLIN};
+        for (size_t c = 0; c < server->nb_polled; c++) {
+            fds[1 + c] = (struct pollfd){.fd = server->polled[c]->fd, .events = POLLIN};
+        }
+
+        int ready = poll(fds, 1 + server->nb_polled, POLL_MS);
+        if (ready < 0 && errno != EINTR) {
+            LOG_ERROR_ERRNO("poll");
+            goto fail_exit;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            accept_connection(server);
+            continue;
+        }
+
+        /* one request per poll, the connections are polled again from the one after it */
+
+        size_t c = server->nb_polled;
+        for (size_t k = 0; k < server->nb_polled && c == server->nb_polled; k++) {
+            size_t candidate = (server->next_polled + k) % server->nb_polled;
+            if (fds[1 + candidate].revents != 0) {
+                c = candidate;
+            }
+        }
+        if (c == server->nb_polled) {
+            continue;
+        }
+        server->next_polled = c + 1;
+
+        image_socket_header_t header;
+        image_t* image = NULL;
+
+        int ret = receive_request(server, server->polled[c], &header, &image);
+        if (ret <= 0) {
+            drop_connection(server, c);
+            continue;
+        }
+        if (image == NULL) {
+            continue;
+        }
+
+        pending_t* pending = malloc(sizeof(*pending));
+        if (pending == NULL) {
+            LOG_ERROR_ERRNO("malloc");
+            image_destroy(image);
+            goto fail_exit;
+        }
+
+        /* image_dir_load_next() gives the image the current id */
+
+        pending->id         = image_dir->load_current;
+        pending->tag        = header.tag;
+        pending->format     = header.format;
+        pending->connection = server->polled[c];
+
+        pthread_mutex_lock(&server->mutex);
+        pending->connection->refs++;
+        pending->next   = server->pending;
+        server->pending = pending;
+        pthread_mutex_unlock(&server->mutex);
+
+        return image;
+    }
+
+fail_exit:
+    return NULL;
+}
+
+/* removes the request of the image from the list, the caller replies and frees it */
+
+static pending_t* take_pending(image_socket_t* server, size_t id) {
+    pthread_mutex_lock(&server->mutex);
+    pending_t** link = &server->pending;
+    while (*link != NULL && (*link)->id != id) {
+        link = &(*link)->next;
+    }
+    pending_t* pending = *link;
+    if (pending != NULL) {
+        *link = pending->next;
+    }
+    pthread_mutex_unlock(&server->mutex);
+
+    if (pending == NULL) {
+        LOG_ERROR("no request for image %zu", id);
+    }
+    return pending;
+}
+
+static int socket_save(image_dir_t* image_dir, image_t* image) {
+    image_socket_t* server = image_dir->hooks->arg;
+
+    pending_t* pending = take_pending(server, image->id);
+    if (pending == NULL) {
+        goto fail_exit;
+    }
+
+    void* data;
+    size_t size;
+    int ret = image_encode(image, pending->format, &data, &size);
+    if (ret < 0) {
+        send_reply(pending->connection, pending->tag, pending->format, IMAGE_SOCKET_FAILED, NULL, 0);
+    } else {
+        send_reply(pending->connection, pending->tag, pending->format, IMAGE_SOCKET_OK, data, size);
+        free(data);
+    }
+
+    release_connection(server, pending->connection);
+    free(pending);
+    return ret;
+
+fail_exit:
+    return -1;
+}
+
+static void socket_drop(image_dir_t* image_dir, size_t id) {
+    image_socket_t* server = image_dir->hooks->arg;
+
+    pending_t* pending = take_pending(server, id);
+    if (pending == NULL) {
+        return;
+    }
+
+    send_reply(pending->connection, pending->tag, pending->format, IMAGE_SOCKET_FAILED, NULL, 0);
+    release_connection(server, pending->connection);
+    free(pending);
+}
+
+int image_dir_start_socket(image_dir_t* image_dir, const char* path, const struct filter_chain* filters) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    struct stat st;
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        LOG_ERROR("socket path `%s` too long", path);
+        goto fail_exit;
+    }
+    strcpy(address.sun_path, path);
+
+    image_socket_t* server = calloc(1, sizeof(*server));
+    if (server == NULL) {
+        LOG_ERROR_ERRNO("calloc");
+        goto fail_exit;
+    }
+
+    server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server->listen_fd < 0) {
+        LOG_ERROR_ERRNO("socket");
+        goto fail_free;
+    }
+
+    /* the socket left behind by a previous server, anything else at that path is kept */
+
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    if (bind(server->listen_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        LOG_ERROR("bind `%s` (%s)", path, strerror(errno));
+        goto fail_close;
+    }
+
+    if (listen(server->listen_fd, LISTEN_BACKLOG) < 0) {
+        LOG_ERROR_ERRNO("listen");
+        goto fail_unlink;
+    }
+
+    server->path    = path;
+    server->filters = filters;
+    server->hooks   = (image_dir_hooks_t){.load = socket_load, .save = socket_save, .drop = socket_drop, .arg = server};
+    pthread_mutex_init(&server->mutex, NULL);
+    image_dir->hooks = &server->hooks;
+    return 0;
+
+fail_unlink:
+    unlink(path);
+fail_close:
+    close(server->listen_fd);
+fail_free:
+    free(server);
+fail_exit:
+    return -1;
+}
+
+void image_dir_stop_socket(image_dir_t* image_dir) {
+    if (image_dir->hooks == NULL) {
+        return;
+    }
+
+    image_socket_t* server = image_dir->hooks->arg;
+
+    /* requests left when the pipeline failed are never replied to */
+
+    while (server->pending != NULL) {
+        pending_t* pending = server->pending;
+        server->pending    = pending->next;
+        release_connection(server, pending->connection);
+        free(pending);
+    }
+
+    while (server->nb_polled > 0) {
+        drop_connection(server, server->nb_polled - 1);
+    }
+
+    close(server->listen_fd);
+    unlink(server->path);
+    pthread_mutex_destroy(&server->mutex);
+    free(server);
+    image_dir->hooks = NULL;
+}
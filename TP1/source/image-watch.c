@@ -0,0 +1,259 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "id-map.h"
+#include "image-loader.h"
+#include "image-watch.h"
+#include "latency.h"
+#include "log.h"
+
+/*
+ * an inotify watch on the input directory reports the files a writer closes or renames into it, the time of that
+ * event is the arrival of the frame and image_watch_next() only decodes a file once it arrived, so it never reads
+ * one that is half written
+ *
+ * the frames already in the directory when the watch starts have no event to wait for, they arrive at the start,
+ * as do the ones found when the kernel reports lost events, a file that then fails to decode was most likely
+ * still being written and is waited for again until its writer closes it
+ *
+ * the arrivals of the frames not saved yet are kept by id and the latencies in a histogram, behind a mutex since
+ * the saves come from any thread, a watch running for days uses as much memory as one running for a minute
+ */
+
+#define BUFFER_SIZE 256
+#define EVENTS_SIZE 4096
+#define POLL_MS 100 /* how often image_dir->stop is checked while no file arrives */
+
+struct image_watch {
+    int fd;
+    pthread_mutex_t mutex;
+    id_map_t arrivals; /* uint64_t by id, from the arrival of the file to its save */
+    latency_histogram_t latencies;
+};
+
+static int set_arrival(image_watch_t* watch, size_t id, uint64_t arrival) {
+    int ret = 0;
+
+    pthread_mutex_lock(&watch->mutex);
+    uint64_t* value = id_map_put(&watch->arrivals, id);
+    if (value == NULL) {
+        ret = -1;
+    } else if (*value == 0) {
+        *value = arrival;
+    }
+    pthread_mutex_unlock(&watch->mutex);
+
+    return ret;
+}
+
+static uint64_t get_arrival(image_watch_t* watch, size_t id) {
+    pthread_mutex_lock(&watch->mutex);
+    uint64_t* value  = id_map_get(&watch->arrivals, id);
+    uint64_t arrival = (value != NULL) ? *value : 0;
+    pthread_mutex_unlock(&watch->mutex);
+
+    return arrival;
+}
+
+static void clear_arrival(image_watch_t* watch, size_t id) {
+    pthread_mutex_lock(&watch->mutex);
+    id_map_remove(&watch->arrivals, id);
+    pthread_mutex_unlock(&watch->mutex);
+}
+
+/* the frames are numbered without holes, the ones present from id on arrive now */
+
+static int mark_present(image_dir_t* image_dir, size_t id) {
+    char buffer[BUFFER_SIZE];
+    uint64_t now = latency_now();
+
+    while (image_dir_find(image_dir, id, buffer, BUFFER_SIZE) != NULL) {
+        if (set_arrival(image_dir->watch, id, now) < 0) {
+            return -1;
+        }
+        id++;
+    }
+
+    return 0;
+}
+
+/* the id of a frame file NNNN.ext, -1 for any other name such as the saved images */
+
+static long frame_id(const char* name) {
+    char* end;
+
+    if (name[0] < '0' || name[0] > '9') {
+        return -1;
+    }
+
+    long id = strtol(name, &end, 10);
+    return (*end == '.') ? id : -1;
+}
+
+/* waits up to timeout_ms for events and records the arrivals they report */
+
+static int read_events(image_dir_t* image_dir, int timeout_ms) {
+    image_watch_t* watch = image_dir->watch;
+    char events[EVENTS_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pollfd = {.fd = watch->fd, .events = POLLIN};
+
+    int ready = poll(&pollfd, 1, timeout_ms);
+    if (ready < 0 && errno != EINTR) {
+        LOG_ERROR_ERRNO("poll");
+        goto fail_exit;
+    }
+    if (ready <= 0) {
+        return 0;
+    }
+
+    while (1) {
+        ssize_t length = read(watch->fd, events, EVENTS_SIZE);
+        if (length < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return 0;
+        }
+        if (length < 0) {
+            LOG_ERROR_ERRNO("read");
+            goto fail_exit;
+        }
+
+        uint64_t now = latency_now();
+
+        for (char* p = events; p < events + length;) {
+            struct inotify_event* event = (struct inotify_event*)p;
+            p += sizeof(*event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                LOG_ERROR("inotify events lost, taking the frames present as arrived");
+                if (mark_present(image_dir, image_dir->load_current) < 0) {
+                    goto fail_exit;
+                }
+                continue;
+            }
+
+            long id = (event->len > 0) ? frame_id(event->name) : -1;
+            if (id >= (long)image_dir->load_current && set_arrival(watch, id, now) < 0) {
+                goto fail_exit;
+            }
+        }
+    }
+
+fail_exit:
+    return -1;
+}
+
+image_t* image_watch_next(image_dir_t* image_dir) {
+    image_watch_t* watch = image_dir->watch;
+    size_t id            = image_dir->load_current;
+    char buffer[BUFFER_SIZE];
+
+    while (!image_dir->stop) {
+        if (get_arrival(watch, id) != 0) {
+            image_load_t load = image_dir_find(image_dir, id, buffer, BUFFER_SIZE);
+            image_t* image    = (load != NULL) ? load(buffer) : NULL;
+            if (image != NULL) {
+                image->id = image_dir->load_current++;
+                return image;
+            }
+
+            /* removed or still being written, its next close or rename makes it arrive again */
+            clear_arrival(watch, id);
+        }
+
+        if (read_events(image_dir, POLL_MS) < 0) {
+            goto fail_exit;
+        }
+    }
+
+fail_exit:
+    return NULL;
+}
+
+void image_watch_saved(image_dir_t* image_dir, size_t id) {
+    image_watch_t* watch = image_dir->watch;
+    uint64_t end         = latency_now();
+    uint64_t latency     = 0;
+
+    pthread_mutex_lock(&watch->mutex);
+    uint64_t* arrival = id_map_get(&watch->arrivals, id);
+    if (arrival != NULL) {
+        latency = end - *arrival;
+        latency_add(&watch->latencies, latency);
+        id_map_remove(&watch->arrivals, id);
+    }
+    pthread_mutex_unlock(&watch->mutex);
+
+    if (latency != 0) {
+        printf("\nframe %04zu saved %.3f ms after its arrival\n", id, latency / 1e6);
+        fflush(stdout);
+    }
+}
+
+void image_watch_dropped(image_dir_t* image_dir, size_t id) {
+    clear_arrival(image_dir->watch, id);
+}
+
+int image_dir_start_watch(image_dir_t* image_dir) {
+    image_watch_t* watch = calloc(1, sizeof(*watch));
+    if (watch == NULL) {
+        LOG_ERROR_ERRNO("calloc");
+        goto fail_exit;
+    }
+
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->fd < 0) {
+        LOG_ERROR_ERRNO("inotify_init1");
+        goto fail_free;
+    }
+
+    if (inotify_add_watch(watch->fd, image_dir->input_dir_name, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        LOG_ERROR("inotify_add_watch `%s` (%s)", image_dir->input_dir_name, strerror(errno));
+        goto fail_close;
+    }
+
+    pthread_mutex_init(&watch->mutex, NULL);
+    id_map_init(&watch->arrivals, sizeof(uint64_t));
+    latency_reset(&watch->latencies);
+    image_dir->watch = watch;
+
+    /* after adding the watch, a frame written in between is both present and reported */
+
+    if (mark_present(image_dir, image_dir->load_current) < 0) {
+        image_dir_stop_watch(image_dir);
+        goto fail_exit;
+    }
+
+    return 0;
+
+fail_close:
+    close(watch->fd);
+fail_free:
+    free(watch);
+fail_exit:
+    return -1;
+}
+
+void image_dir_stop_watch(image_dir_t* image_dir) {
+    image_watch_t* watch = image_dir->watch;
+    if (watch == NULL) {
+        return;
+    }
+
+    latency_histogram_t* latencies = &watch->latencies;
+    printf("watch: %llu frames, arrival to save ms: p50 %.3f, p95 %.3f, p99 %.3f, max %.3f\n",
+           (unsigned long long)latencies->count, latency_percentile_ms(latencies, 50),
+           latency_percentile_ms(latencies, 95), latency_percentile_ms(latencies, 99),
+           latency_percentile_ms(latencies, 100));
+
+    close(watch->fd);
+    pthread_mutex_destroy(&watch->mutex);
+    id_map_destroy(&watch->arrivals);
+    free(watch);
+    image_dir->watch = NULL;
+}
@@ -1,12 +1,26 @@
 /* DO NOT EDIT THIS FILE */
 
 #include <png.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "image-cache.h"
+#include "image-io.h"
+#include "image-loader.h"
+#include "image-png.h"
+#include "image-pool.h"
+#include "image-watch.h"
 #include "image.h"
 #include "log.h"
 
+image_png_options_t image_png_options = {
+    .level   = -1,
+    .filters = 0,
+    .threads = 1,
+};
+
 image_t* image_create(size_t id, size_t width, size_t height) {
     image_t* image = calloc(1, sizeof(*image));
     if (image == NULL) {
@@ -18,9 +32,13 @@ image_t* image_create(size_t id, size_t width, size_t height) {
     image->width  = width;
     image->height = height;
 
-    image->pixels = malloc((image->width * image->height) * sizeof(*image->pixels));
+    image_pool_t* pool = image_pool_default();
+    if (pool == NULL) {
+        goto fail_free_image;
+    }
+
+    image->pixels = image_pool_get(pool, image->width * image->height);
     if (image->pixels == NULL) {
-        LOG_ERROR_ERRNO("malloc");
         goto fail_free_image;
     }
 
@@ -33,45 +51,23 @@ fail_exit:
 }
 
 image_t* image_create_from_png(char* filename) {
-    if (filename == NULL) {
-        LOG_ERROR_NULL_PTR();
-        goto fail_exit;
-    }
+    return image_create_from_png_rows(filename, 0, NULL, NULL);
+}
 
-    /* source: https://gist.github.com/niw/5963798 */
+/* everything after the input is set up, the caller owns png and info and frees them whatever happens */
 
-    FILE* file = fopen(filename, "rb");
-    if (file == NULL) {
-        LOG_ERROR_ERRNO("fopen");
-        goto fail_exit;
-    }
-
-    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (png == NULL) {
-        LOG_ERROR("couldn't create png_struct");
-        goto fail_close_file;
-    }
-
-    png_infop info = png_create_info_struct(png);
-    if (info == NULL) {
-        LOG_ERROR("couldn't create png_infop");
-        goto fail_free_png_struct;
-    }
+static image_t* png_decode(png_structp png, png_infop info, const char* name, size_t band_rows,
+                           image_rows_callback_t callback, void* arg) {
+    image_t* volatile image = NULL;
 
     if (setjmp(png_jmpbuf(png))) {
-        goto fail_free_png_info;
+        goto fail_free_image;
     }
 
-    png_init_io(png, file);
     png_read_info(png, info);
 
-    image_t* image = image_create(0, png_get_image_width(png, info), png_get_image_height(png, info));
-    if (image == NULL) {
-        goto fail_free_png_info;
-    }
-
     png_byte color = png_get_color_type(png, info);
-    png_byte depth = png_get_color_type(png, info);
+    png_byte depth = png_get_bit_depth(png, info);
 
     /* read any color_type into 8 bit depth, RGBA format */
 
@@ -103,62 +99,89 @@ image_t* image_create_from_png(char* filename) {
         png_set_gray_to_rgb(png);
     }
 
+    int passes = png_set_interlace_handling(png);
     png_read_update_info(png, info);
 
-    /* read image data */
+    size_t width  = png_get_image_width(png, info);
+    size_t height = png_get_image_height(png, info);
+
+    /* RGBA rows have the layout of pixel_t, libpng decodes straight into the image */
 
-    png_bytep* row_pointers = calloc(image->height, sizeof(*row_pointers));
-    if (row_pointers == NULL) {
+    if (png_get_rowbytes(png, info) != width * sizeof(pixel_t)) {
+        LOG_ERROR("unexpected row size in `%s`", name);
         goto fail_free_image;
     }
 
-    for (int j = 0; j < image->height; j++) {
-        row_pointers[j] = malloc(png_get_rowbytes(png, info));
-        if (row_pointers[j] == NULL) {
-            goto fail_free_rows;
-        }
+    image = image_create(0, width, height);
+    if (image == NULL) {
+        goto fail_exit;
     }
 
-    png_read_image(png, row_pointers);
+    /* an interlaced image only has complete rows after its last pass */
 
-    /* copy image data */
+    size_t band      = (band_rows == 0 || passes > 1) ? height : band_rows;
+    size_t row_begin = 0;
 
-    for (int j = 0; j < image->height; j++) {
-        for (int i = 0; i < image->width; i++) {
-            pixel_t* pixel  = image_get_pixel(image, i, j);
-            pixel->bytes[0] = row_pointers[j][4 * i + 0];
-            pixel->bytes[1] = row_pointers[j][4 * i + 1];
-            pixel->bytes[2] = row_pointers[j][4 * i + 2];
-            pixel->bytes[3] = row_pointers[j][4 * i + 3];
+    for (int pass = 0; pass < passes; pass++) {
+        for (size_t j = 0; j < height; j++) {
+            png_read_row(png, (png_bytep)image_get_pixel(image, 0, j), NULL);
+
+            if (callback == NULL || pass + 1 < passes || (j + 1 - row_begin < band && j + 1 < height)) {
+                continue;
+            }
+
+            if (callback(image, row_begin, j + 1, arg) < 0) {
+                goto fail_free_image;
+            }
+            row_begin = j + 1;
         }
     }
 
-    /* cleanup */
+    return image;
 
-    for (int j = 0; j < image->height; j++) {
-        if (row_pointers[j] != NULL) {
-            free(row_pointers[j]);
-        }
+fail_free_image:
+    if (image != NULL) {
+        image_destroy(image);
+    }
+fail_exit:
+    return NULL;
+}
+
+image_t* image_create_from_png_rows(char* filename, size_t band_rows, image_rows_callback_t callback, void* arg) {
+    if (filename == NULL) {
+        LOG_ERROR_NULL_PTR();
+        goto fail_exit;
+    }
+
+    /* source: https://gist.github.com/niw/5963798 */
+
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        LOG_ERROR_ERRNO("fopen");
+        goto fail_exit;
+    }
+
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (png == NULL) {
+        LOG_ERROR("couldn't create png_struct");
+        goto fail_close_file;
+    }
+
+    png_infop info = png_create_info_struct(png);
+    if (info == NULL) {
+        LOG_ERROR("couldn't create png_infop");
+        goto fail_free_png_struct;
     }
-    free(row_pointers);
+
+    png_init_io(png, file);
+
+    image_t* image = png_decode(png, info, filename, band_rows, callback, arg);
 
     png_destroy_read_struct(&png, &info, NULL);
     fclose(file);
 
     return image;
 
-fail_free_rows:
-    for (int j = 0; j < image->height; j++) {
-        if (row_pointers[j] != NULL) {
-            free(row_pointers[j]);
-        }
-    }
-    free(row_pointers);
-fail_free_image:
-    image_destroy(image);
-fail_free_png_info:
-    png_destroy_read_struct(&png, &info, NULL);
-    goto fail_free_image;
 fail_free_png_struct:
     png_destroy_read_struct(&png, NULL, NULL);
 fail_close_file:
@@ -167,6 +190,57 @@ fail_exit:
     return NULL;
 }
 
+typedef struct png_memory_reader {
+    const unsigned char* data;
+    size_t size;
+    size_t offset;
+} png_memory_reader_t;
+
+static void png_read_memory(png_structp png, png_bytep out, png_size_t length) {
+    png_memory_reader_t* reader = png_get_io_ptr(png);
+
+    if (length > reader->size - reader->offset) {
+        png_error(png, "truncated png data");
+    }
+
+    memcpy(out, reader->data + reader->offset, length);
+    reader->offset += length;
+}
+
+image_t* image_create_from_png_memory(const void* data, size_t size) {
+    png_memory_reader_t reader = {.data = data, .size = size, .offset = 0};
+
+    if (data == NULL) {
+        LOG_ERROR_NULL_PTR();
+        goto fail_exit;
+    }
+
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (png == NULL) {
+        LOG_ERROR("couldn't create png_struct");
+        goto fail_exit;
+    }
+
+    png_infop info = png_create_info_struct(png);
+    if (info == NULL) {
+        LOG_ERROR("couldn't create png_infop");
+        goto fail_free_png_struct;
+    }
+
+    png_set_read_fn(png, &reader, png_read_memory);
+
+    image_t* image = png_decode(png, info, "png data", 0, NULL, NULL);
+
+    png_destroy_read_struct(&png, &info, NULL);
+
+    return image;
+
+fail_free_png_struct:
+    png_destroy_read_struct(&png, NULL, NULL);
+fail_exit:
+    return NULL;
+}
+
 image_t* image_copy(image_t* image) {
     image_t* new_image = image_create(image->id, image->width, image->height);
     if (new_image == NULL) {
@@ -190,111 +264,307 @@ fail_exit:
 
 void image_destroy(image_t* image) {
     if (image->pixels != NULL) {
-        free(image->pixels);
+        image_pool_put(image_pool_default(), image->pixels);
     }
     free(image);
 }
 
-int image_save_png(image_t* image, char* filename) {
-    if (image == NULL || filename == NULL) {
-        LOG_ERROR_NULL_PTR();
-        goto fail_exit;
-    }
+static int png_filters(int filters) {
+    int mask = 0;
 
-    /* source: https://gist.github.com/niw/5963798 */
+    mask |= (filters & IMAGE_PNG_FILTER_NONE) ? PNG_FILTER_NONE : 0;
+    mask |= (filters & IMAGE_PNG_FILTER_SUB) ? PNG_FILTER_SUB : 0;
+    mask |= (filters & IMAGE_PNG_FILTER_UP) ? PNG_FILTER_UP : 0;
+    mask |= (filters & IMAGE_PNG_FILTER_AVG) ? PNG_FILTER_AVG : 0;
+    mask |= (filters & IMAGE_PNG_FILTER_PAETH) ? PNG_FILTER_PAETH : 0;
 
-    FILE* file = fopen(filename, "wb");
-    if (file == NULL) {
-        LOG_ERROR_ERRNO("fopen");
-        goto fail_exit;
+    return mask;
+}
+
+struct image_png_writer {
+    FILE* file;
+    png_structp png;
+    png_infop info;
+    size_t width;
+    size_t height;
+    size_t rows_written;
+    bool failed;
+};
+
+/* the writer owns file from here on, it is closed even when opening the writer fails */
+
+static image_png_writer_t* png_writer_open_file(FILE* file, size_t width, size_t height) {
+    image_png_writer_t* writer = calloc(1, sizeof(*writer));
+    if (writer == NULL) {
+        LOG_ERROR_ERRNO("calloc");
+        goto fail_close_file;
     }
 
-    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (png == NULL) {
+    writer->file   = file;
+    writer->width  = width;
+    writer->height = height;
+
+    /* source: https://gist.github.com/niw/5963798 */
+
+    writer->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (writer->png == NULL) {
         LOG_ERROR("couldn't create png_struct");
-        goto fail_close_file;
+        goto fail_free_writer;
     }
 
-    png_infop info = png_create_info_struct(png);
-    if (info == NULL) {
+    writer->info = png_create_info_struct(writer->png);
+    if (writer->info == NULL) {
         LOG_ERROR("couldn't create png_infop");
         goto fail_free_png_struct;
     }
 
-    if (setjmp(png_jmpbuf(png))) {
+    if (setjmp(png_jmpbuf(writer->png))) {
         goto fail_free_png_info;
     }
 
-    png_init_io(png, file);
+    png_init_io(writer->png, writer->file);
 
     /* output is 8 bit depth, RGBA format */
 
-    png_set_IHDR(png, info, image->width, image->height, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
+    png_set_IHDR(writer->png, writer->info, width, height, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
                  PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
 
-    png_write_info(png, info);
+    if (image_png_options.level >= 0) {
+        png_set_compression_level(writer->png, image_png_options.level);
+    }
+
+    if (image_png_options.filters != 0) {
+        png_set_filter(writer->png, PNG_FILTER_TYPE_BASE, png_filters(image_png_options.filters));
+    }
 
-    /* copy image data */
+    png_write_info(writer->png, writer->info);
 
-    png_bytep* row_pointers = calloc(image->height, sizeof(*row_pointers));
-    if (row_pointers == NULL) {
-        goto fail_free_png_struct;
+    return writer;
+
+fail_free_png_info:
+    png_destroy_write_struct(&writer->png, &writer->info);
+    goto fail_free_writer;
+fail_free_png_struct:
+    png_destroy_write_struct(&writer->png, NULL);
+fail_free_writer:
+    free(writer);
+fail_close_file:
+    fclose(file);
+    return NULL;
+}
+
+image_png_writer_t* image_png_writer_open(char* filename, size_t width, size_t height) {
+    if (filename == NULL) {
+        LOG_ERROR_NULL_PTR();
+        goto fail_exit;
     }
 
-    for (int j = 0; j < image->height; j++) {
-        row_pointers[j] = malloc(png_get_rowbytes(png, info));
-        if (row_pointers[j] == NULL) {
-            goto fail_free_rows;
-        }
+    FILE* file = fopen(filename, "wb");
+    if (file == NULL) {
+        LOG_ERROR_ERRNO("fopen");
+        goto fail_exit;
     }
 
-    for (int j = 0; j < image->height; j++) {
-        for (int i = 0; i < image->width; i++) {
-            pixel_t* pixel             = image_get_pixel(image, i, j);
-            row_pointers[j][4 * i + 0] = pixel->bytes[0];
-            row_pointers[j][4 * i + 1] = pixel->bytes[1];
-            row_pointers[j][4 * i + 2] = pixel->bytes[2];
-            row_pointers[j][4 * i + 3] = pixel->bytes[3];
-        }
+    return png_writer_open_file(file, width, height);
+
+fail_exit:
+    return NULL;
+}
+
+int image_png_writer_write_rows(image_png_writer_t* writer, pixel_t* rows, size_t count) {
+    if (writer->failed) {
+        goto fail_exit;
+    }
+
+    if (count > writer->height - writer->rows_written) {
+        LOG_ERROR("%zu rows written to a png of %zu rows", writer->rows_written + count, writer->height);
+        goto fail_set_failed;
     }
 
-    /* write PNG file */
+    if (setjmp(png_jmpbuf(writer->png))) {
+        goto fail_set_failed;
+    }
 
-    png_write_image(png, row_pointers);
-    png_write_end(png, NULL);
+    for (size_t j = 0; j < count; j++) {
+        png_write_row(writer->png, (png_const_bytep)&rows[j * writer->width]);
+    }
 
-    /* cleanup */
+    writer->rows_written += count;
+    return 0;
 
-    for (int j = 0; j < image->height; j++) {
-        if (row_pointers[j] != NULL) {
-            free(row_pointers[j]);
+fail_set_failed:
+    writer->failed = true;
+fail_exit:
+    return -1;
+}
+
+int image_png_writer_close(image_png_writer_t* writer) {
+    int ret = 0;
+
+    if (!writer->failed && writer->rows_written != writer->height) {
+        LOG_ERROR("png closed after %zu of its %zu rows", writer->rows_written, writer->height);
+        writer->failed = true;
+    }
+
+    if (!writer->failed) {
+        if (setjmp(png_jmpbuf(writer->png))) {
+            writer->failed = true;
+        } else {
+            png_write_end(writer->png, NULL);
         }
     }
-    free(row_pointers);
 
-    png_destroy_write_struct(&png, &info);
-    fclose(file);
+    png_destroy_write_struct(&writer->png, &writer->info);
+
+    if (fclose(writer->file) != 0) {
+        LOG_ERROR_ERRNO("fclose");
+        ret = -1;
+    }
+
+    if (writer->failed) {
+        ret = -1;
+    }
+
+    free(writer);
+    return ret;
+}
+
+int image_save_png(image_t* image, char* filename) {
+    if (image == NULL || filename == NULL) {
+        LOG_ERROR_NULL_PTR();
+        goto fail_exit;
+    }
+
+    if (image_png_options.threads > 1) {
+        return image_save_png_parallel(image, filename, &image_png_options);
+    }
+
+    image_png_writer_t* writer = image_png_writer_open(filename, image->width, image->height);
+    if (writer == NULL) {
+        goto fail_exit;
+    }
+
+    if (image_png_writer_write_rows(writer, image->pixels, image->height) < 0) {
+        image_png_writer_close(writer);
+        goto fail_exit;
+    }
+
+    if (image_png_writer_close(writer) < 0) {
+        goto fail_exit;
+    }
 
     return 0;
 
-fail_free_rows:
-    for (int j = 0; j < image->height; j++) {
-        if (row_pointers[j] != NULL) {
-            free(row_pointers[j]);
+fail_exit:
+    return -1;
+}
+
+int image_encode_png(image_t* image, void** data, size_t* size) {
+    char* buffer = NULL;
+    size_t used  = 0;
+
+    if (image == NULL || data == NULL || size == NULL) {
+        LOG_ERROR_NULL_PTR();
+        goto fail_exit;
+    }
+
+    /* both encoders write to a FILE, a memory stream collects what they write in a buffer that grows as needed */
+
+    FILE* file = open_memstream(&buffer, &used);
+    if (file == NULL) {
+        LOG_ERROR_ERRNO("open_memstream");
+        goto fail_exit;
+    }
+
+    if (image_png_options.threads > 1) {
+        int ret = image_write_png_parallel(image, file, &image_png_options);
+        if (fclose(file) != 0) {
+            LOG_ERROR_ERRNO("fclose");
+            ret = -1;
+        }
+        if (ret < 0) {
+            goto fail_free_buffer;
+        }
+    } else {
+        image_png_writer_t* writer = png_writer_open_file(file, image->width, image->height);
+        if (writer == NULL) {
+            goto fail_free_buffer;
+        }
+
+        if (image_png_writer_write_rows(writer, image->pixels, image->height) < 0) {
+            image_png_writer_close(writer);
+            goto fail_free_buffer;
+        }
+
+        if (image_png_writer_close(writer) < 0) {
+            goto fail_free_buffer;
         }
     }
-    free(row_pointers);
-fail_free_png_info:
-    png_destroy_write_struct(&png, &info);
-    goto fail_close_file;
-fail_free_png_struct:
-    png_destroy_write_struct(&png, NULL);
-fail_close_file:
-    fclose(file);
+
+    *data = buffer;
+    *size = used;
+    return 0;
+
+fail_free_buffer:
+    free(buffer);
 fail_exit:
     return -1;
 }
 
+static const struct {
+    const char* extension;
+    image_t* (*load)(char* filename);
+    int (*save)(image_t* image, char* filename);
+    image_t* (*decode)(const void* data, size_t size);
+    int (*encode)(image_t* image, void** data, size_t* size);
+} image_formats[] = {
+    [IMAGE_FORMAT_PNG] = {"png", image_create_from_png, image_save_png, image_create_from_png_memory,
+                          image_encode_png},
+    [IMAGE_FORMAT_QOI] = {"qoi", image_create_from_qoi, image_save_qoi, image_create_from_qoi_memory,
+                          image_encode_qoi},
+    [IMAGE_FORMAT_RAW] = {"raw", image_create_from_raw, image_save_raw, image_create_from_raw_memory,
+                          image_encode_raw},
+};
+
+#define NB_IMAGE_FORMATS (sizeof(image_formats) / sizeof(image_formats[0]))
+
+image_t* image_decode(image_format_t format, const void* data, size_t size) {
+    return image_formats[format].decode(data, size);
+}
+
+int image_encode(image_t* image, image_format_t format, void** data, size_t* size) {
+    return image_formats[format].encode(image, data, size);
+}
+
+int image_dir_find_format(image_dir_t* image_dir, size_t id, char* buffer, size_t buffer_size,
+                          image_format_t* format) {
+    for (size_t k = 0; k < NB_IMAGE_FORMATS; k++) {
+        int count = snprintf(buffer, buffer_size, "%s/%04ld.%s", image_dir->input_dir_name, id,
+                             image_formats[k].extension);
+        if (count >= buffer_size - 1) {
+            LOG_ERROR("buffer too small");
+            return -1;
+        }
+
+        if (access(buffer, F_OK) == 0) {
+            *format = k;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+image_load_t image_dir_find(image_dir_t* image_dir, size_t id, char* buffer, size_t buffer_size) {
+    image_format_t format;
+
+    if (image_dir_find_format(image_dir, id, buffer, buffer_size, &format) < 0) {
+        return NULL;
+    }
+
+    return image_formats[format].load;
+}
+
 image_t* image_dir_load_next(image_dir_t* image_dir) {
     const size_t buffer_size = 256;
     char buffer[buffer_size];
@@ -303,20 +573,39 @@ image_t* image_dir_load_next(image_dir_t* image_dir) {
         goto stop_exit;
     }
 
-    int count = snprintf(buffer, buffer_size, "%s/%04ld.png", image_dir->input_dir_name, image_dir->load_current);
-    if (count >= buffer_size - 1) {
-        LOG_ERROR("buffer too small");
-        goto fail_exit;
+    if (image_dir->hooks != NULL) {
+        image_t* image = image_dir->hooks->load(image_dir);
+        if (image != NULL) {
+            image->id = image_dir->load_current++;
+        }
+        return image;
+    }
+
+    if (image_dir->loader != NULL) {
+        return image_loader_next(image_dir);
+    }
+
+    if (image_dir->io != NULL) {
+        return image_io_load_next(image_dir);
+    }
+
+    if (image_dir->watch != NULL) {
+        return image_watch_next(image_dir);
     }
 
-    if (access(buffer, F_OK) < 0) {
+    if (image_dir->cache != NULL) {
+        return image_cache_next(image_dir);
+    }
+
+    image_load_t load = image_dir_find(image_dir, image_dir->load_current, buffer, buffer_size);
+    if (load == NULL) {
         if (image_dir->load_current == 0) {
             LOG_ERROR("no image found in directory `%s`", image_dir->input_dir_name);
         }
         goto fail_exit;
     }
 
-    image_t* image = image_create_from_png(buffer);
+    image_t* image = load(buffer);
     if (image == NULL) {
         goto fail_exit;
     }
@@ -329,27 +618,68 @@ fail_exit:
     return NULL;
 }
 
+int image_dir_output_name(image_dir_t* image_dir, size_t id, char* buffer, size_t buffer_size) {
+    int count = snprintf(buffer, buffer_size, "%s/%s-%04ld.%s", image_dir->output_dir_name, image_dir->save_prefix,
+                         id, image_formats[image_dir->output_format].extension);
+    if (count >= buffer_size - 1) {
+        LOG_ERROR("buffer too small");
+        return -1;
+    }
+
+    return 0;
+}
+
 int image_dir_save(image_dir_t* image_dir, image_t* image) {
     const size_t buffer_size = 256;
     char buffer[buffer_size];
 
-    int count =
-        snprintf(buffer, buffer_size, "%s/%s-%04ld.png", image_dir->output_dir_name, image_dir->save_prefix, image->id);
-    if (count >= buffer_size - 1) {
-        LOG_ERROR("buffer too small");
+    if (image_dir->hooks != NULL) {
+        return image_dir->hooks->save(image_dir, image);
+    }
+
+    if (image_dir_output_name(image_dir, image->id, buffer, buffer_size) < 0) {
         goto fail_exit;
     }
 
-    if (image_save_png(image, buffer) < 0) {
+    if (image_dir->io != NULL) {
+        return image_io_save(image_dir, image, buffer);
+    }
+
+    if (image_formats[image_dir->output_format].save(image, buffer) < 0) {
         goto fail_exit;
     }
 
+    if (image_dir->cache != NULL) {
+        image_cache_saved(image_dir, image->id, buffer);
+    }
+
+    if (image_dir->watch != NULL) {
+        image_watch_saved(image_dir, image->id);
+    }
+
     return 0;
 
 fail_exit:
     return -1;
 }
 
+void image_dir_drop(image_dir_t* image_dir, size_t id) {
+    if (image_dir->hooks != NULL) {
+        if (image_dir->hooks->drop != NULL) {
+            image_dir->hooks->drop(image_dir, id);
+        }
+        return;
+    }
+
+    if (image_dir->cache != NULL) {
+        image_cache_dropped(image_dir, id);
+    }
+
+    if (image_dir->watch != NULL) {
+        image_watch_dropped(image_dir, id);
+    }
+}
+
 void image_dir_reset(image_dir_t* image_dir, const char* input_dir_name, const char* output_dir_name,
                      const char* save_prefix) {
     image_dir->input_dir_name  = input_dir_name;
@@ -0,0 +1,68 @@
+#include <string.h>
+#include <time.h>
+
+#include "latency.h"
+
+/*
+ * values below LATENCY_SUB_BUCKETS have a bucket each, above that a value whose highest bit is e falls in one of
+ * the LATENCY_SUB_BUCKETS buckets splitting [2^e, 2^(e+1)) evenly
+ */
+
+#define SUB_BITS 5 /* log2(LATENCY_SUB_BUCKETS) */
+
+static size_t bucket_index(uint64_t ns) {
+    if (ns < LATENCY_SUB_BUCKETS) {
+        return ns;
+    }
+
+    int e = 63 - __builtin_clzll(ns);
+    return (e - SUB_BITS + 1) * LATENCY_SUB_BUCKETS + ((ns >> (e - SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/* the largest value of the bucket */
+
+static uint64_t bucket_upper(size_t index) {
+    if (index < LATENCY_SUB_BUCKETS) {
+        return index;
+    }
+
+    int shift      = index / LATENCY_SUB_BUCKETS - 1;
+    uint64_t lower = (uint64_t)(LATENCY_SUB_BUCKETS + index % LATENCY_SUB_BUCKETS) << shift;
+    return lower + ((uint64_t)1 << shift) - 1;
+}
+
+uint64_t latency_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void latency_reset(latency_histogram_t* histogram) {
+    memset(histogram, 0, sizeof(*histogram));
+}
+
+void latency_add(latency_histogram_t* histogram, uint64_t ns) {
+    histogram->counts[bucket_index(ns)]++;
+    histogram->count++;
+    if (ns > histogram->max) {
+        histogram->max = ns;
+    }
+}
+
+double latency_percentile_ms(const latency_histogram_t* histogram, unsigned int p) {
+    if (histogram->count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (histogram->count * p + 99) / 100;
+    uint64_t seen = 0;
+    size_t index  = 0;
+
+    rank = (rank == 0) ? 1 : rank;
+    while (seen + histogram->counts[index] < rank) {
+        seen += histogram->counts[index++];
+    }
+
+    uint64_t upper = bucket_upper(index);
+    return ((upper < histogram->max) ? upper : histogram->max) / 1e6;
+}
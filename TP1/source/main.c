@@ -2,13 +2,16 @@
 
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "filter.h"
 #include "image.h"
 #include "log.h"
 #include "pipeline.h"
+#include "stats.h"
 
 static void show_help(FILE* f, const char* exec_name) {
     fprintf(f, "Usage: %s [OPTION]...\n", exec_name);
@@ -17,7 +20,26 @@ static void show_help(FILE* f, const char* exec_name) {
     fprintf(f, "  --directory PATH                path to read images\n");
     fprintf(f, "  --out PATH                      path to write images\n");
     fprintf(f, "  --quiet                         don't print anything\n");
-    fprintf(f, "  --pipeline [serial|pthread|tbb] pipeline algorithm to use\n");
+    fprintf(f, "  --pipeline [serial|pthread|tbb|steal] pipeline algorithm to use\n");
+    fprintf(f, "  --filters LIST                  filters applied to every image, comma separated (default: %s)\n",
+            FILTER_CHAIN_DEFAULT);
+    fprintf(f, "                                  scale_up[:N] sobel sharpen edge_identity edge_detect box_blur\n");
+    fprintf(f, "                                  gaussian_blur to_hsv to_rgb add_pixel:R:G:B desaturate\n");
+    fprintf(f, "                                  horizontal_flip vertical_flip\n");
+    fprintf(f, "  --filter-impl [scalar|sse|avx2] row kernels for the sobel and 3x3 convolution filters\n");
+    fprintf(f, "  --tbb-grain ROWS                split frames in bands of ROWS rows in the tbb pipeline\n");
+    fprintf(f, "  --max-inflight-mb N             bound the memory of the images in flight instead of their number\n");
+    fprintf(f, "  --load-threads N                decode the next images on N threads ahead of the pipeline\n");
+    fprintf(f, "  --output-format [png|qoi|raw]   format of the written images (default: png)\n");
+    fprintf(f, "  --async-io [uring|threads]      read ahead and write the files in the background\n");
+    fprintf(f, "  --io-depth N                    input files read ahead by --async-io (default: 8)\n");
+    fprintf(f, "  --watch                         wait for the next frames to be written until CTRL+C\n");
+    fprintf(f, "  --listen PATH                   process the frames sent on a unix socket until CTRL+C\n");
+    fprintf(f, "  --cache PATH                    reuse the outputs of the frames already processed, kept in PATH\n");
+    fprintf(f, "  --png-level [0-9]               zlib compression level of the saved images\n");
+    fprintf(f, "  --png-filter [none|sub|up|avg|paeth|all] row filters tried by the png encoder, comma separated\n");
+    fprintf(f, "  --png-threads N                 threads compressing each saved image\n");
+    fprintf(f, "  --stats [table|json]            print per stage timings and image latencies at the end\n");
 }
 
 static void fail_missing_argument(const char* exec_name, const char* opt) {
@@ -38,13 +60,118 @@ static void fail_unknown_pipeline_algorithm(const char* exec_name, const char* a
     exit(1);
 }
 
+static void fail_unknown_filter_impl(const char* exec_name, const char* arg) {
+    fprintf(stderr, "%s: unrecognized argument '%s' for option `--filter-impl`\n", exec_name, arg);
+    fprintf(stderr, "Try '%s --help' for more information.\n", exec_name);
+    exit(1);
+}
+
+static void fail_unsupported_filter_impl(const char* exec_name, const char* arg) {
+    fprintf(stderr, "%s: filter implementation '%s' is not supported by this CPU\n", exec_name, arg);
+    exit(1);
+}
+
+static void fail_invalid_filters(const char* exec_name, const char* arg) {
+    fprintf(stderr, "%s: invalid filter chain '%s' for option `--filters`\n", exec_name, arg);
+    fprintf(stderr, "Try '%s --help' for more information.\n", exec_name);
+    exit(1);
+}
+
+static void fail_invalid_number(const char* exec_name, const char* opt, const char* arg) {
+    fprintf(stderr, "%s: invalid number '%s' for option `%s`\n", exec_name, arg, opt);
+    fprintf(stderr, "Try '%s --help' for more information.\n", exec_name);
+    exit(1);
+}
+
+static size_t parse_size(const char* exec_name, const char* opt, const char* arg) {
+    char* end;
+
+    errno               = 0;
+    unsigned long value = strtoul(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || arg[0] == '-') {
+        fail_invalid_number(exec_name, opt, arg);
+    }
+
+    return value;
+}
+
+static void fail_unknown_output_format(const char* exec_name, const char* arg) {
+    fprintf(stderr, "%s: unrecognized argument '%s' for option `--output-format`\n", exec_name, arg);
+    fprintf(stderr, "Try '%s --help' for more information.\n", exec_name);
+    exit(1);
+}
+
+static void fail_unknown_async_io(const char* exec_name, const char* arg) {
+    fprintf(stderr, "%s: unrecognized argument '%s' for option `--async-io`\n", exec_name, arg);
+    fprintf(stderr, "Try '%s --help' for more information.\n", exec_name);
+    exit(1);
+}
+
+static void fail_unknown_png_filter(const char* exec_name, const char* arg) {
+    fprintf(stderr, "%s: unrecognized argument '%s' for option `--png-filter`\n", exec_name, arg);
+    fprintf(stderr, "Try '%s --help' for more information.\n", exec_name);
+    exit(1);
+}
+
+static int parse_png_filters(const char* exec_name, const char* arg) {
+    static const struct {
+        const char* name;
+        int filter;
+    } names[] = {
+        {"none", IMAGE_PNG_FILTER_NONE}, {"sub", IMAGE_PNG_FILTER_SUB},     {"up", IMAGE_PNG_FILTER_UP},
+        {"avg", IMAGE_PNG_FILTER_AVG},   {"paeth", IMAGE_PNG_FILTER_PAETH}, {"all", IMAGE_PNG_FILTER_ALL},
+    };
+
+    int filters       = 0;
+    const char* token = arg;
+
+    while (1) {
+        size_t length = strcspn(token, ",");
+        size_t k      = 0;
+
+        while (k < sizeof(names) / sizeof(names[0]) &&
+               (strlen(names[k].name) != length || strncmp(names[k].name, token, length) != 0)) {
+            k++;
+        }
+        if (k == sizeof(names) / sizeof(names[0])) {
+            fail_unknown_png_filter(exec_name, arg);
+        }
+
+        filters |= names[k].filter;
+        if (token[length] == '\0') {
+            return filters;
+        }
+        token += length + 1;
+    }
+}
+
+static void fail_watch_conflict(const char* exec_name) {
+    fprintf(stderr, "%s: option `--watch` can't be combined with `--load-threads` or `--async-io`\n", exec_name);
+    fprintf(stderr, "Try '%s --help' for more information.\n", exec_name);
+    exit(1);
+}
+
+static void fail_listen_conflict(const char* exec_name) {
+    fprintf(stderr, "%s: option `--listen` can't be combined with `--watch`, `--load-threads` or `--async-io`\n",
+            exec_name);
+    fprintf(stderr, "Try '%s --help' for more information.\n", exec_name);
+    exit(1);
+}
+
+static void fail_cache_conflict(const char* exec_name) {
+    fprintf(stderr, "%s: option `--cache` can't be combined with `--listen`, `--watch`, `--load-threads` or "
+                    "`--async-io`\n", exec_name);
+    fprintf(stderr, "Try '%s --help' for more information.\n", exec_name);
+    exit(1);
+}
+
 static void fail_multiple_pipeline(const char* exec_name) {
     fprintf(stderr, "%s: zero or one option `--pipeline` must be specified\n", exec_name);
     fprintf(stderr, "Try '%s --help' for more information.\n", exec_name);
     exit(1);
 }
 
-static image_dir_t image_dir = {.load_current = 0, .stop = false};
+static image_dir_t image_dir = {.load_current = 0, .stop = false, .output_format = IMAGE_FORMAT_PNG};
 
 static void sigint_handler(int sig) {
     printf("\n\rSIGINT received, stopping pipeline\n");
@@ -63,16 +190,30 @@ __attribute__((weak)) int pipeline_tbb(image_dir_t* image_dir) {
     return -1;
 }
 
+__attribute__((weak)) int pipeline_steal(image_dir_t* image_dir) {
+    return -1;
+}
+
 int main(int argc, char* argv[]) {
     char* exec_name           = argv[0];
     bool use_pipeline_serial  = false;
     bool use_pipeline_pthread = false;
     bool use_pipeline_tbb     = false;
+    bool use_pipeline_steal   = false;
     int use_pipeline_count    = 0;
     char* input_dir_name;
     char* output_dir_name;
-    bool quiet = false;
+    bool quiet                    = false;
+    size_t load_threads           = 1;
+    image_io_backend_t io_backend = IMAGE_IO_SYNC;
+    size_t io_depth               = 8;
+    bool watch                    = false;
+    const char* listen_path       = NULL;
+    const char* cache_dir_name    = NULL;
+    bool stats                    = false;
+    stats_format_t stats_format   = STATS_TABLE;
 
+    input_dir_name  = NULL;
     output_dir_name = NULL;
 
     for (int i = 1; i < argc; i++) {
@@ -103,11 +244,168 @@ int main(int argc, char* argv[]) {
             } else if (strcmp("tbb", argv[i + 1]) == 0) {
                 use_pipeline_tbb = true;
                 use_pipeline_count++;
+            } else if (strcmp("steal", argv[i + 1]) == 0) {
+                use_pipeline_steal = true;
+                use_pipeline_count++;
             } else {
                 fail_unknown_pipeline_algorithm(exec_name, argv[i + 1]);
             }
 
             i++;
+        } else if (strcmp("--filters", argv[i]) == 0) {
+            if (i + 1 >= argc) {
+                fail_missing_argument(exec_name, argv[i]);
+            }
+
+            filter_chain_destroy(pipeline_options.filters);
+            pipeline_options.filters = filter_chain_parse(argv[i + 1]);
+            if (pipeline_options.filters == NULL) {
+                fail_invalid_filters(exec_name, argv[i + 1]);
+            }
+
+            i++;
+        } else if (strcmp("--filter-impl", argv[i]) == 0) {
+            if (i + 1 >= argc) {
+                fail_missing_argument(exec_name, argv[i]);
+            }
+
+            filter_impl_t filter_impl;
+            if (strcmp("scalar", argv[i + 1]) == 0) {
+                filter_impl = FILTER_IMPL_SCALAR;
+            } else if (strcmp("sse", argv[i + 1]) == 0) {
+                filter_impl = FILTER_IMPL_SSE;
+            } else if (strcmp("avx2", argv[i + 1]) == 0) {
+                filter_impl = FILTER_IMPL_AVX2;
+            } else {
+                fail_unknown_filter_impl(exec_name, argv[i + 1]);
+            }
+
+            if (filter_set_impl(filter_impl) < 0) {
+                fail_unsupported_filter_impl(exec_name, argv[i + 1]);
+            }
+
+            i++;
+        } else if (strcmp("--tbb-grain", argv[i]) == 0) {
+            if (i + 1 >= argc) {
+                fail_missing_argument(exec_name, argv[i]);
+            }
+
+            pipeline_options.tbb_grain_size = parse_size(exec_name, argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp("--max-inflight-mb", argv[i]) == 0) {
+            if (i + 1 >= argc) {
+                fail_missing_argument(exec_name, argv[i]);
+            }
+
+            size_t megabytes = parse_size(exec_name, argv[i], argv[i + 1]);
+            if (megabytes == 0 || megabytes > SIZE_MAX >> 20) {
+                fail_invalid_number(exec_name, argv[i], argv[i + 1]);
+            }
+
+            pipeline_options.max_inflight_bytes = megabytes << 20;
+            i++;
+        } else if (strcmp("--load-threads", argv[i]) == 0) {
+            if (i + 1 >= argc) {
+                fail_missing_argument(exec_name, argv[i]);
+            }
+
+            load_threads = parse_size(exec_name, argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp("--output-format", argv[i]) == 0) {
+            if (i + 1 >= argc) {
+                fail_missing_argument(exec_name, argv[i]);
+            }
+
+            if (strcmp("png", argv[i + 1]) == 0) {
+                image_dir.output_format = IMAGE_FORMAT_PNG;
+            } else if (strcmp("qoi", argv[i + 1]) == 0) {
+                image_dir.output_format = IMAGE_FORMAT_QOI;
+            } else if (strcmp("raw", argv[i + 1]) == 0) {
+                image_dir.output_format = IMAGE_FORMAT_RAW;
+            } else {
+                fail_unknown_output_format(exec_name, argv[i + 1]);
+            }
+
+            i++;
+        } else if (strcmp("--async-io", argv[i]) == 0) {
+            if (i + 1 >= argc) {
+                fail_missing_argument(exec_name, argv[i]);
+            }
+
+            if (strcmp("uring", argv[i + 1]) == 0) {
+                io_backend = IMAGE_IO_URING;
+            } else if (strcmp("threads", argv[i + 1]) == 0) {
+                io_backend = IMAGE_IO_THREADS;
+            } else {
+                fail_unknown_async_io(exec_name, argv[i + 1]);
+            }
+
+            i++;
+        } else if (strcmp("--io-depth", argv[i]) == 0) {
+            if (i + 1 >= argc) {
+                fail_missing_argument(exec_name, argv[i]);
+            }
+
+            io_depth = parse_size(exec_name, argv[i], argv[i + 1]);
+            if (io_depth == 0) {
+                fail_invalid_number(exec_name, argv[i], argv[i + 1]);
+            }
+            i++;
+        } else if (strcmp("--watch", argv[i]) == 0) {
+            watch = true;
+        } else if (strcmp("--listen", argv[i]) == 0) {
+            if (i + 1 >= argc) {
+                fail_missing_argument(exec_name, argv[i]);
+            }
+
+            listen_path = argv[++i];
+        } else if (strcmp("--cache", argv[i]) == 0) {
+            if (i + 1 >= argc) {
+                fail_missing_argument(exec_name, argv[i]);
+            }
+
+            cache_dir_name = argv[++i];
+        } else if (strcmp("--png-level", argv[i]) == 0) {
+            if (i + 1 >= argc) {
+                fail_missing_argument(exec_name, argv[i]);
+            }
+
+            size_t level = parse_size(exec_name, argv[i], argv[i + 1]);
+            if (level > 9) {
+                fail_invalid_number(exec_name, argv[i], argv[i + 1]);
+            }
+
+            image_png_options.level = level;
+            i++;
+        } else if (strcmp("--png-filter", argv[i]) == 0) {
+            if (i + 1 >= argc) {
+                fail_missing_argument(exec_name, argv[i]);
+            }
+
+            image_png_options.filters = parse_png_filters(exec_name, argv[i + 1]);
+            i++;
+        } else if (strcmp("--png-threads", argv[i]) == 0) {
+            if (i + 1 >= argc) {
+                fail_missing_argument(exec_name, argv[i]);
+            }
+
+            image_png_options.threads = parse_size(exec_name, argv[i], argv[i + 1]);
+            if (image_png_options.threads == 0) {
+                fail_invalid_number(exec_name, argv[i], argv[i + 1]);
+            }
+            i++;
+        } else if (strcmp("--stats", argv[i]) == 0) {
+            stats = true;
+
+            /* the format is optional */
+
+            if (i + 1 < argc && strcmp("table", argv[i + 1]) == 0) {
+                stats_format = STATS_TABLE;
+                i++;
+            } else if (i + 1 < argc && strcmp("json", argv[i + 1]) == 0) {
+                stats_format = STATS_JSON;
+                i++;
+            }
         } else if (strcmp("--quiet", argv[i]) == 0) {
             quiet = true;
         } else if (strcmp("--help", argv[i]) == 0) {
@@ -122,6 +420,19 @@ int main(int argc, char* argv[]) {
         fail_multiple_pipeline(exec_name);
     }
 
+    if (watch && (load_threads > 1 || io_backend != IMAGE_IO_SYNC)) {
+        fail_watch_conflict(exec_name);
+    }
+
+    if (listen_path != NULL && (watch || load_threads > 1 || io_backend != IMAGE_IO_SYNC)) {
+        fail_listen_conflict(exec_name);
+    }
+
+    if (cache_dir_name != NULL &&
+        (listen_path != NULL || watch || load_threads > 1 || io_backend != IMAGE_IO_SYNC)) {
+        fail_cache_conflict(exec_name);
+    }
+
     if (use_pipeline_count == 0) {
         use_pipeline_serial = true;
     }
@@ -142,20 +453,71 @@ int main(int argc, char* argv[]) {
 
     printf("Starting image pipeline, press CTRL+C to stop loading images\n");
 
-    int ret;
+    const char* save_prefix;
+    int (*pipeline)(image_dir_t* image_dir);
     if (use_pipeline_serial) {
-        image_dir_reset(&image_dir, input_dir_name, output_dir_name, "serial");
-        pipeline_serial(&image_dir);
+        save_prefix = "serial";
+        pipeline    = pipeline_serial;
     } else if (use_pipeline_pthread) {
-        image_dir_reset(&image_dir, input_dir_name, output_dir_name, "pthread");
-        pipeline_pthread(&image_dir);
+        save_prefix = "pthread";
+        pipeline    = pipeline_pthread;
     } else if (use_pipeline_tbb) {
-        image_dir_reset(&image_dir, input_dir_name, output_dir_name, "tbb");
-        pipeline_tbb(&image_dir);
+        save_prefix = "tbb";
+        pipeline    = pipeline_tbb;
+    } else if (use_pipeline_steal) {
+        save_prefix = "steal";
+        pipeline    = pipeline_steal;
     } else {
         LOG_ERROR("no pipeline configured");
         exit(1);
     }
 
+    image_dir_reset(&image_dir, input_dir_name, output_dir_name, save_prefix);
+
+    if (image_dir_start_loaders(&image_dir, load_threads) < 0) {
+        exit(1);
+    }
+
+    if (image_dir_start_io(&image_dir, io_backend, io_depth) < 0) {
+        exit(1);
+    }
+
+    if (watch && image_dir_start_watch(&image_dir) < 0) {
+        exit(1);
+    }
+
+    if (pipeline_filters() == NULL) {
+        exit(1);
+    }
+
+    if (listen_path != NULL && image_dir_start_socket(&image_dir, listen_path, pipeline_filters()) < 0) {
+        exit(1);
+    }
+
+    if (cache_dir_name != NULL && image_dir_start_cache(&image_dir, cache_dir_name, pipeline_filters()) < 0) {
+        exit(1);
+    }
+
+    if (stats) {
+        stats_start(pipeline_filters());
+    }
+
+    int ret = pipeline(&image_dir);
+
+    image_dir_stop_watch(&image_dir);
+    image_dir_stop_cache(&image_dir);
+
+    if (listen_path != NULL) {
+        image_dir_stop_socket(&image_dir);
+    }
+
+    stats_report(stdout, stats_format, save_prefix);
+
+    image_dir_stop_loaders(&image_dir);
+
+    if (image_dir_stop_io(&image_dir) < 0) {
+        ret = -1;
+    }
+
     return (ret < 0) ? 1 : 0;
 }
@@ -1,157 +1,384 @@
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MAX_QUEUE_SIZE 10
+#define MAX_QUEUE_SIZE_BUDGET 256
+#define MAX_BATCH_SIZE 4
 #define MIN_NB_THREAD 4
+#define CONTROLLER_PERIOD_MS 10
+#define WORKER_POLL_MS 50
 
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdatomic.h>
 
-#include "filter.h"
+#include "budget.h"
+#include "filter-chain.h"
+#include "log.h"
 #include "pipeline.h"
 #include "queue.h"
+#include "stats.h"
 
-queue_t* image_loaded_queue;
-queue_t* image_scaled_queue;
-queue_t* image_sharpenned_queue;
-queue_t* image_sobelled_queue;
+/*
+ * each stage pops a batch of whatever is waiting in its input queue (up to MAX_BATCH_SIZE images), so a deep
+ * backlog is drained with one wakeup, while a shallow one is still handled one image at a time
+ *
+ * the end of the stream is a single NULL pushed after the last image, every thread that pops it pushes it
+ * back for its siblings and the last thread of the stage to exit forwards it to the next queue
+ *
+ * threads start spread round-robin over the stages, then the controller (the main thread) samples the input
+ * queues every CONTROLLER_PERIOD_MS and asks one thread of the least loaded stage to move to the stage with the
+ * largest backlog, a stage always keeps at least one thread, it waits for the period on a condition variable the
+ * last saver thread signals, so the end of the run is noticed at once
+ *
+ * there is one stage per stage of the filter chain followed by the saver, queues[s] is the input of stages[s]
+ *
+ * with --max-inflight-mb the loader reserves the footprint of every image in the budget before pushing it and
+ * the saver gives it back, the queues are then only a loose bound on the number of images
+ */
 
-_Atomic int image_loader_running;
-_Atomic int image_scaler_running;
-_Atomic int image_sharpenner_running;
-_Atomic int image_sobeller_running;
-_Atomic int image_saver_running;
+typedef struct stage {
+	queue_t* in;
+	queue_t* out;
+	size_t filter;                /* stage of the filter chain, the saver has none */
+	stats_stage_t stats;
+	_Atomic int running;          /* threads that did not see the end of stream yet */
+	_Atomic int threads;          /* threads assigned, kept for the report */
+	_Atomic int peak_threads;
+} stage_t;
 
-void *image_loader(void *arg) {
-	image_dir_t *image_dir = (image_dir_t *) arg;
-	while (1) {
-		image_t* image = image_dir_load_next(image_dir);
-        if (image == NULL) break;
+static const filter_chain_t* filters;
+static stage_t* stages;
+static queue_t** queues;
+static size_t* queues_used;
+static int nb_stages;
+static budget_t* budget;
+
+/* pending move requested by the controller, -1 when there is none */
+static _Atomic int move_from = -1;
+static _Atomic int move_to   = -1;
+static _Atomic int moves;
 
-		queue_push(image_loaded_queue, image);
+/* set by the last saver thread to exit, wakes the controller up */
+static pthread_mutex_t finished_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t finished_cond;
+static bool finished;
+
+/* a worker that can't wait on its queue anymore stops the run */
+static _Atomic bool failed;
+
+/* returns how many images to process, 0 can also mean the timeout expired, an error fails the run */
+static size_t pop_batch(queue_t* queue, image_t** images, bool* done) {
+	size_t count = queue_pop_many_timeout(queue, (void**) images, MAX_BATCH_SIZE, WORKER_POLL_MS);
+	if (count == 0 && errno != ETIMEDOUT) {
+		atomic_store(&failed, true);
+		*done = true;
+		return 0;
 	}
-	atomic_fetch_sub(&image_loader_running, 1);
 
-	if (atomic_load(&image_loader_running) == 0) {
-		int j = atomic_load(&image_scaler_running);
-		for (int i = 0; i < j; ++i) queue_push(image_loaded_queue, NULL);
+	for (size_t i = 0; i < count; ++i) {
+		if (images[i] == NULL) {
+			queue_push(queue, NULL);
+			*done = true;
+			return i;
+		}
 	}
-	
-	return 0;
+
+	return count;
 }
 
-void *image_scaler(void *arg) {
-	while (1) {
-		image_t* image = queue_pop(image_loaded_queue);
-        if (image == NULL && atomic_load(&image_loader_running) == 0) break;
-		else if (image == NULL) continue;
+/* decrements or increments a counter unless it is at the given floor, used so a stage is never emptied by a move */
+static bool add_above(_Atomic int* counter, int delta, int floor) {
+	int value = atomic_load(counter);
+	while (value > floor) {
+		if (atomic_compare_exchange_weak(counter, &value, value + delta)) {
+			return true;
+		}
+	}
+	return false;
+}
 
-		queue_push(image_scaled_queue, filter_scale_up(image, 2));
-		image_destroy(image);
+static int take_move(int s) {
+	int from = s;
+	if (!atomic_compare_exchange_strong(&move_from, &from, -1)) {
+		return s;
 	}
 
-	atomic_fetch_sub(&image_scaler_running, 1);
+	int to = atomic_load(&move_to);
 
-	if (atomic_load(&image_scaler_running) == 0) {
-		int j = atomic_load(&image_sharpenner_running);
-		for (int i = 0; i < j; ++i) queue_push(image_scaled_queue, NULL);
+	/* the source keeps one thread and a stage that already finished is not restarted */
+	if (!add_above(&stages[s].running, -1, 1)) {
+		return s;
+	}
+	if (!add_above(&stages[to].running, 1, 0)) {
+		atomic_fetch_add(&stages[s].running, 1);
+		return s;
 	}
 
-	return 0;
+	atomic_fetch_sub(&stages[s].threads, 1);
+	int threads = atomic_fetch_add(&stages[to].threads, 1) + 1;
+
+	int peak = atomic_load(&stages[to].peak_threads);
+	while (threads > peak && !atomic_compare_exchange_weak(&stages[to].peak_threads, &peak, threads)) {
+	}
+
+	atomic_fetch_add(&moves, 1);
+	return to;
 }
 
-void *image_sharpenner(void *arg) {
-	while (1) {
-		image_t* image = queue_pop(image_scaled_queue);
-        if (image == NULL && atomic_load(&image_scaler_running) == 0)	break;
-		else if (image == NULL) continue;
+static void process_batch(stage_t* stage, image_dir_t* image_dir, image_t** images, size_t count) {
+	if (stage->out == NULL) {
+		for (size_t i = 0; i < count; ++i) {
+			uint64_t begin = stats_now();
+			image_dir_save(image_dir, images[i]);
+			stats_busy(stage->stats, begin, 1);
+			stats_image_end(images[i]->id);
+			budget_release(budget, images[i]->id);
+			printf(".");
+			fflush(stdout);
+			image_destroy(images[i]);
+		}
+		return;
+	}
+
+	uint64_t begin = stats_now();
+	size_t filtered = 0;
+	for (size_t i = 0; i < count; ++i) {
+		size_t id = images[i]->id;
+		image_t* image = filter_chain_stage_apply(filters, stage->filter, images[i]);
+		image_destroy(images[i]);
 
-		queue_push(image_sharpenned_queue, filter_sharpen(image));
-		image_destroy(image);
+		if (image != NULL) {
+			images[filtered++] = image;
+		} else {
+			stats_image_drop(id);
+			image_dir_drop(image_dir, id);
+			budget_release(budget, id);
+		}
 	}
 
-	atomic_fetch_sub(&image_sharpenner_running, 1);
+	stats_busy(stage->stats, begin, count);
+
+	begin = stats_now();
+	queue_push_many(stage->out, (void**) images, filtered);
+	stats_blocked(stage->stats, begin);
+}
+
+typedef struct worker {
+	pthread_t thread;
+	image_dir_t* image_dir;
+	int stage;
+} worker_t;
+
+void *image_loader(void *arg) {
+	image_dir_t *image_dir = (image_dir_t *) arg;
+	while (1) {
+		uint64_t begin = stats_now();
+		image_t* image = image_dir_load_next(image_dir);
+		if (image == NULL) break;
+		stats_busy(STATS_LOAD, begin, 1);
+		stats_image_begin(image->id, begin);
 
-	if (atomic_load(&image_sharpenner_running) == 0) {
-		int j = atomic_load(&image_sobeller_running);
-		for (int i = 0; i < j; ++i) queue_push(image_sharpenned_queue, NULL);
+		begin = stats_now();
+		size_t footprint = filter_chain_footprint(filters, image->width, image->height);
+		if (budget_acquire(budget, image->id, footprint) < 0) {
+			image_destroy(image);
+			break;
+		}
+		queue_push(queues[0], image);
+		stats_blocked(STATS_LOAD, begin);
 	}
 
+	queue_push(queues[0], NULL);
 	return 0;
 }
 
-void *image_sobeller(void *arg) {
-	while (1) {
-		image_t* image = queue_pop(image_sharpenned_queue);
-        if (image == NULL && atomic_load(&image_sharpenner_running) == 0) break;
-		else if (image == NULL) continue;
-		
-		queue_push(image_sobelled_queue, filter_sobel(image));
-		image_destroy(image);
+void *stage_worker(void *arg) {
+	worker_t* worker = (worker_t *) arg;
+	image_t* images[MAX_BATCH_SIZE];
+	bool done = false;
+	int s = worker->stage;
+
+	while (!done) {
+		s = take_move(s);
+
+		uint64_t begin = stats_now();
+		size_t count = pop_batch(stages[s].in, images, &done);
+		stats_blocked(stages[s].stats, begin);
+
+		process_batch(&stages[s], worker->image_dir, images, count);
 	}
 
-	atomic_fetch_sub(&image_sobeller_running, 1);
+	if (atomic_load(&failed)) {
+		worker->image_dir->stop = true;
+	}
 
-	if (atomic_load(&image_sobeller_running) == 0) {
-		int j = atomic_load(&image_saver_running);
-		for (int i = 0; i < j; ++i) queue_push(image_sobelled_queue, NULL);
+	if (atomic_fetch_sub(&stages[s].running, 1) == 1) {
+		if (stages[s].out != NULL) {
+			queue_push(stages[s].out, NULL);
+		} else {
+			pthread_mutex_lock(&finished_mutex);
+			finished = true;
+			pthread_cond_signal(&finished_cond);
+			pthread_mutex_unlock(&finished_mutex);
+		}
 	}
 
 	return 0;
 }
 
-void *image_saver(void *arg) {
-	image_dir_t *image_dir = (image_dir_t *) arg;
-	while (1) {
-		image_t* image = queue_pop(image_sobelled_queue);
-		if (image == NULL && atomic_load(&image_sobeller_running) == 0) break;
-		else if (image == NULL) continue;
+static void controller_sample(void) {
+	if (atomic_load(&move_from) >= 0) {
+		return;
+	}
 
-		image_dir_save(image_dir, image);
-		printf(".");
-		fflush(stdout);
-		image_destroy(image);
+	int busiest = -1;
+	int idlest  = -1;
+	size_t* used = queues_used;
+
+	for (int s = 0; s < nb_stages; ++s) {
+		used[s] = queue_used(stages[s].in);
+
+		if (busiest < 0 || used[s] > used[busiest]) {
+			busiest = s;
+		}
 	}
 
-	atomic_fetch_sub(&image_saver_running, 1);
+	for (int s = 0; s < nb_stages; ++s) {
+		if (s != busiest && atomic_load(&stages[s].running) > 1 && (idlest < 0 || used[s] < used[idlest])) {
+			idlest = s;
+		}
+	}
 
-	return 0;
+	/* only react to a clear imbalance, otherwise threads would bounce between stages */
+	if (idlest < 0 || used[busiest] < MAX_QUEUE_SIZE / 2 || used[busiest] < used[idlest] + 2) {
+		return;
+	}
+
+	atomic_store(&move_to, busiest);
+	atomic_store(&move_from, idlest);
 }
 
 int pipeline_pthread(image_dir_t* image_dir) {
+	filters = pipeline_filters();
+	if (filters == NULL) {
+		return -1;
+	}
+
+	nb_stages = filter_chain_length(filters) + 1;
 	long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
-	unsigned int nb_threads = MAX(MIN_NB_THREAD, nprocs);
+	unsigned int nb_threads = MAX(MAX(MIN_NB_THREAD, nprocs), nb_stages);
 	pthread_t thread_loader;
-	pthread_t *threads = malloc(nb_threads * sizeof(pthread_t));
-
-	void *(*tasks[MIN_NB_THREAD])(void*) = {image_scaler, image_sharpenner, image_sobeller, image_saver};
-	_Atomic int *atomic_values[MIN_NB_THREAD] = {&image_scaler_running, &image_sharpenner_running, &image_sobeller_running, &image_saver_running};
-	image_loaded_queue = queue_create(MAX_QUEUE_SIZE);
-	image_scaled_queue = queue_create(MAX_QUEUE_SIZE);
-	image_sharpenned_queue = queue_create(MAX_QUEUE_SIZE);
-	image_sobelled_queue = queue_create(MAX_QUEUE_SIZE);
-	
-	atomic_fetch_add(&image_loader_running, 1);
-	pthread_create(&thread_loader, NULL, image_loader, image_dir);
+	worker_t *workers = calloc(nb_threads, sizeof(worker_t));
+	stages = calloc(nb_stages, sizeof(stage_t));
+	queues = calloc(nb_stages, sizeof(queue_t*));
+	queues_used = calloc(nb_stages, sizeof(size_t));
+	if (workers == NULL || stages == NULL || queues == NULL || queues_used == NULL) {
+		LOG_ERROR_ERRNO("calloc");
+		goto fail_free;
+	}
+
+	budget = budget_create(pipeline_options.max_inflight_bytes);
+	if (budget == NULL) {
+		goto fail_free;
+	}
+
+	size_t queue_size = (pipeline_options.max_inflight_bytes > 0) ? MAX_QUEUE_SIZE_BUDGET : MAX_QUEUE_SIZE;
+	for (int s = 0; s < nb_stages; ++s) {
+		queues[s] = queue_create(queue_size);
+		if (queues[s] == NULL) {
+			goto fail_destroy_queues;
+		}
+	}
 
-    int ID_task = 0;
+	for (int s = 0; s < nb_stages - 1; ++s) {
+		stages[s] = (stage_t) {.in = queues[s], .out = queues[s + 1], .filter = s, .stats = STATS_FILTER(s)};
+	}
+	stages[nb_stages - 1] = (stage_t) {.in = queues[nb_stages - 1], .out = NULL, .stats = STATS_SAVE};
+	atomic_store(&move_from, -1);
+	atomic_store(&moves, 0);
+	atomic_store(&failed, false);
+	finished = false;
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&finished_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	/* count every thread before starting any, otherwise a stage could forward the end of stream while one of its threads has not started yet */
 	for (int i = 0; i < nb_threads; ++i) {
-		ID_task = i % MIN_NB_THREAD;
-		atomic_fetch_add(atomic_values[ID_task], 1);
-		pthread_create(&threads[i], NULL, tasks[ID_task], image_dir);
+		workers[i].image_dir = image_dir;
+		workers[i].stage = i % nb_stages;
+		atomic_fetch_add(&stages[workers[i].stage].running, 1);
+		atomic_fetch_add(&stages[workers[i].stage].threads, 1);
+	}
+	for (int s = 0; s < nb_stages; ++s) {
+		atomic_store(&stages[s].peak_threads, atomic_load(&stages[s].threads));
 	}
 
+	pthread_create(&thread_loader, NULL, image_loader, image_dir);
+	for (int i = 0; i < nb_threads; ++i) {
+		pthread_create(&workers[i].thread, NULL, stage_worker, &workers[i]);
+	}
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+	pthread_mutex_lock(&finished_mutex);
+	while (!finished) {
+		deadline.tv_nsec += CONTROLLER_PERIOD_MS * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		if (pthread_cond_timedwait(&finished_cond, &finished_mutex, &deadline) == ETIMEDOUT) {
+			controller_sample();
+		}
+	}
+	pthread_mutex_unlock(&finished_mutex);
+
 	pthread_join(thread_loader, NULL);
 	for (int i = 0; i < nb_threads; ++i) {
-		pthread_join(threads[i], NULL);
+		pthread_join(workers[i].thread, NULL);
 	}
 
-	queue_destroy(image_loaded_queue);
-	queue_destroy(image_scaled_queue);
-	queue_destroy(image_sharpenned_queue);
-	queue_destroy(image_sobelled_queue);
+	pthread_cond_destroy(&finished_cond);
 
-	free(threads);
 	printf("\n");
-	return 0;
+	for (int s = 0; s < nb_stages; ++s) {
+		stats_threads(stages[s].stats, atomic_load(&stages[s].threads), atomic_load(&stages[s].peak_threads));
+	}
+	stats_thread_moves(atomic_load(&moves));
+
+	if (pipeline_options.max_inflight_bytes > 0) {
+		printf("peak in-flight footprint: %.1f MB\n", budget_peak(budget) / (1024.0 * 1024.0));
+	}
+
+	for (int s = 0; s < nb_stages; ++s) {
+		queue_destroy(queues[s]);
+	}
+	budget_destroy(budget);
+
+	free(queues_used);
+	free(queues);
+	free(stages);
+	free(workers);
+	return atomic_load(&failed) ? -1 : 0;
+
+fail_destroy_queues:
+	for (int s = 0; s < nb_stages && queues[s] != NULL; ++s) {
+		queue_destroy(queues[s]);
+	}
+	budget_destroy(budget);
+fail_free:
+	free(queues_used);
+	free(queues);
+	free(stages);
+	free(workers);
+	return -1;
 }
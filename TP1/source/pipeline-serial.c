@@ -2,38 +2,66 @@
 
 #include <stdio.h>
 
-#include "filter.h"
+#include "filter-chain.h"
 #include "pipeline.h"
+#include "stats.h"
+
+/* the fused filters have no boundary between the stages to time, with --stats the stages run one after the other */
+
+static image_t* apply_filters(const filter_chain_t* filters, image_t* image) {
+    if (!stats_enabled()) {
+        return filter_chain_apply(filters, image);
+    }
+
+    image_t* current = image;
+    for (size_t s = 0; s < filter_chain_length(filters); s++) {
+        uint64_t begin = stats_now();
+        image_t* next  = filter_chain_stage_apply(filters, s, current);
+        stats_busy(STATS_FILTER(s), begin, 1);
+
+        if (current != image) {
+            image_destroy(current);
+        }
+        if (next == NULL) {
+            return NULL;
+        }
+        current = next;
+    }
+
+    return current;
+}
 
 int pipeline_serial(image_dir_t* image_dir) {
+    const filter_chain_t* filters = pipeline_filters();
+    if (filters == NULL) {
+        goto fail_exit;
+    }
+
     while (1) {
+        uint64_t begin  = stats_now();
         image_t* image1 = image_dir_load_next(image_dir);
         if (image1 == NULL) {
             break;
         }
+        stats_busy(STATS_LOAD, begin, 1);
+        stats_image_begin(image1->id, begin);
 
-        image_t* image2 = filter_scale_up(image1, 2);
+        size_t id       = image1->id;
+        image_t* image2 = apply_filters(filters, image1);
         image_destroy(image1);
         if (image2 == NULL) {
-            goto fail_exit;
+            stats_image_drop(id);
+            image_dir_drop(image_dir, id);
+            continue;
         }
 
-        image_t* image3 = filter_sharpen(image2);
-        image_destroy(image2);
-        if (image3 == NULL) {
-            goto fail_exit;
-        }
-
-        image_t* image4 = filter_sobel(image3);
-        image_destroy(image3);
-        if (image4 == NULL) {
-            goto fail_exit;
-        }
-
-        image_dir_save(image_dir, image4);
+        begin = stats_now();
+        image_dir_save(image_dir, image2);
+        stats_busy(STATS_SAVE, begin, 1);
+        stats_image_end(image2->id);
         printf(".");
         fflush(stdout);
-        image_destroy(image4);
+        image_destroy(image2);
     }
 
     printf("\n");
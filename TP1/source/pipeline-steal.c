@@ -0,0 +1,309 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "budget.h"
+#include "deque.h"
+#include "filter-chain.h"
+#include "log.h"
+#include "pipeline.h"
+#include "stats.h"
+
+/*
+ * work-stealing pipeline without TBB, every worker owns a deque of tasks where a task is one image and the next
+ * stage to run on it, after each stage the worker pushes the continuation on its own deque and pops it right
+ * back, so an image usually goes through every stage on the same core while its pixels are still in cache
+ *
+ * a worker without work steals the oldest task of another worker, and when no one has anything to steal it
+ * loads the next image itself, the number of images in flight is bounded by MAX_IN_FLIGHT_PER_THREAD per worker
+ *
+ * with --max-inflight-mb the bound is the footprint of the images instead, a loaded image that doesn't fit in
+ * the budget waits in `pending` until enough of the others are saved, workers never block on the budget
+ */
+
+#define MAX_IN_FLIGHT_PER_THREAD 2
+#define MAX_IN_FLIGHT_BUDGET 256
+#define IDLE_MIN_NS 50000L
+#define IDLE_MAX_NS 1000000L
+
+/* stage k < filter_chain_length() runs stage k of the filter chain, the last one saves the image */
+
+typedef struct task {
+    image_t* image;
+    size_t stage;
+} task_t;
+
+typedef struct worker {
+    pthread_t thread;
+    size_t index;
+    deque_t* deque;
+} worker_t;
+
+typedef struct steal_pipeline {
+    image_dir_t* image_dir;
+    const filter_chain_t* filters;
+    worker_t* workers;
+    size_t nb_workers;
+    size_t max_in_flight;
+    pthread_mutex_t load_mutex;
+    image_t* pending; /* loaded but not admitted yet, under load_mutex */
+    budget_t* budget;
+    atomic_bool loading_done;
+    atomic_size_t in_flight;
+} steal_pipeline_t;
+
+static steal_pipeline_t pipeline;
+
+static task_t* load_task(void) {
+    if (atomic_load(&pipeline.loading_done) || atomic_load(&pipeline.in_flight) >= pipeline.max_in_flight) {
+        return NULL;
+    }
+
+    /* image_dir_t is not thread-safe, only one worker loads at a time and the others keep stealing */
+
+    if (pthread_mutex_trylock(&pipeline.load_mutex) != 0) {
+        return NULL;
+    }
+
+    task_t* task = NULL;
+    if (atomic_load(&pipeline.loading_done)) {
+        goto unlock;
+    }
+
+    if (pipeline.pending == NULL) {
+        uint64_t begin   = stats_now();
+        pipeline.pending = image_dir_load_next(pipeline.image_dir);
+        if (pipeline.pending == NULL) {
+            atomic_store(&pipeline.loading_done, true);
+            goto unlock;
+        }
+        stats_busy(STATS_LOAD, begin, 1);
+        stats_image_begin(pipeline.pending->id, begin);
+    }
+
+    image_t* image   = pipeline.pending;
+    size_t footprint = filter_chain_footprint(pipeline.filters, image->width, image->height);
+    if (!budget_try_acquire(pipeline.budget, image->id, footprint)) {
+        goto unlock;
+    }
+
+    task = malloc(sizeof(*task));
+    if (task == NULL) {
+        LOG_ERROR_ERRNO("malloc");
+        budget_release(pipeline.budget, image->id);
+        goto unlock;
+    }
+
+    pipeline.pending = NULL;
+    task->image      = image;
+    task->stage = 0;
+    atomic_fetch_add(&pipeline.in_flight, 1);
+
+unlock:
+    pthread_mutex_unlock(&pipeline.load_mutex);
+    return task;
+}
+
+static task_t* steal_task(worker_t* self) {
+    for (size_t i = 1; i < pipeline.nb_workers; i++) {
+        worker_t* victim = &pipeline.workers[(self->index + i) % pipeline.nb_workers];
+
+        task_t* task = deque_steal(victim->deque);
+        if (task != NULL) {
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+static void finish_task(task_t* task, size_t id) {
+    if (task->image != NULL) {
+        image_destroy(task->image);
+    }
+    budget_release(pipeline.budget, id);
+    free(task);
+    atomic_fetch_sub(&pipeline.in_flight, 1);
+}
+
+static void run_task(worker_t* self, task_t* task) {
+    uint64_t begin = stats_now();
+
+    if (task->stage == filter_chain_length(pipeline.filters)) {
+        image_dir_save(pipeline.image_dir, task->image);
+        stats_busy(STATS_SAVE, begin, 1);
+        stats_image_end(task->image->id);
+        printf(".");
+        fflush(stdout);
+        finish_task(task, task->image->id);
+        return;
+    }
+
+    size_t id      = task->image->id;
+    image_t* image = filter_chain_stage_apply(pipeline.filters, task->stage, task->image);
+    stats_busy(STATS_FILTER(task->stage), begin, 1);
+
+    image_destroy(task->image);
+    task->image = image;
+
+    if (image == NULL) {
+        stats_image_drop(id);
+        image_dir_drop(pipeline.image_dir, id);
+        finish_task(task, id);
+        return;
+    }
+
+    task->stage++;
+
+    /* the deque holds every task in flight at most, so this only fails if that bound is broken */
+
+    if (deque_push(self->deque, task) < 0) {
+        run_task(self, task);
+    }
+}
+
+static void idle_wait(long* idle_ns) {
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = *idle_ns};
+    nanosleep(&ts, NULL);
+
+    *idle_ns = (*idle_ns * 2 > IDLE_MAX_NS) ? IDLE_MAX_NS : *idle_ns * 2;
+}
+
+static void* steal_worker(void* arg) {
+    worker_t* self = arg;
+    long idle_ns   = IDLE_MIN_NS;
+
+    while (1) {
+        task_t* task = deque_pop(self->deque);
+
+        if (task == NULL) {
+            task = steal_task(self);
+        }
+
+        if (task == NULL) {
+            task = load_task();
+        }
+
+        if (task == NULL) {
+            if (atomic_load(&pipeline.loading_done) && atomic_load(&pipeline.in_flight) == 0) {
+                break;
+            }
+
+            idle_wait(&idle_ns);
+            continue;
+        }
+
+        idle_ns = IDLE_MIN_NS;
+        run_task(self, task);
+    }
+
+    return NULL;
+}
+
+int pipeline_steal(image_dir_t* image_dir) {
+    long nprocs       = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nb_workers = (nprocs > 0) ? nprocs : 1;
+
+    pipeline.image_dir     = image_dir;
+    pipeline.filters       = pipeline_filters();
+    pipeline.nb_workers    = nb_workers;
+    pipeline.max_in_flight = MAX_IN_FLIGHT_PER_THREAD * nb_workers;
+    pipeline.pending       = NULL;
+    atomic_init(&pipeline.loading_done, false);
+    atomic_init(&pipeline.in_flight, 0);
+
+    if (pipeline.filters == NULL) {
+        goto fail_exit;
+    }
+
+    if (pipeline_options.max_inflight_bytes > 0) {
+        pipeline.max_in_flight = MAX_IN_FLIGHT_BUDGET;
+    }
+
+    pipeline.budget = budget_create(pipeline_options.max_inflight_bytes);
+    if (pipeline.budget == NULL) {
+        goto fail_exit;
+    }
+
+    errno = pthread_mutex_init(&pipeline.load_mutex, NULL);
+    if (errno != 0) {
+        LOG_ERROR_ERRNO("pthread_mutex_init");
+        goto fail_destroy_budget;
+    }
+
+    pipeline.workers = calloc(nb_workers, sizeof(*pipeline.workers));
+    if (pipeline.workers == NULL) {
+        LOG_ERROR_ERRNO("calloc");
+        goto fail_destroy_mutex;
+    }
+
+    size_t created = 0;
+    for (; created < nb_workers; created++) {
+        worker_t* worker = &pipeline.workers[created];
+        worker->index    = created;
+        worker->deque    = deque_create(pipeline.max_in_flight);
+        if (worker->deque == NULL) {
+            goto fail_destroy_deques;
+        }
+    }
+
+    /*
+     * the calling thread is worker 0, when a thread can't be created the running ones finish the images in flight,
+     * pipeline.nb_workers is left as is since they read it while stealing, the deques of the workers that never
+     * started stay empty
+     */
+
+    size_t started = 1;
+    bool failed    = false;
+    for (; started < nb_workers; started++) {
+        errno = pthread_create(&pipeline.workers[started].thread, NULL, steal_worker, &pipeline.workers[started]);
+        if (errno != 0) {
+            LOG_ERROR_ERRNO("pthread_create");
+            atomic_store(&pipeline.loading_done, true);
+            failed = true;
+            break;
+        }
+    }
+
+    steal_worker(&pipeline.workers[0]);
+
+    for (size_t i = 1; i < started; i++) {
+        pthread_join(pipeline.workers[i].thread, NULL);
+    }
+
+    for (size_t i = 0; i < pipeline.nb_workers; i++) {
+        deque_destroy(pipeline.workers[i].deque);
+    }
+    free(pipeline.workers);
+    pthread_mutex_destroy(&pipeline.load_mutex);
+
+    /* left over when a worker could not be created */
+
+    if (pipeline.pending != NULL) {
+        image_destroy(pipeline.pending);
+    }
+
+    printf("\n");
+    if (pipeline_options.max_inflight_bytes > 0) {
+        printf("peak in-flight footprint: %.1f MB\n", budget_peak(pipeline.budget) / (1024.0 * 1024.0));
+    }
+    budget_destroy(pipeline.budget);
+    return failed ? -1 : 0;
+
+fail_destroy_deques:
+    for (size_t i = 0; i < created; i++) {
+        deque_destroy(pipeline.workers[i].deque);
+    }
+    free(pipeline.workers);
+fail_destroy_mutex:
+    pthread_mutex_destroy(&pipeline.load_mutex);
+fail_destroy_budget:
+    budget_destroy(pipeline.budget);
+fail_exit:
+    return -1;
+}
@@ -1,71 +1,103 @@
 #define MIN_NB_THREAD 5
+#define MAX_TOKENS_BUDGET 256
 
 #include <stdio.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
 #include <tbb/pipeline.h>
 #include <thread>
 #include <algorithm>
 
 extern "C" {
-#include "filter.h"
+#include "filter-chain.h"
 #include "pipeline.h"
 #include "image.h"
+#include "stats.h"
+}
+
+// computes a band of output rows, the 3x3 kernels read their halo rows straight from the shared input image
+class rowsBody {
+    const filter_chain_t* chain;
+    size_t stage;
+    image_t* src;
+    image_t* dst;
+
+public:
+    rowsBody(const filter_chain_t* c, size_t st, image_t* s, image_t* d): chain(c), stage(st), src(s), dst(d) {}
+
+    void operator()(const tbb::blocked_range<size_t>& range) const {
+        filter_chain_stage_rows(chain, stage, src, dst, range.begin(), range.end());
+    }
+};
+
+// splits the frame in bands of pipeline_options.tbb_grain_size rows, or runs the whole stage when it is 0 or the
+// stage can't be split
+static image_t* apply_stage(const filter_chain_t* chain, size_t stage, image_t* img) {
+    size_t grain_size = pipeline_options.tbb_grain_size;
+    if (grain_size == 0 || !filter_chain_stage_has_rows(chain, stage)) {
+        return filter_chain_stage_apply(chain, stage, img);
+    }
+
+    size_t width, height;
+    if (!filter_chain_stage_size(chain, stage, img->width, img->height, &width, &height)) {
+        return nullptr;
+    }
+
+    image_t* new_img = image_create(img->id, width, height);
+    if (new_img != NULL) {
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, height, grain_size), rowsBody(chain, stage, img, new_img));
+    }
+    return new_img;
 }
 
 class loadFilter : public tbb::filter_t<void, image_t*> {
     image_dir_t* dir;
+    image_t** first; // loaded before the pipeline started, handed out first
 
 public:
-    loadFilter(image_dir_t* d): dir(d) {} // llist initialization of constant private member dir
+    loadFilter(image_dir_t* d, image_t** f): dir(d), first(f) {} // llist initialization of constant private member dir
 
     image_t* operator()(tbb::flow_control& fc) const {
+        if (*first) {
+            image_t* img = *first;
+            *first = nullptr;
+            return img;
+        }
+
+        uint64_t begin = stats_now();
         image_t* img = image_dir_load_next(dir);
         if (!img) {
             fc.stop();
             return nullptr;
         }
+        stats_busy(STATS_LOAD, begin, 1);
+        stats_image_begin(img->id, begin);
         return img;
     }
 };
 
-class scaleFilter : public tbb::filter_t<image_t*, image_t*> {
-
-public:
-    image_t* operator()(image_t* img) const {
-        // if (!img) {
-        //     fc.stop();
-        //     return nullptr;
-        // }
-
-        image_t* tempImg = filter_scale_up(img, 2);
-        image_destroy(img); // destroys original image
-        return tempImg;
-    }
-};
-
-class sharpenFilter : public tbb::filter_t<image_t*, image_t*> {
+// one stage of the filter chain, the pipeline is built with one of these per stage
+class chainFilter : public tbb::filter_t<image_t*, image_t*> {
+    image_dir_t* dir;
+    const filter_chain_t* chain;
+    size_t stage;
 
 public:
-    image_t* operator()(image_t* img) const {
-        // if (!img) {
-        //     fc.stop();
-        //     return nullptr;
-        // }
-
-        image_t* tempImg = filter_sharpen(img);
-        image_destroy(img); // destroys original image
-        return tempImg;
-    }
-};
+    chainFilter(image_dir_t* d, const filter_chain_t* c, size_t s): dir(d), chain(c), stage(s) {}
 
-class sobelFilter : public tbb::filter_t<image_t*, image_t*> {
-    public:
     image_t* operator()(image_t* img) const {
-        // if (!img) {
-        //     fc.stop(); 
-        //     return nullptr;
-        // }
+        // an image an earlier stage dropped
+        if (!img) {
+            return nullptr;
+        }
 
-        image_t* tempImg = filter_sobel(img);
+        uint64_t begin = stats_now();
+        image_t* tempImg = apply_stage(chain, stage, img);
+        stats_busy(STATS_FILTER(stage), begin, 1);
+        if (!tempImg) {
+            stats_image_drop(img->id);
+            image_dir_drop(dir, img->id);
+        }
         image_destroy(img); // destroys original image
         return tempImg;
     }
@@ -78,12 +110,15 @@ class saveFilter : public tbb::filter_t<image_t*, void>{
     saveFilter(image_dir_t* d): dir(d) {}
 
     void operator()(image_t* img) const {
-        // if (!img) {
-        //     fc.stop();
-        //     return;
-        // }
+        // an image a filter dropped, the other ones are still saved
+        if (!img) {
+            return;
+        }
 
+        uint64_t begin = stats_now();
         image_dir_save(dir, img);
+        stats_busy(STATS_SAVE, begin, 1);
+        stats_image_end(img->id);
         printf(".");
         fflush(stdout);
         image_destroy(img); // destroys original image
@@ -94,16 +129,39 @@ class saveFilter : public tbb::filter_t<image_t*, void>{
 
 
 int pipeline_tbb(image_dir_t* image_dir) {
+    const filter_chain_t* chain = pipeline_filters();
+    if (chain == nullptr) {
+        return -1;
+    }
+
+    size_t max_tokens = std::max(MIN_NB_THREAD, (int) std::thread::hardware_concurrency());
+    image_t* first = nullptr;
+
+    // a filter waiting for memory would stall the TBB thread that could free it, so --max-inflight-mb bounds the
+    // tokens instead, as many as footprints of the first image fit in the budget
+    if (pipeline_options.max_inflight_bytes > 0) {
+        uint64_t begin = stats_now();
+        first = image_dir_load_next(image_dir);
+        if (!first) {
+            printf("\n");
+            return 0;
+        }
+        stats_busy(STATS_LOAD, begin, 1);
+        stats_image_begin(first->id, begin);
+
+        size_t footprint = filter_chain_footprint(chain, first->width, first->height);
+        max_tokens = std::clamp(pipeline_options.max_inflight_bytes / footprint, (size_t) 1, (size_t) MAX_TOKENS_BUDGET);
+    }
 
     // tbb::filter_t myFilter = tbb::make_filter<Type1, Type2>(tbb::filter::mode, functor); where functor operator() maps Type1 to Type2
-    auto load_filter = tbb::make_filter<void, image_t*>(tbb::filter::serial_in_order, loadFilter(image_dir));
-    auto scale_filter = tbb::make_filter<image_t*, image_t*>(tbb::filter::parallel, scaleFilter());
-    auto sharpen_filter = tbb::make_filter<image_t*, image_t*>(tbb::filter::parallel, sharpenFilter());
-    auto sobel_filter = tbb::make_filter<image_t*, image_t*>(tbb::filter::parallel, sobelFilter());
+    tbb::filter_t<void, image_t*> filters = tbb::make_filter<void, image_t*>(tbb::filter::serial_in_order, loadFilter(image_dir, &first));
+    for (size_t stage = 0; stage < filter_chain_length(chain); stage++) {
+        chainFilter stage_filter(image_dir, chain, stage);
+        filters = filters & tbb::make_filter<image_t*, image_t*>(tbb::filter::parallel, stage_filter);
+    }
     auto save_filter = tbb::make_filter<image_t*, void>(tbb::filter::parallel, saveFilter(image_dir));
-    
-    size_t max_tokens = std::max(MIN_NB_THREAD, (int) std::thread::hardware_concurrency());
-    tbb::parallel_pipeline(max_tokens, load_filter & scale_filter & sharpen_filter & sobel_filter & save_filter);
+
+    tbb::parallel_pipeline(max_tokens, filters & save_filter);
 
     printf("\n");
     return 0;
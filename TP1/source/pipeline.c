@@ -0,0 +1,15 @@
+#include "pipeline.h"
+
+pipeline_options_t pipeline_options = {
+    .tbb_grain_size     = 0,
+    .filters            = NULL,
+    .max_inflight_bytes = 0,
+};
+
+const filter_chain_t* pipeline_filters(void) {
+    if (pipeline_options.filters == NULL) {
+        pipeline_options.filters = filter_chain_parse(FILTER_CHAIN_DEFAULT);
+    }
+
+    return pipeline_options.filters;
+}
@@ -1,45 +1,82 @@
-/* DO NOT EDIT THIS FILE */
-
-#include <assert.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "log.h"
 #include "queue.h"
 
+/*
+ * bounded ring buffer where each cell carries a sequence number (D. Vyukov's MPMC queue), producers and
+ * consumers claim a position with a CAS on tail/head and never take a lock
+ *
+ * the cell used by position pos holds 2 * pos while free and 2 * pos + 1 once written, doubling keeps the two
+ * states distinct from the next lap's free state even when the queue holds a single cell
+ *
+ * a thread only sleeps when the queue is full or empty, it then waits on a futex that is bumped after every
+ * pop or push (an eventcount), the waiter counters let the other side skip the wake syscall when nobody sleeps
+ */
+
+#define CACHE_LINE_SIZE 64
+
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+
+typedef struct queue_cell {
+    atomic_size_t sequence;
+    void* value;
+} queue_cell_t;
+
+typedef struct queue_event {
+    _Alignas(CACHE_LINE_SIZE) atomic_uint count;
+    atomic_uint waiters;
+} queue_event_t;
+
+struct queue {
+    size_t size;
+    queue_cell_t* cells;
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail;
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head;
+    queue_event_t pushed;
+    queue_event_t poped;
+};
+
 queue_t* queue_create(size_t size) {
-    queue_t* queue = calloc(sizeof(*queue), 1);
-    if (queue == NULL) {
-        LOG_ERROR_ERRNO("calloc");
+    if (size == 0) {
+        LOG_ERROR("queue size must be positive");
         goto fail_exit;
     }
 
-    queue->size = size;
-    queue->used = 0;
+    queue_t* queue = aligned_alloc(CACHE_LINE_SIZE, sizeof(*queue));
+    if (queue == NULL) {
+        LOG_ERROR_ERRNO("aligned_alloc");
+        goto fail_exit;
+    }
 
-    errno = pthread_mutex_init(&queue->mutex, NULL);
-    if (errno != 0) {
-        LOG_ERROR_ERRNO("pthread_mutex_init");
+    queue->size  = size;
+    queue->cells = calloc(size, sizeof(*queue->cells));
+    if (queue->cells == NULL) {
+        LOG_ERROR_ERRNO("calloc");
         goto fail_free_queue;
     }
 
-    errno = pthread_cond_init(&queue->modified_item_pushed, NULL);
-    if (errno != 0) {
-        LOG_ERROR_ERRNO("pthread_cond_init");
-        goto fail_destroy_mutex;
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&queue->cells[i].sequence, 2 * i);
     }
 
-    errno = pthread_cond_init(&queue->modified_item_poped, NULL);
-    if (errno != 0) {
-        LOG_ERROR_ERRNO("pthread_cond_init");
-        goto fail_destroy_cond;
-    }
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->pushed.count, 0);
+    atomic_init(&queue->pushed.waiters, 0);
+    atomic_init(&queue->poped.count, 0);
+    atomic_init(&queue->poped.waiters, 0);
 
     return queue;
 
-fail_destroy_cond:
-    pthread_cond_destroy(&queue->modified_item_pushed);
-fail_destroy_mutex:
-    pthread_mutex_destroy(&queue->mutex);
 fail_free_queue:
     free(queue);
 fail_exit:
@@ -47,117 +84,209 @@ fail_exit:
 }
 
 void queue_destroy(queue_t* queue) {
-    pthread_mutex_destroy(&queue->mutex);
-    pthread_cond_destroy(&queue->modified_item_pushed);
-    pthread_cond_destroy(&queue->modified_item_poped);
-
-    while (queue->head != NULL) {
-        queue_node_t* head = queue->head;
-        queue->head        = head->prev;
-        free(head);
-    }
-
+    free(queue->cells);
     free(queue);
 }
 
-int queue_push(queue_t* queue, void* ptr) {
-    queue_node_t* node = malloc(sizeof(*node));
-    if (node == NULL) {
-        LOG_ERROR_ERRNO("malloc");
-        goto fail_exit;
+static bool queue_try_push(queue_t* queue, void* ptr) {
+    size_t pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+    while (1) {
+        queue_cell_t* cell = &queue->cells[pos % queue->size];
+        size_t sequence    = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff      = (intptr_t)sequence - (intptr_t)(2 * pos);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->tail, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                cell->value = ptr;
+                atomic_store_explicit(&cell->sequence, 2 * pos + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            /* the cell still holds the item pushed one lap ago */
+            return false;
+        } else {
+            pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        }
     }
+}
 
-    errno = pthread_mutex_lock(&queue->mutex);
-    if (errno != 0) {
-        LOG_ERROR_ERRNO("pthread_mutex_lock");
-        goto fail_free_node;
+static bool queue_try_pop(queue_t* queue, void** ptr) {
+    size_t pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+    while (1) {
+        queue_cell_t* cell = &queue->cells[pos % queue->size];
+        size_t sequence    = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff      = (intptr_t)sequence - (intptr_t)(2 * pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->head, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                *ptr = cell->value;
+                atomic_store_explicit(&cell->sequence, 2 * (pos + queue->size), memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            /* the cell has not been written for this lap yet */
+            return false;
+        } else {
+            pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        }
     }
+}
+
+/* returns 1 when the absolute CLOCK_MONOTONIC deadline passed, deadline may be NULL to wait forever */
 
-    while (queue->used == queue->size) {
-        errno = pthread_cond_wait(&queue->modified_item_poped, &queue->mutex);
-        if (errno != 0) {
-            LOG_ERROR_ERRNO("pthread_cond_wait");
-            goto fail_unlock_mutex;
+static int queue_event_wait(queue_event_t* event, unsigned int count, const struct timespec* deadline) {
+    if (syscall(SYS_futex, &event->count, FUTEX_WAIT_BITSET_PRIVATE, count, deadline, NULL, FUTEX_BITSET_MATCH_ANY) <
+        0) {
+        if (errno == ETIMEDOUT) {
+            return 1;
+        }
+
+        if (errno != EAGAIN && errno != EINTR) {
+            LOG_ERROR_ERRNO("futex");
+            return -1;
         }
     }
 
-    node->value = ptr;
-    node->prev  = NULL;
+    return 0;
+}
 
-    if (queue->tail != NULL) {
-        queue->tail->prev = node;
-    }
+/* wakes up to `count` waiters, one per item pushed or poped */
 
-    queue->tail = node;
+static void queue_event_signal(queue_event_t* event, size_t count) {
+    atomic_fetch_add(&event->count, 1);
 
-    if (queue->used++ == 0) {
-        queue->head = node;
+    if (atomic_load(&event->waiters) > 0) {
+        int wake = (count > INT_MAX) ? INT_MAX : (int)count;
+        syscall(SYS_futex, &event->count, FUTEX_WAKE_PRIVATE, wake, NULL, NULL, 0);
     }
+}
 
-    errno = pthread_cond_broadcast(&queue->modified_item_pushed);
-    if (errno != 0) {
-        LOG_ERROR_ERRNO("pthread_cond_signal");
-        goto fail_exit;
-    }
+/* blocks until at least one item could be pushed, returns how many of ptrs[0..count) were pushed */
 
-    errno = pthread_mutex_unlock(&queue->mutex);
-    if (errno != 0) {
-        LOG_ERROR_ERRNO("pthread_mutex_lock");
-        goto fail_exit;
+static ssize_t queue_push_some(queue_t* queue, void** ptrs, size_t count) {
+    size_t pushed = 0;
+
+    while (1) {
+        while (pushed < count && queue_try_push(queue, ptrs[pushed])) {
+            pushed++;
+        }
+
+        if (pushed > 0) {
+            break;
+        }
+
+        /* register before checking again so that a pop in between either is seen or wakes us up */
+
+        atomic_fetch_add(&queue->poped.waiters, 1);
+        unsigned int event = atomic_load(&queue->poped.count);
+
+        if (queue_try_push(queue, ptrs[0])) {
+            atomic_fetch_sub(&queue->poped.waiters, 1);
+            pushed++;
+            continue;
+        }
+
+        int ret = queue_event_wait(&queue->poped, event, NULL);
+        atomic_fetch_sub(&queue->poped.waiters, 1);
+        if (ret < 0) {
+            return -1;
+        }
     }
 
-    return 0;
+    queue_event_signal(&queue->pushed, pushed);
+    return pushed;
+}
 
-fail_unlock_mutex:
-    pthread_mutex_unlock(&queue->mutex);
-fail_free_node:
-    free(node);
-fail_exit:
-    return -1;
+int queue_push(queue_t* queue, void* ptr) {
+    return (queue_push_some(queue, &ptr, 1) < 0) ? -1 : 0;
 }
 
-void* queue_pop(queue_t* queue) {
-    errno = pthread_mutex_lock(&queue->mutex);
-    if (errno != 0) {
-        LOG_ERROR_ERRNO("pthread_mutex_lock");
-        goto fail_exit;
-    }
+int queue_push_many(queue_t* queue, void** ptrs, size_t count) {
+    size_t pushed = 0;
 
-    while (queue->used == 0) {
-        errno = pthread_cond_wait(&queue->modified_item_pushed, &queue->mutex);
-        if (errno != 0) {
-            LOG_ERROR_ERRNO("pthread_cond_wait");
-            goto fail_unlock_mutex;
+    while (pushed < count) {
+        ssize_t ret = queue_push_some(queue, ptrs + pushed, count - pushed);
+        if (ret < 0) {
+            return -1;
         }
+        pushed += ret;
     }
 
-    queue_node_t* head = queue->head;
-    queue->head        = head->prev;
+    return 0;
+}
 
-    void* value = head->value;
-    free(head);
+static size_t queue_pop_some(queue_t* queue, void** ptrs, size_t max, const struct timespec* deadline) {
+    size_t poped = 0;
 
-    if (--queue->used == 0) {
-        queue->tail = NULL;
-        queue->head = NULL;
+    if (max == 0) {
+        return 0;
     }
 
-    errno = pthread_cond_broadcast(&queue->modified_item_poped);
-    if (errno != 0) {
-        LOG_ERROR_ERRNO("pthread_cond_signal");
-        goto fail_exit;
+    while (1) {
+        while (poped < max && queue_try_pop(queue, &ptrs[poped])) {
+            poped++;
+        }
+
+        if (poped > 0) {
+            break;
+        }
+
+        atomic_fetch_add(&queue->pushed.waiters, 1);
+        unsigned int event = atomic_load(&queue->pushed.count);
+
+        if (queue_try_pop(queue, &ptrs[0])) {
+            atomic_fetch_sub(&queue->pushed.waiters, 1);
+            poped++;
+            continue;
+        }
+
+        int ret = queue_event_wait(&queue->pushed, event, deadline);
+        atomic_fetch_sub(&queue->pushed.waiters, 1);
+        if (ret != 0) {
+            return 0;
+        }
     }
 
-    errno = pthread_mutex_unlock(&queue->mutex);
-    if (errno != 0) {
-        LOG_ERROR_ERRNO("pthread_mutex_lock");
-        goto fail_exit;
+    queue_event_signal(&queue->poped, poped);
+    return poped;
+}
+
+size_t queue_pop_many(queue_t* queue, void** ptrs, size_t max) {
+    return queue_pop_some(queue, ptrs, max, NULL);
+}
+
+size_t queue_pop_many_timeout(queue_t* queue, void** ptrs, size_t max, unsigned int timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
     }
 
-    return value;
+    return queue_pop_some(queue, ptrs, max, &deadline);
+}
 
-fail_unlock_mutex:
-    pthread_mutex_unlock(&queue->mutex);
-fail_exit:
-    return NULL;
+size_t queue_used(queue_t* queue) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+    /* both positions move concurrently, the value is only a hint */
+    return (tail > head) ? min(tail - head, queue->size) : 0;
+}
+
+void* queue_pop(queue_t* queue) {
+    void* ptr;
+
+    if (queue_pop_many(queue, &ptr, 1) == 0) {
+        return NULL;
+    }
+
+    return ptr;
 }
@@ -0,0 +1,269 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "id-map.h"
+#include "image-pool.h"
+#include "latency.h"
+#include "log.h"
+#include "stats.h"
+
+/*
+ * the stage counters are atomics any thread adds to, the load timestamps of the images in flight are kept by id
+ * and the latencies in a histogram, both behind a mutex that is only taken twice per image, so the memory used
+ * doesn't grow with the length of the run
+ */
+
+typedef struct stage_counters {
+    atomic_uint_fast64_t items;
+    atomic_uint_fast64_t busy_ns;
+    atomic_uint_fast64_t blocked_ns;
+    int threads; /* 0 unless stats_threads() was called */
+    int peak_threads;
+} stage_counters_t;
+
+/* set before the pipeline starts its threads and cleared after they are joined */
+static bool enabled;
+static uint64_t start_ns;
+static const filter_chain_t* chain;
+static stage_counters_t* stages;
+static size_t nb_stages;
+static bool threads_reported;
+static size_t thread_moves;
+static bool cache_reported;
+static size_t cache_hits;
+static size_t cache_misses;
+
+static pthread_mutex_t images_mutex = PTHREAD_MUTEX_INITIALIZER;
+static id_map_t begins; /* uint64_t by id, removed once the image is saved or dropped */
+static latency_histogram_t latencies;
+
+void stats_start(const filter_chain_t* filters) {
+    nb_stages = STATS_FILTERS + filter_chain_length(filters);
+    stages    = calloc(nb_stages, sizeof(*stages));
+    if (stages == NULL) {
+        LOG_ERROR_ERRNO("calloc");
+        return;
+    }
+
+    for (size_t s = 0; s < nb_stages; s++) {
+        atomic_init(&stages[s].items, 0);
+        atomic_init(&stages[s].busy_ns, 0);
+        atomic_init(&stages[s].blocked_ns, 0);
+    }
+
+    id_map_init(&begins, sizeof(uint64_t));
+    latency_reset(&latencies);
+
+    threads_reported = false;
+    thread_moves     = 0;
+    cache_reported   = false;
+    cache_hits       = 0;
+    cache_misses     = 0;
+    chain            = filters;
+    start_ns = latency_now();
+    enabled  = true;
+}
+
+bool stats_enabled(void) {
+    return enabled;
+}
+
+uint64_t stats_now(void) {
+    return enabled ? latency_now() : 0;
+}
+
+void stats_busy(stats_stage_t stage, uint64_t begin, size_t items) {
+    if (!enabled) {
+        return;
+    }
+
+    atomic_fetch_add_explicit(&stages[stage].items, items, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stages[stage].busy_ns, latency_now() - begin, memory_order_relaxed);
+}
+
+void stats_blocked(stats_stage_t stage, uint64_t begin) {
+    if (!enabled) {
+        return;
+    }
+
+    atomic_fetch_add_explicit(&stages[stage].blocked_ns, latency_now() - begin, memory_order_relaxed);
+}
+
+void stats_image_begin(size_t id, uint64_t begin) {
+    if (!enabled) {
+        return;
+    }
+
+    pthread_mutex_lock(&images_mutex);
+    uint64_t* value = id_map_put(&begins, id);
+    if (value != NULL) {
+        *value = begin;
+    }
+    pthread_mutex_unlock(&images_mutex);
+}
+
+void stats_image_end(size_t id) {
+    if (!enabled) {
+        return;
+    }
+
+    uint64_t end = latency_now();
+
+    pthread_mutex_lock(&images_mutex);
+    uint64_t* begin = id_map_get(&begins, id);
+    if (begin != NULL) {
+        latency_add(&latencies, end - *begin);
+        id_map_remove(&begins, id);
+    }
+    pthread_mutex_unlock(&images_mutex);
+}
+
+void stats_image_drop(size_t id) {
+    if (!enabled) {
+        return;
+    }
+
+    pthread_mutex_lock(&images_mutex);
+    id_map_remove(&begins, id);
+    pthread_mutex_unlock(&images_mutex);
+}
+
+void stats_threads(stats_stage_t stage, int threads, int peak_threads) {
+    if (!enabled) {
+        return;
+    }
+
+    stages[stage].threads      = threads;
+    stages[stage].peak_threads = peak_threads;
+    threads_reported           = true;
+}
+
+void stats_thread_moves(size_t moves) {
+    if (!enabled) {
+        return;
+    }
+
+    thread_moves     = moves;
+    threads_reported = true;
+}
+
+void stats_cache(size_t hits, size_t misses) {
+    if (!enabled) {
+        return;
+    }
+
+    cache_hits     = hits;
+    cache_misses   = misses;
+    cache_reported = true;
+}
+
+static double percentile_ms(unsigned int p) {
+    return latency_percentile_ms(&latencies, p);
+}
+
+static const char* stage_name(size_t s) {
+    switch (s) {
+    case STATS_LOAD:
+        return "load";
+    case STATS_SAVE:
+        return "save";
+    default:
+        return filter_chain_stage_name(chain, s - STATS_FILTERS);
+    }
+}
+
+/* the stages in the order an image goes through them */
+
+static size_t report_order(size_t i) {
+    if (i == 0) {
+        return STATS_LOAD;
+    }
+    return (i == nb_stages - 1) ? STATS_SAVE : STATS_FILTERS + i - 1;
+}
+
+void stats_report(FILE* file, stats_format_t format, const char* pipeline) {
+    if (!enabled) {
+        return;
+    }
+
+    int width = 5;
+    for (size_t s = 0; s < nb_stages; s++) {
+        int length = strlen(stage_name(s));
+        width      = (length > width) ? length : width;
+    }
+
+    double wall_s       = (latency_now() - start_ns) / 1e9;
+    size_t nb_latencies = latencies.count;
+    size_t nb_images    = nb_latencies + cache_hits;
+
+    double rate = (wall_s > 0) ? nb_images / wall_s : 0;
+
+    /* the pool counts since the start of the process, the run is all of it */
+    image_pool_stats_t pool = {0};
+    if (image_pool_default() != NULL) {
+        image_pool_get_stats(image_pool_default(), &pool);
+    }
+
+    if (format == STATS_JSON) {
+        fprintf(file, "{\"pipeline\": \"%s\", \"images\": %zu, \"wall_s\": %.6f, \"images_per_s\": %.3f, ",
+                pipeline, nb_images, wall_s, rate);
+        fprintf(file, "\"stages\": [");
+        for (size_t i = 0; i < nb_stages; i++) {
+            size_t s = report_order(i);
+            fprintf(file, "%s{\"name\": \"%s\", \"items\": %lu, \"busy_ms\": %.3f, \"blocked_ms\": %.3f",
+                    (i == 0) ? "" : ", ", stage_name(s), (unsigned long)atomic_load(&stages[s].items),
+                    atomic_load(&stages[s].busy_ns) / 1e6, atomic_load(&stages[s].blocked_ns) / 1e6);
+            if (stages[s].threads > 0) {
+                fprintf(file, ", \"threads\": %d, \"peak_threads\": %d", stages[s].threads, stages[s].peak_threads);
+            }
+            fprintf(file, "}");
+        }
+        fprintf(file, "], ");
+        if (threads_reported) {
+            fprintf(file, "\"thread_moves\": %zu, ", thread_moves);
+        }
+        if (cache_reported) {
+            fprintf(file, "\"cache\": {\"hits\": %zu, \"misses\": %zu}, ", cache_hits, cache_misses);
+        }
+        fprintf(file, "\"latency_ms\": {\"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f, \"max\": %.3f}, ",
+                percentile_ms(50), percentile_ms(95), percentile_ms(99), percentile_ms(100));
+        fprintf(file, "\"image_pool\": {\"allocated\": %zu, \"reused\": %zu, \"released\": %zu}}\n", pool.allocated,
+                pool.reused, pool.released);
+    } else {
+        fprintf(file, "%s: %zu images in %.3f s (%.2f images/s)\n", pipeline, nb_images, wall_s, rate);
+        fprintf(file, "%-*s %8s %12s %12s %12s", width, "stage", "items", "busy ms", "blocked ms", "ms/item");
+        fprintf(file, threads_reported ? " %12s\n" : "\n", "threads/peak");
+        for (size_t i = 0; i < nb_stages; i++) {
+            size_t s       = report_order(i);
+            uint64_t items = atomic_load(&stages[s].items);
+            double busy_ms = atomic_load(&stages[s].busy_ns) / 1e6;
+
+            fprintf(file, "%-*s %8lu %12.3f %12.3f %12.3f", width, stage_name(s), (unsigned long)items, busy_ms,
+                    atomic_load(&stages[s].blocked_ns) / 1e6, (items == 0) ? 0 : busy_ms / items);
+            if (threads_reported && stages[s].threads > 0) {
+                fprintf(file, " %8d/%-3d", stages[s].threads, stages[s].peak_threads);
+            } else if (threads_reported) {
+                fprintf(file, " %12s", "-");
+            }
+            fprintf(file, "\n");
+        }
+        if (threads_reported) {
+            fprintf(file, "thread moves: %zu\n", thread_moves);
+        }
+        if (cache_reported) {
+            fprintf(file, "cache: %zu hits, %zu misses\n", cache_hits, cache_misses);
+        }
+        fprintf(file, "latency ms: p50 %.3f, p95 %.3f, p99 %.3f, max %.3f\n", percentile_ms(50), percentile_ms(95),
+                percentile_ms(99), percentile_ms(100));
+        fprintf(file, "image pool: %zu buffers allocated, %zu reused, %zu released\n", pool.allocated, pool.reused,
+                pool.released);
+    }
+
+    free(stages);
+    id_map_destroy(&begins);
+    stages  = NULL;
+    enabled = false;
+}